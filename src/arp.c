@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -5,61 +6,316 @@
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
 #include <net/if.h>
 #include <sys/socket.h>
 #include <netpacket/packet.h>
 
+#include "vrrp_common.h"
+#include "cksum.h"
 #include "arp.h"
 
-//! @brief Send gratuituous ARP requset
-//! @param[in] ifidx The index of interface to send packet
+//! @brief Build a gratuituous ARP requset
+//! @param[out] pkt Where to build it
 //! @param[in] mac The src hwaddr
 //! @param[in] nw_ipaddr The src/dst ipaddr (in netwot byteorder)
+void garp_build(struct arppkt *pkt, const char *mac, uint32_t nw_ipaddr)
+{
+	memcpy(pkt->ethh.h_dest, BROADCAST_MAC, 6);
+	memcpy(pkt->ethh.h_source, mac, 6);
+	pkt->ethh.h_proto = htons(ETH_P_ARP);
+	pkt->arph.ar_hrd = htons(ARPHRD_ETHER);
+	pkt->arph.ar_pro = htons(ETH_P_IP);
+	pkt->arph.ar_hln = 6;
+	pkt->arph.ar_pln = 4;
+	pkt->arph.ar_op = htons(ARPOP_REQUEST);
+	memcpy(pkt->sha, mac, 6);
+	memcpy(pkt->sip, &nw_ipaddr, 4);
+	memcpy(pkt->dha, mac, 6);
+	memcpy(pkt->dip, &nw_ipaddr, 4);
+}
+
+//! @brief Build a neighbour advertisement
+//! @param[out] pkt Where to build it
+//! @param[in] mac The src hwaddr, also the target link-layer address
+//! @param[in] target The IPv6 address advertised, also the source address
+//! @param[in] dst_mac The dst hwaddr, NULL for all nodes
+//! @param[in] dst The IPv6 dst address, NULL for all nodes (ff02::1)
+//! @param[in] flags ND_NA_FLAG_* (in network byteorder)
+void na_build(struct napkt *pkt, const char *mac, const void *target,
+	const char *dst_mac, const void *dst, uint32_t flags)
+{
+	static const uint8_t all_nodes[16] = { 0xFF, 0x02, [15] = 0x01 };
+	if (!dst_mac) dst_mac = ALL_NODES_MAC;
+	if (!dst) dst = all_nodes;
+
+	memset(pkt, 0, sizeof(*pkt));
+	memcpy(pkt->ethh.h_dest, dst_mac, 6);
+	memcpy(pkt->ethh.h_source, mac, 6);
+	pkt->ethh.h_proto = htons(ETH_P_IPV6);
+	pkt->ip6h.ip6_flow = htonl(6 << 28);
+	pkt->ip6h.ip6_plen = htons(sizeof(*pkt) - offsetof(struct napkt, na));
+	pkt->ip6h.ip6_nxt = IPPROTO_ICMPV6;
+	pkt->ip6h.ip6_hlim = 255;
+	memcpy(&pkt->ip6h.ip6_src, target, 16);
+	memcpy(&pkt->ip6h.ip6_dst, dst, 16);
+	pkt->na.nd_na_type = ND_NEIGHBOR_ADVERT;
+	pkt->na.nd_na_flags_reserved = flags;
+	memcpy(&pkt->na.nd_na_target, target, 16);
+	pkt->opt.nd_opt_type = ND_OPT_TARGET_LINKADDR;
+	pkt->opt.nd_opt_len = 1;	// in units of 8 octets
+	memcpy(pkt->tlla, mac, 6);
+
+	// ICMPv6 checksum covers the pseudo header
+	struct {
+		uint8_t 	src[16];
+		uint8_t 	dst[16];
+		uint32_t 	len;
+		uint8_t 	zero[3];
+		uint8_t 	next;
+	} ps;
+	memset(&ps, 0, sizeof(ps));
+	memcpy(ps.src, target, 16);
+	memcpy(ps.dst, dst, 16);
+	ps.len = htonl(sizeof(*pkt) - offsetof(struct napkt, na));
+	ps.next = IPPROTO_ICMPV6;
+	struct cksum_vec vec[] = {
+		{ &ps, sizeof(ps) },
+		{ &pkt->na, sizeof(*pkt) - offsetof(struct napkt, na) },
+	};
+	uint16_t sum = in_cksumv(vec, 2);
+	memcpy(&pkt->na.nd_na_cksum, &sum, sizeof(sum));
+}
+
+//! @brief Order frames by family, then by VIP, then by MAC
+static int garp_cmp(const void *a, const void *b)
+{
+	const struct arp_resp_vip *x = &((const struct garp_frame *)a)->vip;
+	const struct arp_resp_vip *y = &((const struct garp_frame *)b)->vip;
+	if (x->family != y->family) return x->family - y->family;
+	int c = memcmp(x->addr6, y->addr6, AF_INET6 == x->family ? 16 : 4);
+	return c ? c : memcmp(x->vmac, y->vmac, sizeof(x->vmac));
+}
+
+//! @brief Send time one frame takes from the bucket
+static inline uint64_t garp_cost(const struct garp_engine *g)
+{
+	return NSEC_FROM_SEC(1) / g->sched.rate;
+}
+
+//! @brief Arm the timer for whatever the engine has to do next
+static void garp_arm(struct garp_engine *g, uint64_t now)
+{
+	int pending = 0;
+	for (int i = 0; i < g->num_of_frame && !pending; ++i) {
+		pending = (g->frames[i].left > 0);
+	}
+
+	uint64_t cost = garp_cost(g);
+	if (pending && g->cursor) {
+		// In the middle of a round, wait for the bucket
+		uint64_t wait = (g->credit < cost) ? cost - g->credit : 0;
+		reactor_timer_arm_at(&g->timer, now + wait);
+	} else if (pending) {
+		reactor_timer_arm_at(&g->timer,
+			g->round_at > now ? g->round_at : now);
+	} else if (g->sched.refresh_usec && g->num_of_frame) {
+		reactor_timer_arm_at(&g->timer, g->refresh_at);
+	} else {
+		reactor_timer_cancel(&g->timer);
+	}
+}
+
+//! @brief Send the given frames in as few syscalls as it takes
+static void garp_send(struct garp_engine *g, struct garp_frame **burst,
+	int n)
+{
+	struct mmsghdr msgs[GARP_BURST];
+	struct iovec iovs[GARP_BURST];
+	struct sockaddr_ll dst[2];
+
+	memset(dst, 0, sizeof(dst));
+	for (int i = 0; i < 2; ++i) {
+		dst[i].sll_family = PF_PACKET;
+		dst[i].sll_ifindex = g->ifidx;
+		dst[i].sll_halen = 6;
+	}
+	dst[0].sll_protocol = htons(ETH_P_ARP);
+	memcpy(dst[0].sll_addr, BROADCAST_MAC, 6);
+	dst[1].sll_protocol = htons(ETH_P_IPV6);
+	memcpy(dst[1].sll_addr, ALL_NODES_MAC, 6);
+
+	memset(msgs, 0, n * sizeof(msgs[0]));
+	for (int i = 0; i < n; ++i) {
+		iovs[i].iov_base = &burst[i]->pkt;
+		iovs[i].iov_len = burst[i]->len;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name =
+			&dst[AF_INET6 == burst[i]->vip.family];
+		msgs[i].msg_hdr.msg_namelen = sizeof(dst[0]);
+	}
+
+	int sent = 0;
+	while (sent < n) {
+		int ret = sendmmsg(g->fd, msgs + sent, n - sent, 0);
+		++g->tx_calls;
+		if (ret < 0) {
+			if (EINTR == errno) continue;
+			// They count as sent, the next round covers them
+			VRRPLOG("%d send garp:%s\n", g->ifidx,
+				strerror(errno));
+			break;
+		}
+		sent += ret;
+	}
+	g->tx_pkts += sent;
+	PROBE2(garp_tx, g->ifidx, sent);
+}
+
+//! @brief Send as much of the running round as the bucket allows
+static void garp_run(struct reactor_timer *t)
+{
+	struct garp_engine *g = t->arg;
+	uint64_t now = now_nsec();
+
+	if (g->sched.refresh_usec && g->num_of_frame && now >= g->refresh_at) {
+		for (int i = 0; i < g->num_of_frame; ++i) {
+			if (!g->frames[i].left) g->frames[i].left = 1;
+		}
+		g->refresh_at = now + NSEC_FROM_USEC(g->sched.refresh_usec);
+	}
+	if (!g->cursor) {
+		if (now < g->round_at) goto out;
+		g->round_at = now + NSEC_FROM_USEC(g->sched.interval_usec);
+	}
+
+	// The bucket holds at most one burst
+	uint64_t cost = garp_cost(g);
+	g->credit += now - g->credit_at;
+	if (g->credit > cost * GARP_BURST) g->credit = cost * GARP_BURST;
+	g->credit_at = now;
+
+	struct garp_frame *burst[GARP_BURST];
+	int n = 0;
+	int quota = g->credit / cost;
+	for (; g->cursor < g->num_of_frame && n < quota; ++g->cursor) {
+		struct garp_frame *f = &g->frames[g->cursor];
+		if (!f->left) continue;
+		--f->left;
+		burst[n++] = f;
+	}
+	if (n) garp_send(g, burst, n);
+	g->credit -= n * cost;
+	if (g->cursor == g->num_of_frame) g->cursor = 0;
+out:
+	garp_arm(g, now);
+}
+
+//! @brief Open the gratuitous ARP engine of an interface
+//! @param[out] g The engine
+//! @param[in] r The event loop it paces itself on
+//! @param[in] ifidx The interface index
+//! @param[in] sched The repeat schedule and the rate (copied)
 //! @retval 0 Success
 //! @retval -1 Failure
-int send_garp_request(int ifidx, const char *mac, uint32_t nw_ipaddr)
+int garp_open(struct garp_engine *g, struct reactor *r, int ifidx,
+	const struct garp_sched *sched)
 {
 	assert(ifidx > 0);
+	assert(sched->rate > 0);
+
+	memset(g, 0, sizeof(*g));
+	g->sched = *sched;
+	g->fd = socket(PF_PACKET, SOCK_RAW, 0);
+	if (g->fd < 0) {
+		VRRPLOG("open garp socket:%s\n", strerror(errno));
+		return -1;
+	}
 
-	int fd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ARP));
-	if (fd < 0) return -1;
-
-	struct sockaddr_ll ll;
-	memset(&ll, 0, sizeof(ll));
-	ll.sll_family = PF_PACKET;
-	ll.sll_ifindex = ifidx;
-	ll.sll_halen = 6;
-	memcpy(ll.sll_addr, BROADCAST_MAC, 6);
-
-	int bcast = 1;
-	int ret = setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &bcast, 
-		sizeof(bcast));
-	if (ret < 0) goto err;
-
-	struct arppkt pkt;
-	memcpy(pkt.ethh.h_dest, BROADCAST_MAC, 6);
-	memcpy(pkt.ethh.h_source, mac, 6);
-	pkt.ethh.h_proto = htons(ETH_P_ARP);
-	pkt.arph.ar_hrd=htons(ARPHRD_ETHER);
-	pkt.arph.ar_pro=htons(ETH_P_IP);
-	pkt.arph.ar_hln=6;
-        pkt.arph.ar_pln=4;
-        pkt.arph.ar_op=htons(ARPOP_REQUEST);
-	memcpy(pkt.sha, mac, 6);
-	//*((uint32_t *)pkt.sip) = nw_ipaddr;
-	*(pkt.sip) = nw_ipaddr;
-	memcpy(pkt.dha, mac, 6);
-	//*((uint32_t *)pkt.dip) = nw_ipaddr;
-	*(pkt.dip) = nw_ipaddr;
-
-	ret = sendto(fd, &pkt, sizeof(pkt), 0, (struct sockaddr *)&ll, 
-		sizeof(ll));
-	if (ret < 0) goto err;
-
-	close(fd);
+	g->ifidx = ifidx;
+
+	// A full bucket, the first burst leaves at once
+	g->credit = garp_cost(g) * GARP_BURST;
+	g->credit_at = now_nsec();
+	return reactor_timer_init(r, &g->timer, garp_run, g);
+}
+
+//! @brief Replace the set of VIPs announced on the interface
+//! @param[in] g The engine
+//! @param[in] vips The VIPs and the MACs they are announced with
+//! @param[in] num_of_vip Number of |vips|
+//! @note A pair that was already in the set keeps its schedule, a new
+//!	one is announced in the next |repeat| rounds, the first of them
+//!	starting right away.
+//! @retval 0 Success
+//! @retval -1 Failure, the old set is kept
+int garp_update(struct garp_engine *g, const struct arp_resp_vip *vips,
+	int num_of_vip)
+{
+	struct garp_frame *frames = NULL;
+	if (g->fd < 0) return -1;
+	if (num_of_vip) {
+		frames = malloc(num_of_vip * sizeof(*frames));
+		if (!frames) {
+			VRRPLOG("alloc garp frames:%s\n", strerror(errno));
+			return -1;
+		}
+	}
+	for (int i = 0; i < num_of_vip; ++i) {
+		struct garp_frame *f = &frames[i];
+		f->vip = vips[i];
+		if (AF_INET6 == f->vip.family) {
+			// Unsolicited, to all nodes
+			na_build(&f->pkt.na, f->vip.vmac, f->vip.addr6, NULL,
+				NULL, ND_NA_FLAG_ROUTER | ND_NA_FLAG_OVERRIDE);
+			f->len = sizeof(f->pkt.na);
+		} else {
+			garp_build(&f->pkt.arp, f->vip.vmac, f->vip.nw_ipaddr);
+			f->len = sizeof(f->pkt.arp);
+		}
+	}
+	qsort(frames, num_of_vip, sizeof(*frames), garp_cmp);
+
+	// Both sets are sorted, carry the schedule of pairs in both over
+	int fresh = 0;
+	for (int i = 0, j = 0; i < num_of_vip; ++i) {
+		int c = 1;
+		while (j < g->num_of_frame &&
+			(c = garp_cmp(&g->frames[j], &frames[i])) < 0)
+		{
+			++j;
+		}
+		if (j < g->num_of_frame && !c) {
+			frames[i].left = g->frames[j].left;
+		} else {
+			frames[i].left = g->sched.repeat;
+			++fresh;
+		}
+	}
+
+	free(g->frames);
+	g->frames = frames;
+	g->num_of_frame = num_of_vip;
+	g->cursor = 0;
+
+	uint64_t now = now_nsec();
+	if (fresh) g->round_at = now;
+	if (!g->refresh_at || g->refresh_at < now) {
+		g->refresh_at = now + NSEC_FROM_USEC(g->sched.refresh_usec);
+	}
+	garp_arm(g, now);
 	return 0;
-err:
-	close(fd);
-	return -1;
 }
 
+//! @brief Stop announcing and close the engine
+void garp_close(struct garp_engine *g)
+{
+	if (g->fd < 0) return;
+	reactor_timer_cancel(&g->timer);
+	close(g->fd);
+	g->fd = -1;
+	free(g->frames);
+	g->frames = NULL;
+	g->num_of_frame = 0;
+}
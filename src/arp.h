@@ -1,9 +1,21 @@
 #ifndef XTVRRPD_GARP_H
 #define XTVRRPD_GARP_H
+#include <stdint.h>
 #include <net/if_arp.h>
 #include <net/ethernet.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include "arp_responder.h"
+#include "reactor.h"
 
 #define BROADCAST_MAC "\xFF\xFF\xFF\xFF\xFF\xFF"
+#define ALL_NODES_MAC "\x33\x33\x00\x00\x00\x01"
+
+#define GARP_REPEAT_DFT		5	// rounds a new VIP is announced in
+#define GARP_INTERVAL_USEC_DFT	100000	// between the starts of rounds
+#define GARP_REFRESH_USEC_DFT	0	// announce everything again, 0 never
+#define GARP_RATE_DFT		10000	// frames per sec
+#define GARP_BURST		64	// frames per sendmmsg(), bucket depth
 
 /**
  * @brief A structure to implement ARP packet from layer 2.
@@ -17,6 +29,59 @@ struct arppkt {
 	char dip[4];
 };
 
-int send_garp_request(int ifidx, const char *mac, uint32_t nw_ipaddr);
+//! @brief An unsolicited neighbour advertisement, the IPv6 counterpart
+struct napkt {
+	struct ethhdr ethh;
+	struct ip6_hdr ip6h;
+	struct nd_neighbor_advert na;
+	struct nd_opt_hdr opt;
+	char tlla[6];
+} __attribute__((packed));
+
+//! @brief When and how fast gratuitous ARPs go out
+struct garp_sched {
+	int 		repeat;
+	uint32_t 	interval_usec;
+	uint32_t 	refresh_usec;
+	uint32_t 	rate;
+};
+
+//! @brief A prebuilt gratuitous ARP, or neighbour advertisement, of a VIP
+struct garp_frame {
+	struct arp_resp_vip vip;	// sort key
+	union {
+		struct arppkt 	arp;
+		struct napkt 	na;
+	} pkt;
+	int 		len;
+	int 		left;		// rounds it is still sent in
+};
+
+//! @brief Announces the VIPs of every master on one interface, IPv4
+//!	ones by gratuitous ARP and IPv6 ones by unsolicited NA
+struct garp_engine {
+	int 		fd;		// protocol 0, it takes no traffic
+	int 		ifidx;
+	struct garp_sched sched;
+	struct reactor_timer timer;
+	struct garp_frame *frames;	// sorted by VIP and MAC
+	int 		num_of_frame;
+	int 		cursor;		// next frame of the running round
+	uint64_t 	round_at;	// when the next round may start
+	uint64_t 	refresh_at;
+	uint64_t 	credit;		// nsec of sending time in the bucket
+	uint64_t 	credit_at;	// when it was last filled
+	uint64_t 	tx_pkts;
+	uint64_t 	tx_calls;
+};
+
+void garp_build(struct arppkt *pkt, const char *mac, uint32_t nw_ipaddr);
+void na_build(struct napkt *pkt, const char *mac, const void *target,
+	const char *dst_mac, const void *dst, uint32_t flags);
+int garp_open(struct garp_engine *g, struct reactor *r, int ifidx,
+	const struct garp_sched *sched);
+int garp_update(struct garp_engine *g, const struct arp_resp_vip *vips,
+	int num_of_vip);
+void garp_close(struct garp_engine *g);
 
 #endif //XTVRRPD_GARP_H
@@ -0,0 +1,546 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include "vrrp_common.h"
+#include "arp.h"
+#include "arp_responder.h"
+#include "ifconfig.h"
+
+#define ARP_OFF_TYPE	12
+#define ARP_OFF_OP	20
+#define ARP_OFF_TIP	38
+#define NS_OFF_NEXT	20	// no extension headers in between
+#define NS_OFF_TYPE	54
+#define NS_OFF_TARGET	62
+
+//! @brief Number of filter instructions for the given VIPs
+static inline int arp_filter_len(int num_of_vip4, int num_of_vip6)
+{
+	return 2 * num_of_vip4 + 9 * num_of_vip6 + 21;
+}
+
+//! @brief Generate the classic BPF program that only accepts ARP requests,
+//!	and neighbour solicitations, for the given VIPs
+//! @param[out] prog Where to store the instructions, BPF_MAXINSNS of them
+//! @param[in] vips The VIPs to match, an empty set drops everything
+//! @param[in] num_of_vip Number of |vips|
+//! @note A set too large for one program lets every request through,
+//!	the workers look the target up themselves.
+//! @return The number of instructions
+static int arp_filter_build(struct sock_filter *prog,
+	const struct arp_resp_vip *vips, int num_of_vip)
+{
+	int n = 0;
+
+	if (!num_of_vip) {
+		prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+		return n;
+	}
+	int num_of_vip6 = 0;
+	for (int i = 0; i < num_of_vip; ++i) {
+		num_of_vip6 += (AF_INET6 == vips[i].family);
+	}
+	if (arp_filter_len(num_of_vip - num_of_vip6, num_of_vip6) >
+		BPF_MAXINSNS)
+	{
+		num_of_vip = 0;
+	}
+
+	// Our own GARP requests come back as outgoing frames
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+		SKF_AD_OFF + SKF_AD_PKTTYPE);
+	prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+		PACKET_OUTGOING, 0, 1);
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS,
+		ARP_OFF_TYPE);
+	prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+		ETH_P_ARP, 1, 0);
+	int to_ns = n;	// the ARP part may be too long for a JEQ offset
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_JMP | BPF_JA, 0);
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS,
+		ARP_OFF_OP);
+	prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+		ARPOP_REQUEST, 1, 0);
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+		ARP_OFF_TIP);
+	// One compare and one accept per VIP keeps every jump in range
+	for (int i = 0; i < num_of_vip; ++i) {
+		if (AF_INET != vips[i].family) continue;
+		prog[n++] = (struct sock_filter)BPF_JUMP(
+			BPF_JMP | BPF_JEQ | BPF_K,
+			ntohl(vips[i].nw_ipaddr), 0, 1);
+		prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+			0xFFFF);
+	}
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+		num_of_vip ? 0 : 0xFFFF);
+
+	// Neighbour solicitations, the accumulator still holds the type
+	prog[to_ns].k = n - to_ns - 1;
+	prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+		ETH_P_IPV6, 1, 0);
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+		NS_OFF_NEXT);
+	prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+		IPPROTO_ICMPV6, 1, 0);
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+		NS_OFF_TYPE);
+	prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+		ND_NEIGHBOR_SOLICIT, 1, 0);
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+	// Four word compares, a mismatch skips to the next VIP
+	for (int i = 0; i < num_of_vip; ++i) {
+		if (AF_INET6 != vips[i].family) continue;
+		for (int w = 0; w < 4; ++w) {
+			uint32_t word;
+			memcpy(&word, vips[i].addr6 + 4 * w, 4);
+			prog[n++] = (struct sock_filter)BPF_STMT(
+				BPF_LD | BPF_W | BPF_ABS, NS_OFF_TARGET + 4 * w);
+			prog[n++] = (struct sock_filter)BPF_JUMP(
+				BPF_JMP | BPF_JEQ | BPF_K, ntohl(word),
+				0, 2 * (3 - w) + 1);
+		}
+		prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+			0xFFFF);
+	}
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+		num_of_vip ? 0 : 0xFFFF);
+	return n;
+}
+
+//! @brief Attach the filter of given VIPs to a ring socket
+//! @retval 0 Success
+//! @retval -1 Failure
+static int arp_filter_attach(int fd, const struct arp_resp_vip *vips,
+	int num_of_vip)
+{
+	static struct sock_filter prog[BPF_MAXINSNS];
+	struct sock_fprog fprog = {
+		.len = arp_filter_build(prog, vips, num_of_vip),
+		.filter = prog,
+	};
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog,
+		sizeof(fprog)) < 0)
+	{
+		VRRPLOG("attach arp filter:%s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+//! @brief Open a packet socket with a TPACKET_V3 RX ring
+//! @param[in] w The worker to set up
+//! @param[in] fanout The fanout group argument, 0 for none
+//! @retval 0 Success
+//! @retval -1 Failure
+static int arp_ring_open(struct arp_resp_worker *w, int fanout)
+{
+	// Bind with protocol 0 first so nothing is queued before the filter
+	w->fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if (w->fd < 0) {
+		VRRPLOG("open arp socket:%s\n", strerror(errno));
+		return -1;
+	}
+	if (arp_filter_attach(w->fd, NULL, 0) < 0) goto err;
+
+	int ver = TPACKET_V3;
+	if (setsockopt(w->fd, SOL_PACKET, PACKET_VERSION, &ver,
+		sizeof(ver)) < 0)
+	{
+		VRRPLOG("set option PACKET_VERSION:%s\n", strerror(errno));
+		goto err;
+	}
+
+	struct tpacket_req3 req;
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = ARP_RESP_BLOCK_SIZ;
+	req.tp_block_nr = ARP_RESP_BLOCK_NR;
+	req.tp_frame_size = ARP_RESP_FRAME_SIZ;
+	req.tp_frame_nr = (ARP_RESP_BLOCK_SIZ / ARP_RESP_FRAME_SIZ) *
+		ARP_RESP_BLOCK_NR;
+	req.tp_retire_blk_tov = ARP_RESP_BLOCK_TMO;
+	if (setsockopt(w->fd, SOL_PACKET, PACKET_RX_RING, &req,
+		sizeof(req)) < 0)
+	{
+		VRRPLOG("set option PACKET_RX_RING:%s\n", strerror(errno));
+		goto err;
+	}
+	w->ringsiz = (size_t)req.tp_block_size * req.tp_block_nr;
+	w->ring = mmap(NULL, w->ringsiz, PROT_READ | PROT_WRITE,
+		MAP_SHARED, w->fd, 0);
+	if (MAP_FAILED == w->ring) {
+		VRRPLOG("mmap arp ring:%s\n", strerror(errno));
+		w->ring = NULL;
+		goto err;
+	}
+	w->blk = 0;
+
+	struct sockaddr_ll ll;
+	memset(&ll, 0, sizeof(ll));
+	ll.sll_family = AF_PACKET;
+	ll.sll_protocol = htons(w->resp->ipv6 ? ETH_P_ALL : ETH_P_ARP);
+	ll.sll_ifindex = w->resp->ifidx;
+	if (bind(w->fd, (struct sockaddr *)&ll, sizeof(ll)) < 0) {
+		VRRPLOG("bind arp socket:%s\n", strerror(errno));
+		goto err;
+	}
+
+	if (fanout && setsockopt(w->fd, SOL_PACKET, PACKET_FANOUT, &fanout,
+		sizeof(fanout)) < 0)
+	{
+		VRRPLOG("set option PACKET_FANOUT:%s\n", strerror(errno));
+		goto err;
+	}
+
+	if ((w->evfd = eventfd(0, EFD_NONBLOCK)) < 0) {
+		VRRPLOG("open arp eventfd:%s\n", strerror(errno));
+		goto err;
+	}
+	return 0;
+err:
+	if (w->ring) munmap(w->ring, w->ringsiz);
+	w->ring = NULL;
+	close(w->fd);
+	w->fd = -1;
+	return -1;
+}
+
+//! @brief Reply an ARP request if it asks for one of our VIPs
+//! @param[in] w The worker which received the request
+//! @param[in] req The received frame
+//! @param[in] len Length of |req|
+static void arp_reply(struct arp_resp_worker *w, const struct arppkt *req,
+	unsigned int len)
+{
+	struct arp_responder *resp = w->resp;
+	if (len < sizeof(struct arppkt)) return;
+	if (htons(ARPOP_REQUEST) != req->arph.ar_op) return;
+	// Gratuitous ARP of somebody else, nothing to answer
+	if (!memcmp(req->sip, req->dip, 4)) return;
+	PROBE2(arp_request, resp->ifidx, req->dip);
+
+	struct vip_key key;
+	vip_key_set(&key, AF_INET, req->dip, 0, 0);
+	int pos = vip_index_find(&resp->index, &key);
+	if (pos < 0) return;
+	const struct arp_resp_vip *vip = &resp->vips[pos];
+
+	struct arppkt reply = {
+		.ethh = {
+			.h_proto = htons(ETH_P_ARP),
+			},
+		.arph = {
+			.ar_hrd = htons(ARPHRD_ETHER),
+			.ar_pro = htons(ETH_P_IP),
+			.ar_hln = 6,
+			.ar_pln = 4,
+			.ar_op = htons(ARPOP_REPLY),
+			},
+	};
+	memcpy(reply.ethh.h_dest, req->sha, 6);
+	memcpy(reply.ethh.h_source, vip->vmac, 6);
+	memcpy(reply.sha, vip->vmac, 6);
+	memcpy(reply.sip, req->dip, 4);
+	memcpy(reply.dha, req->sha, 6);
+	memcpy(reply.dip, req->sip, 4);
+
+	struct sockaddr_ll send;
+	memset(&send, 0, sizeof(send));
+	send.sll_family = AF_PACKET;
+	send.sll_ifindex = resp->ifidx;
+	send.sll_halen = 6;
+	memcpy(send.sll_addr, req->sha, 6);
+	if (sendto(w->fd, &reply, sizeof(reply), 0,
+		(struct sockaddr *)&send, sizeof(send)) < 0)
+	{
+		VRRPLOG("reply arp:%s\n", strerror(errno));
+		return;
+	}
+	PROBE3(arp_reply, resp->ifidx, req->dip, vip->vmac);
+}
+
+//! @brief Answer a neighbour solicitation if it asks for one of our VIPs
+//! @param[in] w The worker which received the solicitation
+//! @param[in] req The received frame
+//! @param[in] len Length of |req|
+static void ns_reply(struct arp_resp_worker *w, const char *req,
+	unsigned int len)
+{
+	struct arp_responder *resp = w->resp;
+	const struct ethhdr *ethh = (const struct ethhdr *)req;
+	struct ip6_hdr ip6h;
+	struct nd_neighbor_solicit ns;
+	if (len < sizeof(*ethh) + sizeof(ip6h) + sizeof(ns)) return;
+	memcpy(&ip6h, req + sizeof(*ethh), sizeof(ip6h));
+	memcpy(&ns, req + sizeof(*ethh) + sizeof(ip6h), sizeof(ns));
+	// RFC 4861 7.1.1, it must not have been forwarded
+	if (255 != ip6h.ip6_hlim || 0 != ns.nd_ns_code) return;
+	PROBE2(ns_request, resp->ifidx, &ns.nd_ns_target);
+
+	struct vip_key key;
+	vip_key_set(&key, AF_INET6, &ns.nd_ns_target, 0, 0);
+	int pos = vip_index_find(&resp->index, &key);
+	if (pos < 0) return;
+	const struct arp_resp_vip *vip = &resp->vips[pos];
+
+	// Duplicate address detection is answered to all nodes
+	struct napkt reply;
+	if (IN6_IS_ADDR_UNSPECIFIED(&ip6h.ip6_src)) {
+		na_build(&reply, vip->vmac, vip->addr6, NULL, NULL,
+			ND_NA_FLAG_ROUTER | ND_NA_FLAG_OVERRIDE);
+	} else {
+		na_build(&reply, vip->vmac, vip->addr6,
+			(const char *)ethh->h_source, &ip6h.ip6_src,
+			ND_NA_FLAG_ROUTER | ND_NA_FLAG_SOLICITED |
+			ND_NA_FLAG_OVERRIDE);
+	}
+
+	struct sockaddr_ll send;
+	memset(&send, 0, sizeof(send));
+	send.sll_family = AF_PACKET;
+	send.sll_ifindex = resp->ifidx;
+	send.sll_halen = 6;
+	memcpy(send.sll_addr, reply.ethh.h_dest, 6);
+	if (sendto(w->fd, &reply, sizeof(reply), 0,
+		(struct sockaddr *)&send, sizeof(send)) < 0)
+	{
+		VRRPLOG("reply ns:%s\n", strerror(errno));
+		return;
+	}
+	PROBE3(ns_reply, resp->ifidx, vip->addr6, vip->vmac);
+}
+
+//! @brief Consume every block the kernel has handed over to us
+static void arp_ring_drain(struct arp_resp_worker *w)
+{
+	struct arp_responder *resp = w->resp;
+	pthread_rwlock_rdlock(&resp->vip_lock);
+	while (1) {
+		struct tpacket_block_desc *pbd = (struct tpacket_block_desc *)
+			((char *)w->ring + (size_t)w->blk * ARP_RESP_BLOCK_SIZ);
+		if (!(pbd->hdr.bh1.block_status & TP_STATUS_USER)) break;
+
+		struct tpacket3_hdr *ppd = (struct tpacket3_hdr *)
+			((char *)pbd + pbd->hdr.bh1.offset_to_first_pkt);
+		for (unsigned int i = 0; i < pbd->hdr.bh1.num_pkts; ++i) {
+			char *frame = (char *)ppd + ppd->tp_mac;
+			struct ethhdr *ethh = (struct ethhdr *)frame;
+			if (htons(ETH_P_IPV6) == ethh->h_proto) {
+				ns_reply(w, frame, ppd->tp_snaplen);
+			} else {
+				arp_reply(w, (struct arppkt *)frame,
+					ppd->tp_snaplen);
+			}
+			ppd = (struct tpacket3_hdr *)((char *)ppd +
+				ppd->tp_next_offset);
+		}
+
+		__sync_synchronize();
+		pbd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+		w->blk = (w->blk + 1) % ARP_RESP_BLOCK_NR;
+	}
+	pthread_rwlock_unlock(&resp->vip_lock);
+}
+
+//! @brief The worker thread, it sleeps while there is no VIP to answer
+static void* arp_worker(void *arg)
+{
+	struct arp_resp_worker *w = arg;
+	struct arp_responder *resp = w->resp;
+	struct pollfd pfd[2] = {
+		{ .fd = w->fd, .events = POLLIN },
+		{ .fd = w->evfd, .events = POLLIN },
+	};
+	uint64_t cnt;
+
+	while (!resp->stop) {
+		pthread_mutex_lock(&resp->lock);
+		while (!resp->num_of_vip && !resp->stop) {
+			pthread_cond_wait(&resp->cond, &resp->lock);
+		}
+		pthread_mutex_unlock(&resp->lock);
+		if (resp->stop) break;
+
+		if (poll(pfd, 2, -1) < 0) {
+			if (EINTR == errno) continue;
+			VRRPLOG("poll arp ring:%s\n", strerror(errno));
+			break;
+		}
+		if (pfd[0].revents & POLLERR) {
+			// A link bounce leaves ENETDOWN pending on the socket
+			int err;
+			socklen_t errlen = sizeof(err);
+			getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+		}
+		if (pfd[1].revents & POLLIN) {
+			if (read(w->evfd, &cnt, sizeof(cnt)) < 0) {
+				// Drained by an earlier wakeup
+			}
+		}
+		arp_ring_drain(w);
+	}
+	pthread_exit(0);
+}
+
+//! @brief Open the ARP responder on an interface
+//! @param[out] resp The responder to initialize
+//! @param[in] ifidx The interface index to serve
+//! @param[in] num_of_worker Number of ring/thread pairs in the fanout group
+//! @param[in] ipv6 Non-zero to answer neighbour solicitations as well
+//! @retval 0 Success
+//! @retval -1 Failure
+int arp_responder_open(struct arp_responder *resp, int ifidx,
+	int num_of_worker, int ipv6)
+{
+	memset(resp, 0, sizeof(*resp));
+	resp->ifidx = ifidx;
+	resp->ipv6 = ipv6;
+	if (num_of_worker < 1) num_of_worker = 1;
+	if (num_of_worker > ARP_RESP_WORKER_MAX) {
+		num_of_worker = ARP_RESP_WORKER_MAX;
+	}
+	pthread_mutex_init(&resp->lock, NULL);
+	pthread_cond_init(&resp->cond, NULL);
+	pthread_rwlock_init(&resp->vip_lock, NULL);
+
+	int fanout = 0;
+	if (num_of_worker > 1) {
+		fanout = ((getpid() ^ (ifidx << 8)) & 0xFFFF) |
+			(PACKET_FANOUT_LB << 16);
+	}
+	for (int i = 0; i < num_of_worker; ++i) {
+		struct arp_resp_worker *w = &resp->workers[i];
+		w->resp = resp;
+		if (arp_ring_open(w, fanout) < 0) {
+			if (!i) return -1;
+			break;
+		}
+		if (pthread_create(&w->tid, NULL, arp_worker, w)) {
+			VRRPLOG("create arp worker failed\n");
+			close(w->evfd);
+			munmap(w->ring, w->ringsiz);
+			close(w->fd);
+			if (!i) return -1;
+			break;
+		}
+		resp->num_of_worker = i + 1;
+	}
+	VRRPLOG("start ARP responder with %d worker(s)\n",
+		resp->num_of_worker);
+	return 0;
+}
+
+//! @brief Let the NIC take solicitations for IPv6 VIPs, or stop
+//! @note They are sent to the solicited-node multicast address, which
+//!	lives as long as the ring socket.
+static void ns_membership(struct arp_responder *resp,
+	const struct arp_resp_vip *vips, int num_of_vip, int on)
+{
+	for (int i = 0; i < num_of_vip; ++i) {
+		if (AF_INET6 != vips[i].family) continue;
+		char mac[6] = { 0x33, 0x33, 0xFF };
+		memcpy(mac + 3, vips[i].addr6 + 13, 3);
+		if (set_multicast(resp->workers[0].fd, resp->ifidx, mac, on) < 0) {
+			VRRPLOG("%s solicited-node group:%s\n",
+				on ? "join" : "leave", strerror(errno));
+		}
+	}
+}
+
+//! @brief Replace the set of VIPs we answer for
+//! @param[in] resp The responder
+//! @param[in] vips The VIPs (copied), empty puts the workers to sleep
+//! @param[in] num_of_vip Number of |vips|
+//! @retval 0 Success
+//! @retval -1 Failure
+int arp_responder_update(struct arp_responder *resp,
+	const struct arp_resp_vip *vips, int num_of_vip)
+{
+	// The new set and its index are ready before the workers see them
+	struct arp_resp_vip *copy = NULL;
+	struct vip_index index = { 0 };
+	if (vip_index_init(&index, num_of_vip) < 0) goto err;
+	if (num_of_vip && !(copy = malloc(num_of_vip * sizeof(*vips)))) {
+		goto err;
+	}
+	for (int i = 0; i < num_of_vip; ++i) {
+		struct vip_key key;
+		copy[i] = vips[i];
+		vip_key_set(&key, vips[i].family, vips[i].addr6, 0, 0);
+		// A VIP of two masters is answered with the first MAC
+		vip_index_add(&index, &key, i);
+	}
+
+	// Groups are counted per socket, join the new ones first
+	ns_membership(resp, vips, num_of_vip, 1);
+	ns_membership(resp, resp->vips, resp->num_of_vip, 0);
+
+	pthread_mutex_lock(&resp->lock);
+	pthread_rwlock_wrlock(&resp->vip_lock);
+	struct arp_resp_vip *old = resp->vips;
+	struct vip_index old_index = resp->index;
+	resp->vips = copy;
+	resp->index = index;
+	resp->num_of_vip = num_of_vip;
+	pthread_rwlock_unlock(&resp->vip_lock);
+	free(old);
+	vip_index_free(&old_index);
+
+	int ret = 0;
+	uint64_t one = 1;
+	for (int i = 0; i < resp->num_of_worker; ++i) {
+		struct arp_resp_worker *w = &resp->workers[i];
+		if (arp_filter_attach(w->fd, vips, num_of_vip) < 0) ret = -1;
+		if (write(w->evfd, &one, sizeof(one)) < 0) ret = -1;
+	}
+	pthread_cond_broadcast(&resp->cond);
+	pthread_mutex_unlock(&resp->lock);
+	return ret;
+err:
+	VRRPLOG("alloc %d VIPs for ARP responder:%s\n", num_of_vip,
+		strerror(errno));
+	vip_index_free(&index);
+	return -1;
+}
+
+//! @brief Stop workers and release the rings
+void arp_responder_close(struct arp_responder *resp)
+{
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&resp->lock);
+	resp->stop = 1;
+	for (int i = 0; i < resp->num_of_worker; ++i) {
+		if (write(resp->workers[i].evfd, &one, sizeof(one)) < 0) {
+			// The worker polls with no timeout, nothing else to do
+		}
+	}
+	pthread_cond_broadcast(&resp->cond);
+	pthread_mutex_unlock(&resp->lock);
+
+	for (int i = 0; i < resp->num_of_worker; ++i) {
+		struct arp_resp_worker *w = &resp->workers[i];
+		pthread_join(w->tid, NULL);
+		munmap(w->ring, w->ringsiz);
+		close(w->evfd);
+		close(w->fd);
+	}
+	resp->num_of_worker = 0;
+	free(resp->vips);
+	resp->vips = NULL;
+	resp->num_of_vip = 0;
+	vip_index_free(&resp->index);
+}
@@ -0,0 +1,58 @@
+#ifndef XTVRRPD_ARP_RESPONDER_H
+#define XTVRRPD_ARP_RESPONDER_H
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "vip_index.h"
+
+#define ARP_RESP_WORKER_DFT	1
+#define ARP_RESP_WORKER_MAX	16
+
+#define ARP_RESP_BLOCK_SIZ	(1 << 16)
+#define ARP_RESP_BLOCK_NR	8
+#define ARP_RESP_FRAME_SIZ	2048
+#define ARP_RESP_BLOCK_TMO	10	// msec before a partly filled block retires
+
+//! @brief A VIP we answer ARP requests, or neighbour solicitations, for
+struct arp_resp_vip {
+	int 		family;		// AF_INET or AF_INET6
+	union {
+		uint32_t 	nw_ipaddr;	// in network byteorder
+		uint8_t 	addr6[16];
+	};
+	char 		vmac[6];
+};
+
+//! @brief A thread servicing one TPACKET_V3 ring of the fanout group
+struct arp_resp_worker {
+	struct arp_responder 	*resp;
+	int 			fd;
+	int 			evfd;	// wakes the worker on VIP changes
+	void 			*ring;
+	size_t 			ringsiz;
+	unsigned int 		blk;	// next block to inspect
+	pthread_t 		tid;
+};
+
+//! @brief Event-driven ARP responder of one interface
+struct arp_responder {
+	int 			ifidx;
+	int 			ipv6;	// also answers neighbour solicitations
+	int 			num_of_worker;
+	volatile int 		stop;
+	pthread_mutex_t 	lock;
+	pthread_cond_t 		cond;
+	pthread_rwlock_t 	vip_lock;
+	int 			num_of_vip;
+	struct arp_resp_vip 	*vips;
+	struct vip_index 	index;	// VIP to its position in |vips|
+	struct arp_resp_worker 	workers[ARP_RESP_WORKER_MAX];
+};
+
+int arp_responder_open(struct arp_responder *resp, int ifidx,
+	int num_of_worker, int ipv6);
+int arp_responder_update(struct arp_responder *resp,
+	const struct arp_resp_vip *vips, int num_of_vip);
+void arp_responder_close(struct arp_responder *resp);
+
+#endif //XTVRRPD_ARP_RESPONDER_H
@@ -0,0 +1,165 @@
+#include <string.h>
+#include "cksum.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// All sums are taken over 16-bit words as they lie in memory, so the
+// result is already in network byteorder once stored back.
+
+//! @brief Fold a 64-bit one's complement sum down to 16 bits
+static inline uint16_t cksum_fold(uint64_t sum)
+{
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	return sum;
+}
+
+//! @brief Sum the bytes a vector loop left over, 8 bytes at a time
+static uint64_t cksum_tail(const uint8_t *p, size_t len, uint64_t sum)
+{
+	while (len >= 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		sum += w;
+		sum += (sum < w);	// end-around carry
+		p += 8;
+		len -= 8;
+	}
+	if (len >= 4) {
+		uint32_t w;
+		memcpy(&w, p, 4);
+		sum += w;
+		sum += (sum < w);
+		p += 4;
+		len -= 4;
+	}
+	if (len >= 2) {
+		uint16_t w;
+		memcpy(&w, p, 2);
+		sum += w;
+		sum += (sum < w);
+		p += 2;
+		len -= 2;
+	}
+	if (len) {
+		// An odd byte is padded with zero behind it
+		uint16_t w = 0;
+		memcpy(&w, p, 1);
+		sum += w;
+		sum += (sum < w);
+	}
+	return sum;
+}
+
+#if !defined(__x86_64__)
+//! @brief Portable sum of a buffer
+static uint64_t cksum_generic(const void *data, size_t len)
+{
+	return cksum_tail(data, len, 0);
+}
+#else
+//! @brief Sum a buffer 32 bytes at a time, with SSE2
+//! @note 32-bit words are widened into 64-bit lanes, so the lanes can
+//!	not overflow before 2^32 rounds.
+static uint64_t cksum_sse2(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc0 = zero, acc1 = zero;
+
+	for (; len >= 32; p += 32, len -= 32) {
+		__m128i a = _mm_loadu_si128((const __m128i *)p);
+		__m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(b, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(b, zero));
+	}
+
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(acc0, acc1));
+	uint64_t sum = (lanes[0] >> 32) + (lanes[0] & 0xffffffff) +
+		(lanes[1] >> 32) + (lanes[1] & 0xffffffff);
+	return cksum_tail(p, len, sum);
+}
+
+//! @brief Sum a buffer 64 bytes at a time, with AVX2
+__attribute__((target("avx2")))
+static uint64_t cksum_avx2(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	__m256i acc0 = _mm256_setzero_si256(), acc1 = acc0;
+
+	for (; len >= 64; p += 64, len -= 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)p);
+		__m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(p + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *)(p + 48));
+		acc0 = _mm256_add_epi64(acc0, _mm256_cvtepu32_epi64(a));
+		acc1 = _mm256_add_epi64(acc1, _mm256_cvtepu32_epi64(b));
+		acc0 = _mm256_add_epi64(acc0, _mm256_cvtepu32_epi64(c));
+		acc1 = _mm256_add_epi64(acc1, _mm256_cvtepu32_epi64(d));
+	}
+
+	uint64_t lanes[4];
+	_mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(acc0, acc1));
+	uint64_t sum = 0;
+	for (int i = 0; i < 4; ++i) {
+		sum += (lanes[i] >> 32) + (lanes[i] & 0xffffffff);
+	}
+	return cksum_tail(p, len, sum);
+}
+#endif
+
+static uint64_t cksum_select(const void *data, size_t len);
+static uint64_t (*cksum_block)(const void *data, size_t len) = cksum_select;
+
+//! @brief Pick the fastest kernel this CPU runs, on the first call
+static uint64_t cksum_select(const void *data, size_t len)
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	cksum_block = __builtin_cpu_supports("avx2") ? cksum_avx2 : cksum_sse2;
+#else
+	cksum_block = cksum_generic;
+#endif
+	return cksum_block(data, len);
+}
+
+//! @brief Internet checksum (RFC 1071) over a scatter list
+//! @param[in] vec The pieces, e.g. a pseudo header and the payload
+//! @param[in] cnt Number of pieces in |vec|
+//! @return The checksum as stored in the packet, 0 if the data verifies
+//! @note A piece may have an odd length, the next one is summed as if
+//!	it followed it in one buffer.
+uint16_t in_cksumv(const struct cksum_vec *vec, int cnt)
+{
+	uint64_t sum = 0;
+	size_t off = 0;
+
+	for (int i = 0; i < cnt; ++i) {
+		uint16_t part = cksum_fold(cksum_block(vec[i].base, vec[i].len));
+		// Starting at an odd offset swaps the bytes of every word
+		if (off & 1) part = (part << 8) | (part >> 8);
+		sum += part;
+		off += vec[i].len;
+	}
+	return ~cksum_fold(sum);
+}
+
+//! @brief Update a checksum after one 16-bit word changed (RFC 1624)
+//! @param[in] cksum The checksum covering |old_word|
+//! @param[in] old_word The word as it was, as stored in the packet
+//! @param[in] new_word The word as it is now, as stored in the packet
+//! @return The checksum covering |new_word|
+uint16_t cksum_adjust(uint16_t cksum, uint16_t old_word, uint16_t new_word)
+{
+	// HC' = ~(~HC + ~m + m'), never yields -0 for a nonzero sum
+	uint32_t sum = (uint16_t)~cksum + (uint16_t)~old_word + new_word;
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum += (sum >> 16);
+	return ~sum;
+}
@@ -0,0 +1,23 @@
+#ifndef XTVRRPD_CKSUM_H
+#define XTVRRPD_CKSUM_H
+#include <stdint.h>
+#include <stddef.h>
+
+//! @brief One piece of the data a checksum covers
+struct cksum_vec {
+	const void 	*base;
+	size_t 		len;
+};
+
+uint16_t in_cksumv(const struct cksum_vec *vec, int cnt);
+uint16_t cksum_adjust(uint16_t cksum, uint16_t old_word, uint16_t new_word);
+
+//! @brief Internet checksum (RFC 1071) of a contiguous buffer
+//! @return The checksum as stored in the packet, 0 if |data| verifies
+static inline uint16_t in_cksum(const void *data, size_t len)
+{
+	struct cksum_vec vec = { data, len };
+	return in_cksumv(&vec, 1);
+}
+
+#endif //XTVRRPD_CKSUM_H
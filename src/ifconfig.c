@@ -6,6 +6,8 @@
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <netinet/in.h>
+#include <netpacket/packet.h>
+#include <ifaddrs.h>
 #include "ifconfig.h"
 
 //! @brief Get HW address by the given interface name 
@@ -142,3 +144,120 @@ err:
 	return -1;
 }
 
+
+//! @brief Get arp_ignore of an interface
+//! @param[in] ifname The given interface name
+//! @return The value, -1 on failure
+int get_arp_ignore(const char *ifname)
+{
+	char path[64 + IFNAMSIZ];
+	int val = -1;
+	snprintf(path, sizeof(path), "/proc/sys/net/ipv4/conf/%s/arp_ignore",
+		ifname);
+
+	FILE *fp = fopen(path, "r");
+	if (!fp) return -1;
+	if (fscanf(fp, "%d", &val) != 1) val = -1;
+	fclose(fp);
+	return val;
+}
+
+//! @brief Set arp_ignore of an interface
+//! @param[in] ifname The given interface name
+//! @param[in] val The new value
+//! @retval 0 Success
+//! @retval -1 Failure
+int set_arp_ignore(const char *ifname, int val)
+{
+	char path[64 + IFNAMSIZ];
+	snprintf(path, sizeof(path), "/proc/sys/net/ipv4/conf/%s/arp_ignore",
+		ifname);
+
+	FILE *fp = fopen(path, "w");
+	if (!fp) return -1;
+	int ret = (fprintf(fp, "%d\n", val) < 0) ? -1 : 0;
+	if (fclose(fp)) ret = -1;
+	return ret;
+}
+
+//! @brief Get the IPv6 link-local address by the given interface name
+//! @param[in]  ifname The given interface name
+//! @param[out] addr Where to store it
+//! @retval 0 Success
+//! @retval -1 Failure, there is none
+int get_ipv6_linklocal(const char *ifname, struct in6_addr *addr)
+{
+	struct ifaddrs *ifa_list;
+	if (getifaddrs(&ifa_list) < 0) return -1;
+
+	int ret = -1;
+	for (struct ifaddrs *ifa = ifa_list; ifa; ifa = ifa->ifa_next) {
+		if (!ifa->ifa_addr || AF_INET6 != ifa->ifa_addr->sa_family) {
+			continue;
+		}
+		if (strcmp(ifa->ifa_name, ifname)) continue;
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ifa->ifa_addr;
+		if (!IN6_IS_ADDR_LINKLOCAL(&sin6->sin6_addr)) continue;
+		*addr = sin6->sin6_addr;
+		ret = 0;
+		break;
+	}
+	freeifaddrs(ifa_list);
+	return ret;
+}
+
+//! @brief Open a packet socket to hold unicast filter entries
+//! @note It takes no traffic, the entries go away when it is closed.
+//! @return The socket, -1 on failure
+int open_unicast_filter(void)
+{
+	return socket(PF_PACKET, SOCK_RAW, 0);
+}
+
+//! @brief Add or drop a secondary unicast or a multicast address of an
+//!	interface
+static int hwaddr_membership(int fd, int ifidx, const char *hwaddr,
+	int type, int opt)
+{
+	struct packet_mreq mr;
+	memset(&mr, 0, sizeof(mr));
+	mr.mr_ifindex = ifidx;
+	mr.mr_type = type;
+	mr.mr_alen = 6;
+	memcpy(mr.mr_address, hwaddr, 6);
+	return setsockopt(fd, SOL_PACKET, opt, &mr, sizeof(mr));
+}
+
+//! @brief Let the NIC accept frames for one more unicast address
+//! @param[in] fd A socket from open_unicast_filter()
+//! @param[in] ifidx The interface index
+//! @param[in] hwaddr The address
+//! @retval 0 Success
+//! @retval -1 Failure
+int add_unicast(int fd, int ifidx, const char *hwaddr)
+{
+	return hwaddr_membership(fd, ifidx, hwaddr, PACKET_MR_UNICAST,
+		PACKET_ADD_MEMBERSHIP);
+}
+
+//! @brief Drop an address added by add_unicast()
+//! @retval 0 Success
+//! @retval -1 Failure
+int del_unicast(int fd, int ifidx, const char *hwaddr)
+{
+	return hwaddr_membership(fd, ifidx, hwaddr, PACKET_MR_UNICAST,
+		PACKET_DROP_MEMBERSHIP);
+}
+
+//! @brief Let the NIC accept frames for a multicast address, or stop
+//! @param[in] fd A socket from open_unicast_filter()
+//! @param[in] ifidx The interface index
+//! @param[in] hwaddr The address
+//! @param[in] on 1 to add it, 0 to drop it
+//! @retval 0 Success
+//! @retval -1 Failure
+int set_multicast(int fd, int ifidx, const char *hwaddr, int on)
+{
+	return hwaddr_membership(fd, ifidx, hwaddr, PACKET_MR_MULTICAST,
+		on ? PACKET_ADD_MEMBERSHIP : PACKET_DROP_MEMBERSHIP);
+}
@@ -1,14 +1,23 @@
 #ifndef XTVRRPD_IFCONFIG_H
 #define XTVRRPD_IFCONFIG_H
 #include <stdint.h>
+#include <netinet/in.h>
 
 int get_hwaddr(const char *ifname, char *hwaddr);
 int get_ipaddr(const char *ifname, uint32_t *ipaddr);
+int get_ipv6_linklocal(const char *ifname, struct in6_addr *addr);
 
 int set_hwaddr(const char *ifname, const char *hwaddr, size_t addrlen);
 
 int set_promiscuous(const char *ifname);
 int unset_promiscuous(const char *ifname);
+int get_arp_ignore(const char *ifname);
+int set_arp_ignore(const char *ifname, int val);
+
+int open_unicast_filter(void);
+int add_unicast(int fd, int ifidx, const char *hwaddr);
+int del_unicast(int fd, int ifidx, const char *hwaddr);
+int set_multicast(int fd, int ifidx, const char *hwaddr, int on);
 
 #endif //XTVRRPD_IFCONFIG_H
 
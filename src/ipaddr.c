@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <linux/if_addr.h>
+#include "vrrp_common.h"
+#include "libnetlink.h"
+#include "ipaddr.h"
+
+#ifndef IFA_F_NOPREFIXROUTE
+#define IFA_F_NOPREFIXROUTE	0x200
+#endif
+
+#define IPADDR_REQ_LEN		128
+
+//! @brief An address request and room for its attributes
+struct addr_req {
+	struct nlmsghdr 	n;
+	struct ifaddrmsg 	ifa;
+	char 			buf[IPADDR_REQ_LEN];
+};
+
+// Address requests go through one handle, opened on first use
+static struct rtnl_handle addr_rth = { .fd = -1 };
+static struct rtnl_batch addr_batch;
+
+//! @brief Get the handle address requests go through
+static struct rtnl_handle *addr_handle(void)
+{
+	if (addr_rth.fd < 0 && rtnl_open(&addr_rth, 0) < 0) {
+		if (addr_rth.fd >= 0) rtnl_close(&addr_rth);
+		return NULL;
+	}
+	return &addr_rth;
+}
+
+//! @brief Report a queued address request the kernel refused, and flag
+//!	it to whoever queued it
+//! @note Removing an address that is already gone is fine.
+static int addr_error(struct nlmsghdr *req, void *cookie, int err,
+	const char *msg, void *arg)
+{
+	int add = !req || RTM_NEWADDR == req->nlmsg_type;
+	if (!add && EADDRNOTAVAIL == err) return 0;
+	if (cookie) *(int *)cookie = 1;
+
+	struct ifaddrmsg *ifa = req ? NLMSG_DATA(req) : NULL;
+	struct rtattr *rta = req ? IFA_RTA(ifa) : NULL;
+	char addr[INET6_ADDRSTRLEN] = "?";
+	if (rta && RTA_PAYLOAD(rta) <= 16) {
+		inet_ntop(ifa->ifa_family, RTA_DATA(rta), addr, sizeof(addr));
+	}
+	VRRPLOG("%s address %s on %d:%s%s%s\n", add ? "add" : "delete",
+		addr, ifa ? (int)ifa->ifa_index : 0,
+		strerror(err), msg ? ": " : "", msg ? msg : "");
+	return 1;
+}
+
+//! @brief Queue adding or removing a VIP as a /32, or /128, of a link
+//! @param[in] ifidx The link
+//! @param[in] family AF_INET or AF_INET6
+//! @param[in] addr The VIP (in network byteorder)
+//! @param[in] add Non-zero to add it
+//! @param[out] failed Set to 1 if the kernel refuses it, may be NULL
+//! @note It carries no prefix route and skips DAD. Queued changes are
+//!	sent together by ipaddr_commit().
+//! @retval 0 Success
+//! @retval -1 Failure
+int ipaddr_set(int ifidx, int family, const void *addr, int add, int *failed)
+{
+	int len = (AF_INET6 == family) ? 16 : 4;
+	struct rtnl_handle *rth = addr_handle();
+	if (!rth) return -1;
+	if (addr_batch.rth != rth) {
+		rtnl_batch_init(&addr_batch, rth, addr_error, NULL);
+	}
+
+	struct addr_req req;
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+	req.n.nlmsg_flags = NLM_F_REQUEST;
+	if (add) req.n.nlmsg_flags |= NLM_F_CREATE | NLM_F_REPLACE;
+	req.n.nlmsg_type = add ? RTM_NEWADDR : RTM_DELADDR;
+	req.ifa.ifa_family = family;
+	req.ifa.ifa_prefixlen = len * 8;
+	req.ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+	req.ifa.ifa_index = ifidx;
+	addattr_l(&req.n, sizeof(req), IFA_LOCAL, addr, len);
+	addattr_l(&req.n, sizeof(req), IFA_ADDRESS, addr, len);
+	if (add) {
+		addattr32(&req.n, sizeof(req), IFA_FLAGS,
+			IFA_F_NODAD | IFA_F_NOPREFIXROUTE);
+	}
+	return rtnl_batch_add(&addr_batch, &req.n, failed);
+}
+
+//! @brief Send the queued address changes in one go
+//! @return How many of them failed
+int ipaddr_commit(void)
+{
+	if (!addr_batch.rth) return 0;
+	return rtnl_batch_commit(&addr_batch);
+}
+
+//! @brief Close the handle address requests go through
+void ipaddr_close(void)
+{
+	if (addr_rth.fd >= 0) rtnl_close(&addr_rth);
+	addr_rth.fd = -1;
+	addr_batch.rth = NULL;
+}
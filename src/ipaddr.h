@@ -0,0 +1,9 @@
+#ifndef XTVRRPD_IPADDR_H
+#define XTVRRPD_IPADDR_H
+#include <stdint.h>
+
+int ipaddr_set(int ifidx, int family, const void *addr, int add, int *failed);
+int ipaddr_commit(void);
+void ipaddr_close(void);
+
+#endif //XTVRRPD_IPADDR_H
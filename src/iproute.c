@@ -1,77 +1,23 @@
+#include <errno.h>
 #include "iproute.h"
+#include "probes.h"
 
-/* Allocation function */
-struct rt_entry * rt_new()
+/* Our rt netlink filter, fills |entry| and returns 1 if the route is wanted */
+int rt_filter(struct nlmsghdr *n, struct rt_entry *entry)
 {
-	struct rt_entry *entry;
-
-	entry = (struct rt_entry *)malloc(sizeof(struct rt_entry));
-	memset(entry, 0, sizeof(struct rt_entry));
-
-	entry->rtm = (struct rtmsg *)malloc(sizeof(struct rtmsg));
-	memset(entry->rtm, 0, sizeof(struct rtmsg));
-
-	return entry;
-}
-
-/* free memory */
-void rt_del(struct rt_entry *entry)
-{
-	free(entry->rtm);
-	free(entry);
-}
-
-/* destroy functions */
-struct rt_entry * clear_entry(struct rt_entry *entry)
-{
-	struct rt_entry *t;
-
-	t = (struct rt_entry *)entry->next;
-	rt_del(entry);
-	return t;
-}
-
-void rt_clear(struct rt_entry *lstentry)
-{
-	while (lstentry)
-		lstentry = clear_entry(lstentry);
-}
-
-/* Append rt entry function */
-struct rt_entry * rt_append(struct rt_entry *lstentry, struct rt_entry *entry)
-{
-	struct rt_entry *ptr = lstentry;
-
-	if (lstentry) {
-		while (lstentry->next) lstentry = (struct rt_entry *)lstentry->next;
-		lstentry->next = (struct rt_entry *)entry;
-		return ptr;
-	} else {
-		lstentry = entry;
-		return lstentry;
-	}
-}
-
-/* Our rt netlink filter */
-int rt_filter(struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
-{
-	struct rt_entry *rtarg;
 	struct rtmsg *r = NLMSG_DATA(n);
 	int len = n->nlmsg_len;
 	struct rtattr *tb[RTA_MAX+1];
-	struct rt_entry *entry;
-
-	rtarg = (struct rt_entry *)arg;
 
 	/* Just lookup the Main routing table */
-	if (r->rtm_table != RT_TABLE_MAIN)
+	if (r->rtm_family != AF_INET || r->rtm_table != RT_TABLE_MAIN)
 		return 0;
 
 	/* init len value  */
 	len -= NLMSG_LENGTH(sizeof(*r));
 	if (len <0) {
 		printf("BUG: wrong nlmsg len %d\n", len);
-		return -1;
+		return 0;
 	}
 
 	/* init the parse attribute space */
@@ -92,68 +38,34 @@ int rt_filter(struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
 		return 0;
 	if (r->rtm_type != RTN_UNICAST)
 		return 0;
+	if (!tb[RTA_OIF])
+		return 0;
 
-	if (tb[RTA_OIF]) {
-		/* alloc new memory entry */
-		entry = rt_new();
-
-		/* copy the rtmsg infos */
-		memcpy(entry->rtm, r, sizeof(struct rtmsg));
-
-		/*
-		 * can use RTA_PAYLOAD(tb[RTA_SRC])
-		 * but ipv4 addr are 4 bytes coded
-		 */
-		entry->oif = *(int *) RTA_DATA(tb[RTA_OIF]);
-		if (tb[RTA_SRC]) memcpy(&entry->src, RTA_DATA(tb[RTA_SRC]), 4);
-		if (tb[RTA_PREFSRC]) memcpy(&entry->psrc, RTA_DATA(tb[RTA_PREFSRC]), 4);
-		if (tb[RTA_DST]) memcpy(&entry->dest, RTA_DATA(tb[RTA_DST]), 4);
-		if (tb[RTA_GATEWAY]) memcpy(&entry->gate, RTA_DATA(tb[RTA_GATEWAY]), 4);
-		if (tb[RTA_FLOW]) memcpy(&entry->flow, RTA_DATA(tb[RTA_FLOW]), 4);
-		if (tb[RTA_IIF]) entry->iif = *(int *) RTA_DATA(tb[RTA_IIF]);
-		if (tb[RTA_PRIORITY]) entry->prio = *(int *) RTA_DATA(tb[RTA_PRIORITY]);
-		if (tb[RTA_METRICS]) entry->metrics = *(int *) RTA_DATA(tb[RTA_METRICS]);
-
-		/* save this entry */
-		rtarg = rt_append(rtarg, entry);
-	}
-
-
-	return 0;
-}
-
-struct rt_entry * rt_fetch(struct rt_entry *r)
-{
-	struct rtnl_handle rth;
-
-	// open netlink socket of NETLINK_ROUTE
-	if (rtnl_open(&rth, 0) < 0) {
-		printf("Can not initialize netlink interface...\n");
-		return NULL;
-	}
-
-	ll_init_map(&rth);
-
-	if (rtnl_wilddump_request(&rth, AF_INET, RTM_GETROUTE) < 0) {
-		printf("Cannot send dump request\n");
-		close(rth.fd);
-		return NULL;
-	}
+	memset(entry, 0, sizeof(*entry));
 
-	if (rtnl_dump_filter(&rth, rt_filter, r, NULL, NULL) < 0) {
-		printf("Dump terminated.\n");
-		close(rth.fd);
-		return NULL;
-	}
+	/* copy the rtmsg infos */
+	memcpy(&entry->rtm, r, sizeof(struct rtmsg));
 
-	close(rth.fd);
-	return r;
+	/*
+	 * can use RTA_PAYLOAD(tb[RTA_SRC])
+	 * but ipv4 addr are 4 bytes coded
+	 */
+	entry->oif = *(int *) RTA_DATA(tb[RTA_OIF]);
+	if (tb[RTA_SRC]) memcpy(&entry->src, RTA_DATA(tb[RTA_SRC]), 4);
+	if (tb[RTA_PREFSRC]) memcpy(&entry->psrc, RTA_DATA(tb[RTA_PREFSRC]), 4);
+	if (tb[RTA_DST]) memcpy(&entry->dest, RTA_DATA(tb[RTA_DST]), 4);
+	if (tb[RTA_GATEWAY]) memcpy(&entry->gate, RTA_DATA(tb[RTA_GATEWAY]), 4);
+	if (tb[RTA_FLOW]) memcpy(&entry->flow, RTA_DATA(tb[RTA_FLOW]), 4);
+	if (tb[RTA_IIF]) entry->iif = *(int *) RTA_DATA(tb[RTA_IIF]);
+	if (tb[RTA_PRIORITY]) entry->prio = *(int *) RTA_DATA(tb[RTA_PRIORITY]);
+	if (tb[RTA_METRICS]) entry->metrics = *(int *) RTA_DATA(tb[RTA_METRICS]);
+
+	return 1;
 }
 
-int rt_restore_entry(struct rt_entry *r)
+/* Queue the request that puts a route back */
+int rt_restore_entry(struct rtnl_batch *b, struct rt_entry *r)
 {
-	struct rtnl_handle rth;
-
 	struct {
 		struct nlmsghdr n;
 		struct rtmsg r;
@@ -166,7 +78,7 @@ int rt_restore_entry(struct rt_entry *r)
 	req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE;
 	req.n.nlmsg_type = RTM_NEWROUTE;
 
-	memcpy(&req.r, r->rtm, sizeof(struct rtmsg));
+	memcpy(&req.r, &r->rtm, sizeof(struct rtmsg));
 
 	if (r->src)
 		addattr_l(&req.n, sizeof(req), RTA_SRC, &r->src, 4);
@@ -188,90 +100,472 @@ int rt_restore_entry(struct rt_entry *r)
 	if (r->metrics)
 		addattr32(&req.n, sizeof(req), RTA_METRICS, r->metrics);
 
-	if (rtnl_open(&rth, 0) < 0) {
-		printf("Can not initialize netlink interface...\n");
-		return -1;
+	return rtnl_batch_add(b, &req.n, NULL);
+}
+
+char *ip_ntoa(uint32_t ip)
+{
+	static char buf[20];
+	unsigned char *bytep;
+
+	bytep = (unsigned char *) &(ip);
+	sprintf(buf, "%d.%d.%d.%d", bytep[0], bytep[1], bytep[2], bytep[3]);
+	return buf;
+}
+
+/* rt netlink dump function, prints every cached route */
+void rt_dump(struct rt_cache *c)
+{
+	struct rt_table *t = &c->table;
+	int slot, kind, i;
+
+	for (slot = 0; slot < c->nr_oif; slot++)
+	for (kind = RT_DIRECT; kind <= RT_GATEWAY; kind++)
+	for (i = c->head[slot][kind]; i >= 0; i = t->next[i]) {
+		if (t->src[i]) printf("src %s ", ip_ntoa(t->src[i]));
+		if (t->psrc[i]) printf("prefsrc %s ", ip_ntoa(t->psrc[i]));
+		if (t->iif[i]) printf("idev %s", ll_index_to_name(t->iif[i]));
+
+		if (t->dest[i]) printf("dest %s ", ip_ntoa(t->dest[i]));
+		if (t->gate[i]) printf("gateway %s ", ip_ntoa(t->gate[i]));
+
+		if (t->prio[i]) printf("priority %d ", t->prio[i]);
+		if (t->metrics[i]) printf("metrics %d ", t->metrics[i]);
+
+		if (t->oif[i]) printf("odev %s ", ll_index_to_name(t->oif[i]));
+
+		/* rtmsg specifics */
+		if (t->rtm[i].rtm_dst_len) printf("mask %d ", t->rtm[i].rtm_dst_len);
+		if (t->rtm[i].rtm_scope == RT_SCOPE_LINK) printf("scope link");
+
+		printf("\n");
 	}
+}
+
+/*
+ * Route table. The arrays are laid out one after the other in the arena,
+ * each rounded up to 8 bytes. With no arena only the size is computed.
+ */
+static size_t rt_table_carve(struct rt_table *t, char *arena, int size)
+{
+	size_t off = 0;
+
+#define RT_CARVE(field) do {						\
+		if (arena) t->field = (void *)(arena + off);		\
+		off += (size * sizeof(*t->field) + 7) & ~(size_t)7;	\
+	} while (0)
+
+	RT_CARVE(rtm);
+	RT_CARVE(psrc);
+	RT_CARVE(src);
+	RT_CARVE(dest);
+	RT_CARVE(gate);
+	RT_CARVE(flow);
+	RT_CARVE(iif);
+	RT_CARVE(oif);
+	RT_CARVE(prio);
+	RT_CARVE(metrics);
+	RT_CARVE(next);
+	RT_CARVE(prev);
+	RT_CARVE(hnext);
+	RT_CARVE(bucket);
+#undef RT_CARVE
+
+	return off;
+}
+
+/* Hash a route the way the kernel keys it: dest, prefix, tos, priority */
+static inline int rt_hash(const struct rt_table *t, uint32_t dest, int dst_len,
+			  int tos, int prio)
+{
+	uint32_t h = dest ^ ((uint32_t)dst_len << 24) ^ ((uint32_t)tos << 16) ^ prio;
+
+	h *= 0x9e3779b1U;
+	return (h ^ h >> 16) & (t->size - 1);
+}
 
-	if (rtnl_talk(&rth, &req.n, 0, 0, NULL, NULL, NULL) < 0) {
-		printf("Can not talk with netlink interface...\n");
+static inline int rt_slot_hash(const struct rt_table *t, int i)
+{
+	return rt_hash(t, t->dest[i], t->rtm[i].rtm_dst_len, t->rtm[i].rtm_tos,
+		       t->prio[i]);
+}
+
+static void rt_table_rehash(struct rt_table *t)
+{
+	int i, h;
+
+	memset(t->bucket, 0xff, t->size * sizeof(*t->bucket));
+	for (i = 0; i < t->used; i++) {
+		if (!t->oif[i])
+			continue;
+		h = rt_slot_hash(t, i);
+		t->hnext[i] = t->bucket[h];
+		t->bucket[h] = i;
+	}
+}
+
+/* Double the arena, slot numbers stay the same */
+static int rt_table_grow(struct rt_table *t)
+{
+	struct rt_table old = *t;
+	int size = old.size ? old.size * 2 : RT_TABLE_MIN;
+	char *arena = malloc(rt_table_carve(t, NULL, size));
+
+	if (!arena)
 		return -1;
+	rt_table_carve(t, arena, size);
+
+#define RT_MOVE(field) \
+	memcpy(t->field, old.field, old.used * sizeof(*t->field))
+
+	if (old.used) {
+		RT_MOVE(rtm);
+		RT_MOVE(psrc);
+		RT_MOVE(src);
+		RT_MOVE(dest);
+		RT_MOVE(gate);
+		RT_MOVE(flow);
+		RT_MOVE(iif);
+		RT_MOVE(oif);
+		RT_MOVE(prio);
+		RT_MOVE(metrics);
+		RT_MOVE(next);
+		RT_MOVE(prev);
 	}
+#undef RT_MOVE
 
+	t->arena = arena;
+	t->size = size;
+	free(old.arena);
+	rt_table_rehash(t);
 	return 0;
 }
 
-int rt_restore(struct rt_entry *lstentry, const char *dev)
+/* Store a route in a free slot, returns the slot or -1 */
+static int rt_table_put(struct rt_table *t, const struct rt_entry *e)
 {
-	int idx = ll_name_to_index(dev);
-	int ret = 0;
-	
-	lstentry = rt_sort(lstentry);
+	int i, h;
 
-	while (lstentry) {
-		if (lstentry->oif == idx) {
-			ret = rt_restore_entry(lstentry);
-			if (ret < 0) return ret;
-		}
+	if (t->free >= 0) {
+		i = t->free;
+		t->free = t->next[i];
+	} else {
+		if (t->used == t->size && rt_table_grow(t) < 0)
+			return -1;
+		i = t->used++;
+	}
+
+	t->rtm[i] = e->rtm;
+	t->psrc[i] = e->psrc;
+	t->src[i] = e->src;
+	t->dest[i] = e->dest;
+	t->gate[i] = e->gate;
+	t->flow[i] = e->flow;
+	t->iif[i] = e->iif;
+	t->oif[i] = e->oif;
+	t->prio[i] = e->prio;
+	t->metrics[i] = e->metrics;
+
+	h = rt_slot_hash(t, i);
+	t->hnext[i] = t->bucket[h];
+	t->bucket[h] = i;
+	t->nr++;
+	return i;
+}
+
+/* Release a slot, the caller took it off its list */
+static void rt_table_drop(struct rt_table *t, int i)
+{
+	int *pp = &t->bucket[rt_slot_hash(t, i)];
+
+	while (*pp != i)
+		pp = &t->hnext[*pp];
+	*pp = t->hnext[i];
+
+	t->oif[i] = 0;
+	t->next[i] = t->free;
+	t->free = i;
+	t->nr--;
+}
+
+static void rt_table_get(const struct rt_table *t, int i, struct rt_entry *e)
+{
+	e->rtm = t->rtm[i];
+	e->psrc = t->psrc[i];
+	e->src = t->src[i];
+	e->dest = t->dest[i];
+	e->gate = t->gate[i];
+	e->flow = t->flow[i];
+	e->iif = t->iif[i];
+	e->oif = t->oif[i];
+	e->prio = t->prio[i];
+	e->metrics = t->metrics[i];
+}
+
+/* Forget every route, the arena is kept */
+static void rt_table_clear(struct rt_table *t)
+{
+	t->used = 0;
+	t->nr = 0;
+	t->free = -1;
+	if (t->arena)
+		memset(t->bucket, 0xff, t->size * sizeof(*t->bucket));
+}
+
+static void rt_table_release(struct rt_table *t)
+{
+	free(t->arena);
+	memset(t, 0, sizeof(*t));
+	t->free = -1;
+}
+
+/*
+ * Route cache. A route sits in the list of its output interface and
+ * kind, and in the hash chain of its kernel key. Routes appended to an
+ * existing key differ by their output interface or gateway, so those
+ * complete the key when a route is looked up.
+ */
+static int rt_oif_slot(const struct rt_cache *c, int oif)
+{
+	int i;
 
-		lstentry = (struct rt_entry *)lstentry->next;
+	for (i = 0; i < c->nr_oif; i++)
+		if (c->oif[i] == oif)
+			return i;
+	return -1;
+}
+
+static void rt_cache_link(struct rt_cache *c, const struct rt_entry *e, int slot)
+{
+	struct rt_table *t = &c->table;
+	int kind = e->gate ? RT_GATEWAY : RT_DIRECT;
+	int i = rt_table_put(t, e);
+
+	if (i < 0) {
+		printf("No memory for route %s/%d\n", ip_ntoa(e->dest),
+		       e->rtm.rtm_dst_len);
+		return;
 	}
 
+	t->next[i] = -1;
+	t->prev[i] = c->tail[slot][kind];
+	if (t->prev[i] >= 0)
+		t->next[t->prev[i]] = i;
+	else
+		c->head[slot][kind] = i;
+	c->tail[slot][kind] = i;
+}
+
+static void rt_cache_unlink(struct rt_cache *c, int i)
+{
+	struct rt_table *t = &c->table;
+	int slot = rt_oif_slot(c, t->oif[i]);
+	int kind = t->gate[i] ? RT_GATEWAY : RT_DIRECT;
+
+	if (t->prev[i] >= 0)
+		t->next[t->prev[i]] = t->next[i];
+	else
+		c->head[slot][kind] = t->next[i];
+	if (t->next[i] >= 0)
+		t->prev[t->next[i]] = t->prev[i];
+	else
+		c->tail[slot][kind] = t->prev[i];
+
+	rt_table_drop(t, i);
+}
+
+/*
+ * Apply one route message, from the seeding dump or a notification.
+ * A replace drops every route of the key, other messages only drop the
+ * very same route.
+ */
+static int rt_cache_event(struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
+{
+	struct rt_cache *c = (struct rt_cache *)arg;
+	struct rt_table *t = &c->table;
+	struct rt_entry entry;
+	int i, next, slot;
+
+	if (n->nlmsg_type != RTM_NEWROUTE && n->nlmsg_type != RTM_DELROUTE)
+		return 0;
+
+	if (!rt_filter(n, &entry))
+		return 0;
+
+	if (t->arena) {
+		i = t->bucket[rt_hash(t, entry.dest, entry.rtm.rtm_dst_len,
+				      entry.rtm.rtm_tos, entry.prio)];
+		for (; i >= 0; i = next) {
+			next = t->hnext[i];
+			if (t->dest[i] != entry.dest ||
+			    t->rtm[i].rtm_dst_len != entry.rtm.rtm_dst_len ||
+			    t->rtm[i].rtm_tos != entry.rtm.rtm_tos ||
+			    t->prio[i] != entry.prio)
+				continue;
+			if ((n->nlmsg_flags & NLM_F_REPLACE) ||
+			    (t->oif[i] == entry.oif && t->gate[i] == entry.gate))
+				rt_cache_unlink(c, i);
+		}
+	}
+
+	slot = rt_oif_slot(c, entry.oif);
+	if (n->nlmsg_type == RTM_NEWROUTE && slot >= 0)
+		rt_cache_link(c, &entry, slot);
+
 	return 0;
 }
 
-char *ip_ntoa(uint32_t ip)
+/* Drop every cached route */
+static void rt_cache_flush(struct rt_cache *c)
 {
-	static char buf[20];
-	unsigned char *bytep;
+	rt_table_clear(&c->table);
+	memset(c->head, 0xff, sizeof(c->head));
+	memset(c->tail, 0xff, sizeof(c->tail));
+}
 
-	bytep = (unsigned char *) &(ip);
-	sprintf(buf, "%d.%d.%d.%d", bytep[0], bytep[1], bytep[2], bytep[3]);
-	return buf;
+/* A route the kernel still has is fine, anything else is reported */
+static int rt_restore_error(struct nlmsghdr *req, void *cookie, int err,
+			    const char *msg, void *arg)
+{
+	struct rtattr *tb[RTA_MAX+1];
+	struct rtmsg *r;
+	uint32_t dest = 0;
+
+	if (err == EEXIST)
+		return 0;
+
+	if (req) {
+		r = NLMSG_DATA(req);
+		memset(tb, 0, sizeof(tb));
+		parse_rtattr(tb, RTA_MAX, RTM_RTA(r), RTM_PAYLOAD(req));
+		if (tb[RTA_DST]) memcpy(&dest, RTA_DATA(tb[RTA_DST]), 4);
+		printf("Can not restore route %s/%d: %s%s%s\n", ip_ntoa(dest),
+		       r->rtm_dst_len, strerror(err), msg ? ": " : "", msg ? msg : "");
+	}
+	return 1;
 }
 
-/* rt netlink dump function */
-void rt_dump(struct rt_entry *r)
+/*
+ * Fill the cache with a dump, notifications met meanwhile apply as well.
+ * A kernel that filters dumps sends only the main table routes of each
+ * watched interface, others send everything once.
+ */
+static int rt_cache_seed(struct rt_cache *c)
 {
-	while (r) {
-		if (r->src) printf("src %s ", ip_ntoa(r->src));
-		if (r->psrc) printf("prefsrc %s ", ip_ntoa(r->psrc));
-		if (r->iif) printf("idev %s", ll_index_to_name(r->iif));
+	int i, n = c->rth.strict ? c->nr_oif : 1;
+	int ret = 0;
 
-		if (r->dest) printf("dest %s ", ip_ntoa(r->dest));
-		if (r->gate) printf("gateway %s ", ip_ntoa(r->gate));
+	PROBE2(netlink_start, "route_dump", 0);
+	rt_cache_flush(c);
 
-		if (r->prio) printf("priority %d ", r->prio);
-		if (r->metrics) printf("metrics %d ", r->metrics);
+	for (i = 0; i < n; i++) {
+		if (rtnl_routedump_request(&c->rth, AF_INET, RT_TABLE_MAIN, c->oif[i]) < 0) {
+			printf("Cannot send dump request\n");
+			ret = -1;
+			break;
+		}
 
-		if (r->oif) printf("odev %s ", ll_index_to_name(r->oif));
+		if (rtnl_dump_filter(&c->rth, rt_cache_event, c, rt_cache_event, c) < 0) {
+			printf("Dump terminated.\n");
+			ret = -1;
+			break;
+		}
+	}
 
-		/* rtmsg specifics */
-		if (r->rtm->rtm_dst_len) printf("mask %d ", r->rtm->rtm_dst_len);
-		if (r->rtm->rtm_scope == RT_SCOPE_LINK) printf("scope link");
+	PROBE2(netlink_end, "route_dump", ret);
+	return ret;
+}
 
-		printf("\n");
+/* Cache the routes of an output interface, call it before rt_cache_open() */
+int rt_cache_watch(struct rt_cache *c, int oif)
+{
+	if (rt_oif_slot(c, oif) >= 0)
+		return 0;
+	if (c->nr_oif == RT_CACHE_OIF_MAX)
+		return -1;
+
+	c->oif[c->nr_oif++] = oif;
+	return 0;
+}
 
-		r = (struct rt_entry *)r->next;
+/*
+ * Open the handle routes are put back through, subscribe to route
+ * changes, then seed the cache with the only dump it ever needs. Changes
+ * made before the dump is read are seen twice, which is harmless.
+ */
+int rt_cache_open(struct rt_cache *c)
+{
+	c->req.fd = -1;
+	if (rtnl_open(&c->rth, RTMGRP_IPV4_ROUTE) < 0 || rtnl_open(&c->req, 0) < 0) {
+		printf("Can not initialize netlink interface...\n");
+		rt_cache_close(c);
+		return -1;
 	}
+	rtnl_strict_dump(&c->rth);
+	rtnl_monitor_rcvbuf(&c->rth, RTNL_MONITOR_RCVBUF);
+
+	if (rt_cache_seed(c) < 0) {
+		rt_cache_close(c);
+		return -1;
+	}
+
+	return 0;
 }
 
-struct rt_entry *rt_sort(struct rt_entry *entry)
+/*
+ * Apply the pending notifications without blocking. If the socket
+ * overran, notifications were lost and the cache is seeded again.
+ */
+int rt_cache_update(struct rt_cache *c)
 {
-	struct rt_entry *previous, *start;
-
-	previous = start = (struct rt_entry *)entry;
-	while (entry) {
-		/* select no gateway routing entry go to start */
-		if (!entry->gate) {
-			previous->next = (struct rt_entry *)entry->next;
-			entry->next = (struct rt_entry *)start; 
-			start = (struct rt_entry *)entry;
-			entry = (struct rt_entry *)previous;
+	int ret;
+
+	PROBE2(netlink_start, "route_drain", 0);
+	ret = rtnl_drain(&c->rth, rt_cache_event, c);
+	PROBE2(netlink_end, "route_drain", ret);
+	if (ret == 0)
+		return 0;
+	if (errno == ENOBUFS)
+		return rt_cache_seed(c);
+	perror("Cannot read route changes");
+	return -1;
+}
+
+/*
+ * Put back the cached routes of an output interface, once a MAC change
+ * took it down. Direct routes go first, gateways are reached through them;
+ * the kernel takes a batch in order. Returns how many routes failed.
+ */
+int rt_cache_restore(struct rt_cache *c, int oif)
+{
+	struct rt_table *t = &c->table;
+	struct rt_entry e;
+	int slot = rt_oif_slot(c, oif);
+	int kind, i, ret;
+
+	if (slot < 0)
+		return -1;
+
+	PROBE2(netlink_start, "route_restore", oif);
+	rtnl_batch_init(&c->batch, &c->req, rt_restore_error, c);
+	for (kind = RT_DIRECT; kind <= RT_GATEWAY; kind++) {
+		for (i = c->head[slot][kind]; i >= 0; i = t->next[i]) {
+			rt_table_get(t, i, &e);
+			rt_restore_entry(&c->batch, &e);
 		}
-	previous = (struct rt_entry *)entry;
-	entry = (struct rt_entry *)entry->next;
 	}
 
-	return start;
+	ret = rtnl_batch_commit(&c->batch);
+	PROBE2(netlink_end, "route_restore", ret);
+	return ret;
+}
+
+void rt_cache_close(struct rt_cache *c)
+{
+	rt_cache_flush(c);
+	rt_table_release(&c->table);
+	if (c->rth.fd >= 0)
+		rtnl_close(&c->rth);
+	if (c->req.fd >= 0)
+		rtnl_close(&c->req);
 }
@@ -38,9 +38,9 @@
 /* macro definitions */
 #define VRRP_RT(X) ((X))
 
-/* specify a routing entry */
+/* specify a routing entry, as parsed or about to be restored */
 struct rt_entry {
-  struct rtmsg *rtm;
+  struct rtmsg rtm;
 
   uint32_t psrc;
   uint32_t src;
@@ -51,16 +51,67 @@ struct rt_entry {
   int oif;
   int prio;
   int metrics;
+};
 
-  struct rt_entry *next;
+/*
+ * Route table: the fields of slot i sit at index i of parallel arrays,
+ * all carved from one arena that doubles when full and is freed at once.
+ * Free slots have no oif and are chained through next[].
+ */
+#define RT_TABLE_MIN		256	/* power of 2 */
+
+struct rt_table {
+  int size;			/* slots in the arena */
+  int used;			/* slots ever handed out */
+  int nr;			/* routes held */
+  int free;			/* first free slot, -1 if none */
+  char *arena;
+
+  struct rtmsg *rtm;
+  uint32_t *psrc;
+  uint32_t *src;
+  uint32_t *dest;
+  uint32_t *gate;
+  uint32_t *flow;
+  int *iif;
+  int *oif;
+  int *prio;
+  int *metrics;
+  int *next;			/* list of the same output interface and kind */
+  int *prev;
+  int *hnext;			/* chain of the same hash bucket */
+  int *bucket;			/* size buckets */
+};
+
+/*
+ * Route cache: routes leaving the watched interfaces, seeded by one dump
+ * and kept current from RTNLGRP_IPV4_ROUTE, so a failover replays them
+ * without asking the kernel. Each interface keeps its direct routes
+ * apart from its gatewayed ones, in arrival order.
+ */
+#define RT_CACHE_OIF_MAX	64
+#define RT_DIRECT		0
+#define RT_GATEWAY		1
+
+struct rt_cache {
+  struct rtnl_handle rth;	/* subscribed to route changes */
+  struct rtnl_handle req;	/* requests, kept open */
+  struct rtnl_batch batch;
+  int nr_oif;
+  int oif[RT_CACHE_OIF_MAX];
+  int head[RT_CACHE_OIF_MAX][2];	/* parallel to oif[], by kind */
+  int tail[RT_CACHE_OIF_MAX][2];
+  struct rt_table table;
 };
 
 /* prototypes */
 
-extern struct rt_entry *rt_fetch(struct rt_entry *r);
-extern void rt_dump(struct rt_entry *r);
-extern void rt_clear(struct rt_entry *lstentry);
-extern int rt_restore(struct rt_entry *lstentry, const char *dev);
-extern struct rt_entry *rt_sort(struct rt_entry *entry);
+extern void rt_dump(struct rt_cache *c);
+
+extern int rt_cache_watch(struct rt_cache *c, int oif);
+extern int rt_cache_open(struct rt_cache *c);
+extern int rt_cache_update(struct rt_cache *c);
+extern int rt_cache_restore(struct rt_cache *c, int oif);
+extern void rt_cache_close(struct rt_cache *c);
 
 #endif
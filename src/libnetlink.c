@@ -30,6 +30,13 @@
 #	define MSG_TRUNC 0x20
 #endif 
 
+#ifndef SOL_NETLINK
+#	define SOL_NETLINK 270
+#endif
+#ifndef NETLINK_GET_STRICT_CHK
+#	define NETLINK_GET_STRICT_CHK 12
+#endif
+
 #if 1
 #	define nl_perror(str)	perror(str)
 #else
@@ -39,8 +46,9 @@
 int rtnl_open(struct rtnl_handle *rth, unsigned subscriptions)
 {
 	socklen_t addr_len;
+	int one = 1;
 
-	memset(rth, 0, sizeof(rth));
+	memset(rth, 0, sizeof(*rth));
 
 	rth->fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
 	if (rth->fd < 0) {
@@ -56,6 +64,10 @@ int rtnl_open(struct rtnl_handle *rth, unsigned subscriptions)
 		nl_perror("Cannot bind netlink socket");
 		return -1;
 	}
+
+	/* errors explain themselves, acks leave the request out; older kernels lack both */
+	setsockopt(rth->fd, SOL_NETLINK, NETLINK_EXT_ACK, &one, sizeof(one));
+	setsockopt(rth->fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
 	addr_len = sizeof(rth->local);
 	if (getsockname(rth->fd, (struct sockaddr*)&rth->local, &addr_len) < 0) {
 		nl_perror("Cannot getsockname");
@@ -94,6 +106,66 @@ int rtnl_wilddump_request(struct rtnl_handle *rth, int family, int type)
 	return sendto(rth->fd, (void*)&req, sizeof(req), 0, (struct sockaddr*)&nladdr, sizeof(nladdr));
 }
 
+/* Have the kernel filter dumps by the request header, 0 if it can */
+int rtnl_strict_dump(struct rtnl_handle *rth)
+{
+	int one = 1;
+
+	if (setsockopt(rth->fd, SOL_NETLINK, NETLINK_GET_STRICT_CHK, &one, sizeof(one)) < 0)
+		return -1;
+	rth->strict = 1;
+	return 0;
+}
+
+/*
+ * Ask for the unicast routes of one table leaving one interface, 0 for
+ * any. Without strict checking the kernel sends every route and the
+ * caller filters them itself.
+ */
+int rtnl_routedump_request(struct rtnl_handle *rth, int family, int table, int oif)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct rtmsg r;
+		char buf[64];
+	} req;
+	struct nlmsghdr *n = (struct nlmsghdr*)&req;
+	struct sockaddr_nl nladdr;
+
+	if (!rth->strict)
+		return rtnl_wilddump_request(rth, family, RTM_GETROUTE);
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+	req.nlh.nlmsg_type = RTM_GETROUTE;
+	req.nlh.nlmsg_flags = NLM_F_DUMP|NLM_F_REQUEST;
+	req.nlh.nlmsg_seq = rth->dump = ++rth->seq;
+	req.r.rtm_family = family;
+	req.r.rtm_type = RTN_UNICAST;
+	if (table) {
+		req.r.rtm_table = table < 256 ? table : RT_TABLE_UNSPEC;
+		addattr32(n, sizeof(req), RTA_TABLE, table);
+	}
+	if (oif)
+		addattr32(n, sizeof(req), RTA_OIF, oif);
+
+	return sendto(rth->fd, (void*)&req, n->nlmsg_len, 0, (struct sockaddr*)&nladdr, sizeof(nladdr));
+}
+
+/*
+ * Give a socket that listens to notifications room for bursts, beyond
+ * rmem_max when we are allowed to. An overrun still shows as ENOBUFS.
+ */
+int rtnl_monitor_rcvbuf(struct rtnl_handle *rth, int size)
+{
+	if (setsockopt(rth->fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) == 0)
+		return 0;
+	return setsockopt(rth->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
 int rtnl_send(struct rtnl_handle *rth, char *buf, int len)
 {
 	struct sockaddr_nl nladdr;
@@ -128,45 +200,89 @@ int rtnl_dump_request(struct rtnl_handle *rth, int type, void *req, int len)
 	return sendmsg(rth->fd, &msg, 0);
 }
 
+/* Make the receive buffer of the handle hold at least |len| bytes */
+static int rtnl_reserve(struct rtnl_handle *rth, int len)
+{
+	char *buf;
+
+	if (len < RTNL_RCVBUF)
+		len = RTNL_RCVBUF;
+	if (rth->buf && len <= rth->buflen)
+		return 0;
+	if ((buf = realloc(rth->buf, len)) == NULL)
+		return -1;
+	rth->buf = buf;
+	rth->buflen = len;
+	return 0;
+}
+
+/*
+ * Receive one datagram into the buffer of the handle. It is peeked at
+ * first and the buffer grows to fit, so nothing is ever truncated.
+ */
+static int rtnl_recv(struct rtnl_handle *rth, struct sockaddr_nl *nladdr, int flags)
+{
+	struct iovec iov;
+	struct msghdr msg = {
+		(void*)nladdr, sizeof(*nladdr),
+		&iov,	1,
+		NULL,	0,
+		0
+	};
+	int len;
+
+	if (rtnl_reserve(rth, 0) < 0)
+		return -1;
+
+	iov.iov_base = rth->buf;
+	iov.iov_len = rth->buflen;
+	len = recvmsg(rth->fd, &msg, flags | MSG_PEEK | MSG_TRUNC);
+	if (len <= 0)
+		return len;
+	if (rtnl_reserve(rth, len) < 0)
+		return -1;
+
+	iov.iov_base = rth->buf;
+	iov.iov_len = rth->buflen;
+	msg.msg_namelen = sizeof(*nladdr);
+	len = recvmsg(rth->fd, &msg, flags);
+	if (len > 0 && msg.msg_namelen != sizeof(*nladdr)) {
+		fprintf(stderr, "sender address length == %d\n", msg.msg_namelen);
+		errno = EPROTO;
+		return -1;
+	}
+	return len;
+}
+
 int rtnl_dump_filter(struct rtnl_handle *rth, 
 	int (*filter)(struct sockaddr_nl *, struct nlmsghdr *n, void *), 
 	void *arg1, 
 	int (*junk)(struct sockaddr_nl *,struct nlmsghdr *n, void *), 
 	void *arg2)
 {
-	char	buf[8192];
 	struct sockaddr_nl nladdr;
-	struct iovec iov = { buf, sizeof(buf) };
 
 	while (1) {
 		int status;
 		struct nlmsghdr *h;
 
-		struct msghdr msg = {
-			(void*)&nladdr, sizeof(nladdr),
-			&iov,	1,
-			NULL,	0,
-			0
-		};
-
-		status = recvmsg(rth->fd, &msg, 0);
+		status = rtnl_recv(rth, &nladdr, 0);
 
 		if (status < 0) {
 			if (errno == EINTR)
 				continue;
 			nl_perror("OVERRUN");
-			continue;
+			/* the dump goes on, only notifications were lost */
+			if (errno == ENOBUFS)
+				continue;
+			return -1;
 		}
 		if (status == 0) {
 			fprintf(stderr, "EOF on netlink\n");
 			return -1;
 		}
-		if (msg.msg_namelen != sizeof(nladdr)) {
-			fprintf(stderr, "sender address length == %d\n", msg.msg_namelen);
-			exit(1);
-		}
 
-		h = (struct nlmsghdr*)buf;
+		h = (struct nlmsghdr*)rth->buf;
 		while (NLMSG_OK(h, status)) {
 			int err;
 
@@ -201,13 +317,9 @@ int rtnl_dump_filter(struct rtnl_handle *rth,
 skip_it:
 			h = NLMSG_NEXT(h, status);
 		}
-		if (msg.msg_flags & MSG_TRUNC) {
-			fprintf(stderr, "Message truncated\n");
-			continue;
-		}
 		if (status) {
 			fprintf(stderr, "!!!Remnant of size %d\n", status);
-			exit(1);
+			return -1;
 		}
 	}
 }
@@ -221,7 +333,7 @@ int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 	struct nlmsghdr *h;
 	struct sockaddr_nl nladdr;
 	struct iovec iov = { (void*)n, n->nlmsg_len };
-	char   buf[8192];
+	unsigned seq;
 	struct msghdr msg = {
 		(void*)&nladdr, sizeof(nladdr),
 		&iov,	1,
@@ -234,7 +346,7 @@ int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 	nladdr.nl_pid = peer;
 	nladdr.nl_groups = groups;
 
-	n->nlmsg_seq = ++rtnl->seq;
+	n->nlmsg_seq = seq = ++rtnl->seq;
 	if (answer == NULL)
 		n->nlmsg_flags |= NLM_F_ACK;
 
@@ -245,48 +357,40 @@ int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 		return -1;
 	}
 
-	iov.iov_base = buf;
-	iov.iov_len = sizeof(buf);
-
 	while (1) {
-		status = recvmsg(rtnl->fd, &msg, 0);
+		status = rtnl_recv(rtnl, &nladdr, 0);
 
 		if (status < 0) {
 			if (errno == EINTR)
 				continue;
 			nl_perror("OVERRUN");
-			continue;
+			if (errno == ENOBUFS)
+				continue;
+			return -1;
 		}
 		if (status == 0) {
 			fprintf(stderr, "EOF on netlink\n");
 			return -1;
 		}
-		if (msg.msg_namelen != sizeof(nladdr)) {
-			fprintf(stderr, "sender address length == %d\n", msg.msg_namelen);
-			exit(1);
-		}
-		for (h = (struct nlmsghdr*)buf; status >= sizeof(*h); ) {
+		for (h = (struct nlmsghdr*)rtnl->buf; status >= sizeof(*h); ) {
 			int err;
 			int len = h->nlmsg_len;
-			pid_t pid=h->nlmsg_pid;
 			int l = len - sizeof(*h);
-			unsigned seq=h->nlmsg_seq;
 
 			if (l<0 || len>status) {
-				if (msg.msg_flags & MSG_TRUNC) {
-					fprintf(stderr, "Truncated message\n");
-					return -1;
-				}
 				fprintf(stderr, "!!!malformed message: len=%d\n", len);
-				exit(1);
+				return -1;
 			}
 
-			if (h->nlmsg_pid != pid || h->nlmsg_seq != seq) {
+			/* notifications, answers to earlier requests */
+			if (h->nlmsg_pid != rtnl->local.nl_pid || h->nlmsg_seq != seq) {
 				if (junk) {
 					err = junk(&nladdr, h, jarg);
 					if (err < 0)
 						return err;
 				}
+				status -= NLMSG_ALIGN(len);
+				h = (struct nlmsghdr*)((char*)h + NLMSG_ALIGN(len));
 				continue;
 			}
 
@@ -317,71 +421,251 @@ int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 			status -= NLMSG_ALIGN(len);
 			h = (struct nlmsghdr*)((char*)h + NLMSG_ALIGN(len));
 		}
-		if (msg.msg_flags & MSG_TRUNC) {
-			fprintf(stderr, "Message truncated\n");
-			continue;
-		}
 		if (status) {
 			fprintf(stderr, "!!!Remnant of size %d\n", status);
-			exit(1);
+			return -1;
 		}
 	}
 }
 
-int rtnl_listen(struct rtnl_handle *rtnl, 
-	      int (*handler)(struct sockaddr_nl *,struct nlmsghdr *n, void *),
-	      void *jarg)
+/*
+ * Batched requests. Messages are packed into one buffer and sent with a
+ * single sendmsg(). Only the last one asks for an ack, the kernel answers
+ * the others only when they fail, in order, so the ack of the last one
+ * tells every answer is in. Failures are matched to their request by
+ * sequence number.
+ */
+void rtnl_batch_init(struct rtnl_batch *b, struct rtnl_handle *rth,
+		     int (*on_error)(struct nlmsghdr *req, void *cookie, int err, const char *msg, void *),
+		     void *arg)
 {
-	int status;
-	struct nlmsghdr *h;
+	b->rth = rth;
+	b->len = 0;
+	b->count = 0;
+	b->errors = 0;
+	b->on_error = on_error;
+	b->arg = arg;
+}
+
+/* Find the extended ack message of an error, NULL if there is none */
+static const char *rtnl_ext_ack_msg(struct nlmsghdr *h)
+{
+	struct nlmsgerr *err = (struct nlmsgerr*)NLMSG_DATA(h);
+	struct rtattr *tb[NLMSGERR_ATTR_MAX+1];
+	int off = NLMSG_LENGTH(sizeof(*err));
+
+	if (!(h->nlmsg_flags & NLM_F_ACK_TLVS))
+		return NULL;
+	if (!(h->nlmsg_flags & NLM_F_CAPPED))
+		off += err->msg.nlmsg_len - sizeof(err->msg);
+	if (off >= h->nlmsg_len)
+		return NULL;
+
+	memset(tb, 0, sizeof(tb));
+	parse_rtattr(tb, NLMSGERR_ATTR_MAX, (struct rtattr*)((char*)h + off),
+		     h->nlmsg_len - off);
+	if (!tb[NLMSGERR_ATTR_MSG])
+		return NULL;
+	return RTA_DATA(tb[NLMSGERR_ATTR_MSG]);
+}
+
+/* Find the queued request a sequence number belongs to, and its cookie */
+static struct nlmsghdr *rtnl_batch_req(struct rtnl_batch *b, __u32 seq,
+				       void **cookie)
+{
+	struct nlmsghdr *n = (struct nlmsghdr*)b->buf;
+	int len = b->len;
+	int i = 0;
+
+	for (; NLMSG_OK(n, len); n = NLMSG_NEXT(n, len), i++)
+		if (n->nlmsg_seq == seq) {
+			*cookie = b->cookies[i];
+			return n;
+		}
+	*cookie = NULL;
+	return NULL;
+}
+
+/* Count a request that failed, on_error decides if it does */
+static void rtnl_batch_fail(struct rtnl_batch *b, struct nlmsghdr *req,
+			    void *cookie, int err, const char *msg)
+{
+	if (b->on_error) {
+		if (b->on_error(req, cookie, err, msg, b->arg))
+			b->errors++;
+		return;
+	}
+
+	b->errors++;
+	fprintf(stderr, "RTNETLINK answers: %s%s%s\n", strerror(err),
+		msg ? ": " : "", msg ? msg : "");
+}
+
+static void rtnl_batch_error(struct rtnl_batch *b, struct nlmsghdr *h)
+{
+	struct nlmsgerr *err = (struct nlmsgerr*)NLMSG_DATA(h);
+	void *cookie;
+	struct nlmsghdr *req = rtnl_batch_req(b, h->nlmsg_seq, &cookie);
+
+	rtnl_batch_fail(b, req, cookie, -err->error, rtnl_ext_ack_msg(h));
+}
+
+/* The answers of the requests queued after seq are lost, count them all
+ * as failed, the ones that made it are undone or redone by a retry */
+static void rtnl_batch_lost(struct rtnl_batch *b, __u32 seq, int err)
+{
+	struct nlmsghdr *n = (struct nlmsghdr*)b->buf;
+	int len = b->len;
+	int i = 0;
+
+	for (; NLMSG_OK(n, len); n = NLMSG_NEXT(n, len), i++)
+		if ((int)(n->nlmsg_seq - seq) > 0)
+			rtnl_batch_fail(b, n, b->cookies[i], err, NULL);
+}
+
+/* Send the queued requests and wait for their answers */
+static int rtnl_batch_flush(struct rtnl_batch *b)
+{
+	struct nlmsghdr *last = (struct nlmsghdr*)(b->buf + b->last);
+	__u32 first = ((struct nlmsghdr*)b->buf)->nlmsg_seq;
+	__u32 seen = first - 1;	/* the last request answered */
 	struct sockaddr_nl nladdr;
-	struct iovec iov;
-	char   buf[8192];
+	struct iovec iov = { b->buf, b->len };
 	struct msghdr msg = {
 		(void*)&nladdr, sizeof(nladdr),
 		&iov,	1,
 		NULL,	0,
 		0
 	};
+	int status;
+
+	if (!b->count)
+		return 0;
 
 	memset(&nladdr, 0, sizeof(nladdr));
 	nladdr.nl_family = AF_NETLINK;
-	nladdr.nl_pid = 0;
-	nladdr.nl_groups = 0;
 
-
-	iov.iov_base = buf;
-	iov.iov_len = sizeof(buf);
+	last->nlmsg_flags |= NLM_F_ACK;
+	status = sendmsg(b->rth->fd, &msg, 0);
+	if (status < 0) {
+		nl_perror("Cannot talk to rtnetlink");
+		rtnl_batch_lost(b, seen, errno);
+		goto out;
+	}
 
 	while (1) {
-		status = recvmsg(rtnl->fd, &msg, 0);
+		struct nlmsghdr *h;
 
+		status = rtnl_recv(b->rth, &nladdr, 0);
 		if (status < 0) {
 			if (errno == EINTR)
 				continue;
+			/* answers were dropped, we can not tell which */
 			nl_perror("OVERRUN");
-			continue;
+			rtnl_batch_lost(b, seen, errno);
+			goto out;
 		}
 		if (status == 0) {
 			fprintf(stderr, "EOF on netlink\n");
+			rtnl_batch_lost(b, seen, EPIPE);
+			goto out;
+		}
+
+		for (h = (struct nlmsghdr*)b->rth->buf; NLMSG_OK(h, status);
+		     h = NLMSG_NEXT(h, status)) {
+			struct nlmsgerr *err = (struct nlmsgerr*)NLMSG_DATA(h);
+
+			if (h->nlmsg_pid != b->rth->local.nl_pid ||
+			    h->nlmsg_seq - first > last->nlmsg_seq - first ||
+			    h->nlmsg_type != NLMSG_ERROR)
+				continue;
+			if (h->nlmsg_len < NLMSG_LENGTH(sizeof(*err))) {
+				void *cookie;
+				struct nlmsghdr *req;
+
+				fprintf(stderr, "ERROR truncated\n");
+				req = rtnl_batch_req(b, h->nlmsg_seq, &cookie);
+				rtnl_batch_fail(b, req, cookie, EBADMSG, NULL);
+			} else if (err->error) {
+				rtnl_batch_error(b, h);
+			}
+			seen = h->nlmsg_seq;
+			if (h->nlmsg_seq == last->nlmsg_seq)
+				goto out;
+		}
+	}
+
+out:
+	b->len = 0;
+	b->count = 0;
+	return 0;
+}
+
+/* Queue a request, the batch is sent first if it has no room left.
+ * The cookie is handed to on_error if the kernel refuses the request. */
+int rtnl_batch_add(struct rtnl_batch *b, struct nlmsghdr *n, void *cookie)
+{
+	int len = NLMSG_ALIGN(n->nlmsg_len);
+
+	if (len > sizeof(b->buf))
+		return -1;
+	if (b->len + len > sizeof(b->buf) || b->count == RTNL_BATCH_REQS)
+		rtnl_batch_flush(b);
+
+	memcpy(b->buf + b->len, n, n->nlmsg_len);
+	n = (struct nlmsghdr*)(b->buf + b->len);
+	n->nlmsg_flags &= ~NLM_F_ACK;
+	n->nlmsg_seq = ++b->rth->seq;
+	n->nlmsg_pid = 0;
+	b->cookies[b->count] = cookie;
+	b->last = b->len;
+	b->len += len;
+	b->count++;
+	return 0;
+}
+
+/* Send what is queued, returns how many requests failed */
+int rtnl_batch_commit(struct rtnl_batch *b)
+{
+	int errors;
+
+	rtnl_batch_flush(b);
+	errors = b->errors;
+	b->errors = 0;
+	return errors;
+}
+
+int rtnl_listen(struct rtnl_handle *rtnl, 
+	      int (*handler)(struct sockaddr_nl *,struct nlmsghdr *n, void *),
+	      void *jarg)
+{
+	int status;
+	struct nlmsghdr *h;
+	struct sockaddr_nl nladdr;
+
+	while (1) {
+		status = rtnl_recv(rtnl, &nladdr, 0);
+
+		if (status < 0) {
+			if (errno == EINTR)
+				continue;
+			nl_perror("OVERRUN");
+			if (errno == ENOBUFS)
+				continue;
 			return -1;
 		}
-		if (msg.msg_namelen != sizeof(nladdr)) {
-			fprintf(stderr, "Sender address length == %d\n", msg.msg_namelen);
-			exit(1);
+		if (status == 0) {
+			fprintf(stderr, "EOF on netlink\n");
+			return -1;
 		}
-		for (h = (struct nlmsghdr*)buf; status >= sizeof(*h); ) {
+		for (h = (struct nlmsghdr*)rtnl->buf; status >= sizeof(*h); ) {
 			int err;
 			int len = h->nlmsg_len;
 			int l = len - sizeof(*h);
 
 			if (l<0 || len>status) {
-				if (msg.msg_flags & MSG_TRUNC) {
-					fprintf(stderr, "Truncated message\n");
-					return -1;
-				}
 				fprintf(stderr, "!!!malformed message: len=%d\n", len);
-				exit(1);
+				return -1;
 			}
 
 			err = handler(&nladdr, h, jarg);
@@ -391,14 +675,63 @@ int rtnl_listen(struct rtnl_handle *rtnl,
 			status -= NLMSG_ALIGN(len);
 			h = (struct nlmsghdr*)((char*)h + NLMSG_ALIGN(len));
 		}
-		if (msg.msg_flags & MSG_TRUNC) {
-			fprintf(stderr, "Message truncated\n");
-			continue;
-		}
 		if (status) {
 			fprintf(stderr, "!!!Remnant of size %d\n", status);
-			exit(1);
+			return -1;
+		}
+	}
+}
+
+/*
+ * Hand every pending message to the handler without blocking. Returns 0
+ * once the socket is empty, -1 with errno set on failure; ENOBUFS means
+ * messages were lost and the listener has to catch up by a dump.
+ * Notifications are small, so they are not peeked at: the rare one the
+ * buffer can not hold counts as lost, and the buffer grows for the next.
+ */
+int rtnl_drain(struct rtnl_handle *rtnl,
+	       int (*handler)(struct sockaddr_nl *,struct nlmsghdr *n, void *),
+	       void *jarg)
+{
+	struct sockaddr_nl nladdr;
+	struct iovec iov;
+	struct nlmsghdr *h;
+	int status;
+
+	while (1) {
+		struct msghdr msg = {
+			(void*)&nladdr, sizeof(nladdr),
+			&iov,	1,
+			NULL,	0,
+			0
+		};
+
+		if (rtnl_reserve(rtnl, 0) < 0)
+			return -1;
+		iov.iov_base = rtnl->buf;
+		iov.iov_len = rtnl->buflen;
+
+		status = recvmsg(rtnl->fd, &msg, MSG_DONTWAIT | MSG_TRUNC);
+		if (status < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 0;
+			return -1;
 		}
+		if (status == 0) {
+			errno = EPIPE;
+			return -1;
+		}
+		if (status > rtnl->buflen) {
+			rtnl_reserve(rtnl, status);
+			errno = ENOBUFS;
+			return -1;
+		}
+
+		for (h = (struct nlmsghdr*)rtnl->buf; NLMSG_OK(h, status);
+		     h = NLMSG_NEXT(h, status))
+			handler(&nladdr, h, jarg);
 	}
 }
 
@@ -417,10 +750,8 @@ int rtnl_from_file(FILE *rtnl,
 	nladdr.nl_groups = 0;
 
 	while (1) {
-		int err, len, type;
-		pid_t pid;
+		int err, len;
 		int l;
-		unsigned seq;
 
 		status = fread(&buf, 1, sizeof(*h), rtnl);
 
@@ -434,10 +765,7 @@ int rtnl_from_file(FILE *rtnl,
 			return 0;
 
 		len = h->nlmsg_len;
-		type= h->nlmsg_type;
-		pid=h->nlmsg_pid;
 		l = len - sizeof(*h);
-		seq=h->nlmsg_seq;
 
 		if (l<0 || len>sizeof(buf)) {
 			fprintf(stderr, "!!!malformed message: len=%d @%lu\n",
@@ -476,7 +804,7 @@ int addattr32(struct nlmsghdr *n, int maxlen, int type, __u32 data)
 	return 0;
 }
 
-int addattr_l(struct nlmsghdr *n, int maxlen, int type, void *data, int alen)
+int addattr_l(struct nlmsghdr *n, int maxlen, int type, const void *data, int alen)
 {
 	int len = RTA_LENGTH(alen);
 	struct rtattr *rta;
@@ -543,6 +871,10 @@ int rtnl_close(struct rtnl_handle *rth)
 {
 	/* close the fd */
 	close( rth->fd );
+	rth->fd = -1;
+	free(rth->buf);
+	rth->buf = NULL;
+	rth->buflen = 0;
 	return(0);
 }
 
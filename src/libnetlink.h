@@ -12,11 +12,40 @@ struct rtnl_handle
 	struct sockaddr_nl	peer;
 	__u32			seq;
 	__u32			dump;
+	int			strict;		/* dumps are filtered by the kernel */
+	char			*buf;		/* receive buffer, grows to fit */
+	int			buflen;
+};
+
+/* receive buffer to start with, the most the kernel packs in a dump part */
+#define RTNL_RCVBUF	32768
+/* socket buffer of a handle that listens to notifications */
+#define RTNL_MONITOR_RCVBUF	(1024 * 1024)
+
+/* many requests sent at once, see rtnl_batch_add() */
+#define RTNL_BATCH_SIZE	32768
+/* requests queued at most, each carries a cookie for on_error */
+#define RTNL_BATCH_REQS	1024
+
+struct rtnl_batch
+{
+	struct rtnl_handle	*rth;
+	int			len;
+	int			last;	/* offset of the last request */
+	int			count;
+	int			errors;
+	int			(*on_error)(struct nlmsghdr *req, void *cookie, int err, const char *msg, void *);
+	void			*arg;
+	void			*cookies[RTNL_BATCH_REQS];
+	char			buf[RTNL_BATCH_SIZE];
 };
 
 extern int rtnl_open(struct rtnl_handle *rth, unsigned subscriptions);
 extern int rtnl_close(struct rtnl_handle *rth);
 extern int rtnl_wilddump_request(struct rtnl_handle *rth, int fam, int type);
+extern int rtnl_strict_dump(struct rtnl_handle *rth);
+extern int rtnl_routedump_request(struct rtnl_handle *rth, int fam, int table, int oif);
+extern int rtnl_monitor_rcvbuf(struct rtnl_handle *rth, int size);
 extern int rtnl_dump_request(struct rtnl_handle *rth, int type, void *req, int len);
 extern int rtnl_dump_filter(struct rtnl_handle *rth,
 			    int (*filter)(struct sockaddr_nl *, struct nlmsghdr *n, void *),
@@ -29,9 +58,15 @@ extern int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 		     void *jarg);
 extern int rtnl_send(struct rtnl_handle *rth, char *buf, int);
 
+extern void rtnl_batch_init(struct rtnl_batch *b, struct rtnl_handle *rth,
+			    int (*on_error)(struct nlmsghdr *req, void *cookie, int err, const char *msg, void *),
+			    void *arg);
+extern int rtnl_batch_add(struct rtnl_batch *b, struct nlmsghdr *n, void *cookie);
+extern int rtnl_batch_commit(struct rtnl_batch *b);
+
 
 extern int addattr32(struct nlmsghdr *n, int maxlen, int type, __u32 data);
-extern int addattr_l(struct nlmsghdr *n, int maxlen, int type, void *data, int alen);
+extern int addattr_l(struct nlmsghdr *n, int maxlen, int type, const void *data, int alen);
 extern int rta_addattr32(struct rtattr *rta, int maxlen, int type, __u32 data);
 extern int rta_addattr_l(struct rtattr *rta, int maxlen, int type, void *data, int alen);
 
@@ -39,6 +74,8 @@ extern int parse_rtattr(struct rtattr *tb[], int max, struct rtattr *rta, int le
 
 extern int rtnl_listen(struct rtnl_handle *, int (*handler)(struct sockaddr_nl *,struct nlmsghdr *n, void *),
 		       void *jarg);
+extern int rtnl_drain(struct rtnl_handle *, int (*handler)(struct sockaddr_nl *,struct nlmsghdr *n, void *),
+		      void *jarg);
 extern int rtnl_from_file(FILE *, int (*handler)(struct sockaddr_nl *,struct nlmsghdr *n, void *),
 		       void *jarg);
 
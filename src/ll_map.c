@@ -18,57 +18,299 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <string.h>
+#include <errno.h>
+#include <net/if.h>
 
 #include "libnetlink.h"
 #include "ll_map.h"
 
-struct idxmap
+/*
+ * Link table, kept current by RTNLGRP_LINK. Links are open addressed by
+ * index, with a second probe array from name hash to link slot. Both stay
+ * at most half full, a table with too many deleted slots is built again.
+ *
+ * One writer, the thread reading link changes, and any number of readers.
+ * Readers copy what they need out under a sequence count and retry if the
+ * writer came by meanwhile. A table replaced by another one is retired,
+ * the writer frees it once it sees no reader inside any table: a reader
+ * counts itself in before it loads ll_tab, so one that came later only
+ * finds the new table.
+ */
+#define LL_TABLE_MIN	64	/* power of 2 */
+#define LL_FREE		0
+#define LL_DELETED	(-1)
+
+struct ll_link
 {
-	struct idxmap * next;
-	int		index;
+	int		index;		/* LL_FREE, LL_DELETED or the ifindex */
 	int		type;
 	int		alen;
 	unsigned	flags;
 	unsigned char	addr[8];
-	char		name[16];
+	char		name[IFNAMSIZ];
+};
+
+struct ll_table
+{
+	unsigned	size;
+	unsigned	used;		/* link slots not free */
+	unsigned	nused;		/* name slots not free */
+	unsigned	live;
+	struct ll_link	*link;
+	int		*name;		/* slot in link[], or LL_FREE - 1 / LL_DELETED - 1 */
+	struct ll_table	*retired;	/* the tables this one replaced */
 };
 
-static struct idxmap *idxmap[16];
+#define LL_NAME_FREE	(LL_FREE - 1)
+#define LL_NAME_DELETED	(LL_DELETED - 1)
 
-int ll_remember_index(struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
+static struct ll_table *ll_tab;
+static unsigned ll_seq;		/* odd while the writer is in ll_tab */
+static unsigned ll_readers;	/* readers inside some table */
+static struct rtnl_handle ll_rth = { .fd = -1 };
+
+static void ll_write_begin(void)
+{
+	__atomic_store_n(&ll_seq, ll_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void ll_write_end(void)
+{
+	__atomic_store_n(&ll_seq, ll_seq + 1, __ATOMIC_RELEASE);
+}
+
+static unsigned ll_read_begin(void)
+{
+	unsigned seq;
+
+	while ((seq = __atomic_load_n(&ll_seq, __ATOMIC_ACQUIRE)) & 1)
+		;
+	return seq;
+}
+
+static int ll_read_retry(unsigned seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&ll_seq, __ATOMIC_RELAXED) != seq;
+}
+
+static struct ll_table *ll_reader_enter(void)
+{
+	__atomic_add_fetch(&ll_readers, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&ll_tab, __ATOMIC_SEQ_CST);
+}
+
+static void ll_reader_leave(void)
+{
+	__atomic_sub_fetch(&ll_readers, 1, __ATOMIC_RELEASE);
+}
+
+static inline unsigned ll_index_hash(int idx)
+{
+	return (unsigned)idx * 2654435761U;
+}
+
+static inline unsigned ll_name_hash(const char *name)
+{
+	unsigned h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619U;
+	return h;
+}
+
+static struct ll_table *ll_table_new(unsigned size)
+{
+	struct ll_table *t;
+	unsigned i;
+
+	t = calloc(1, sizeof(*t) + size * (sizeof(*t->link) + sizeof(*t->name)));
+	if (t == NULL)
+		return NULL;
+	t->size = size;
+	t->link = (struct ll_link *)(t + 1);
+	t->name = (int *)(t->link + size);
+	for (i = 0; i < size; i++)
+		t->name[i] = LL_NAME_FREE;
+	return t;
+}
+
+static void ll_table_free(struct ll_table *t)
+{
+	while (t) {
+		struct ll_table *next = t->retired;
+		free(t);
+		t = next;
+	}
+}
+
+/* Free the retired tables if no reader is left inside them, the ones a
+ * reader may still be in are tried again on the next update */
+static void ll_reclaim(void)
+{
+	struct ll_table *t = ll_tab;
+
+	if (t == NULL || t->retired == NULL)
+		return;
+	if (__atomic_load_n(&ll_readers, __ATOMIC_SEQ_CST))
+		return;
+	ll_table_free(t->retired);
+	t->retired = NULL;
+}
+
+/* Find the link slot of an index, -1 if it is not there */
+static int ll_find_index(const struct ll_table *t, int idx)
+{
+	unsigned mask = t->size - 1;
+	unsigned i = ll_index_hash(idx) & mask;
+	unsigned n;
+
+	for (n = 0; n < t->size; n++, i = (i + 1) & mask) {
+		if (t->link[i].index == LL_FREE)
+			break;
+		if (t->link[i].index == idx)
+			return i;
+	}
+	return -1;
+}
+
+/* Find the name slot of a name, -1 if it is not there */
+static int ll_find_name(const struct ll_table *t, const char *name)
+{
+	unsigned mask = t->size - 1;
+	unsigned i = ll_name_hash(name) & mask;
+	unsigned n;
+
+	for (n = 0; n < t->size; n++, i = (i + 1) & mask) {
+		int slot = t->name[i];
+
+		if (slot == LL_NAME_FREE)
+			break;
+		if (slot >= 0 && strncmp(t->link[slot].name, name, IFNAMSIZ) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static void ll_name_insert(struct ll_table *t, int slot)
+{
+	unsigned mask = t->size - 1;
+	unsigned i = ll_name_hash(t->link[slot].name) & mask;
+
+	while (t->name[i] >= 0)
+		i = (i + 1) & mask;
+	if (t->name[i] == LL_NAME_FREE)
+		t->nused++;
+	t->name[i] = slot;
+}
+
+static void ll_name_remove(struct ll_table *t, int slot)
+{
+	int i = ll_find_name(t, t->link[slot].name);
+
+	if (i >= 0 && t->name[i] == slot)
+		t->name[i] = LL_NAME_DELETED;
+}
+
+/* Take a slot for a new index, the table has room */
+static int ll_link_insert(struct ll_table *t, int idx)
+{
+	unsigned mask = t->size - 1;
+	unsigned i = ll_index_hash(idx) & mask;
+
+	while (t->link[i].index > 0)
+		i = (i + 1) & mask;
+	if (t->link[i].index == LL_FREE)
+		t->used++;
+	memset(&t->link[i], 0, sizeof(t->link[i]));
+	t->link[i].index = idx;
+	t->live++;
+	return i;
+}
+
+/*
+ * Build the table again without deleted slots, twice as large if it is
+ * more than a quarter full, and put it in place of the old one.
+ */
+static int ll_table_rebuild(struct ll_table **tp)
+{
+	struct ll_table *old = *tp;
+	struct ll_table *t;
+	unsigned i;
+
+	t = ll_table_new(old->live * 4 >= old->size ? old->size * 2 : old->size);
+	if (t == NULL)
+		return -1;
+
+	for (i = 0; i < old->size; i++) {
+		int slot;
+
+		if (old->link[i].index <= 0)
+			continue;
+		slot = ll_link_insert(t, old->link[i].index);
+		t->link[slot] = old->link[i];
+		if (t->link[slot].name[0])
+			ll_name_insert(t, slot);
+	}
+
+	t->retired = old;
+	__atomic_store_n(tp, t, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+/* Apply one link message to a table, it may be replaced by a larger one */
+static int ll_apply(struct ll_table **tp, struct nlmsghdr *n)
 {
-	int h;
 	struct ifinfomsg *ifi = NLMSG_DATA(n);
-	struct idxmap *im, **imp;
 	struct rtattr *tb[IFLA_MAX+1];
+	struct ll_table *t;
+	struct ll_link *im;
+	int slot;
 
-	if (n->nlmsg_type != RTM_NEWLINK)
+	if (n->nlmsg_type != RTM_NEWLINK && n->nlmsg_type != RTM_DELLINK)
 		return 0;
 
-	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(ifi)))
+	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
 		return -1;
 
+	t = *tp;
+	slot = ll_find_index(t, ifi->ifi_index);
+
+	if (n->nlmsg_type == RTM_DELLINK) {
+		if (slot >= 0) {
+			ll_name_remove(t, slot);
+			t->link[slot].index = LL_DELETED;
+			t->live--;
+		}
+		return 0;
+	}
 
 	memset(tb, 0, sizeof(tb));
 	parse_rtattr(tb, IFLA_MAX, IFLA_RTA(ifi), IFLA_PAYLOAD(n));
 	if (tb[IFLA_IFNAME] == NULL)
 		return 0;
 
-	h = ifi->ifi_index&0xF;
-
-	for (imp=&idxmap[h]; (im=*imp)!=NULL; imp = &im->next)
-		if (im->index == ifi->ifi_index)
-			break;
-
-	if (im == NULL) {
-		im = malloc(sizeof(*im));
-		if (im == NULL)
-			return 0;
-		im->next = *imp;
-		im->index = ifi->ifi_index;
-		*imp = im;
+	if (slot < 0) {
+		if ((t->used + 1) * 2 > t->size || (t->nused + 1) * 2 > t->size) {
+			if (ll_table_rebuild(tp) < 0)
+				return 0;
+			t = *tp;
+		}
+		slot = ll_link_insert(t, ifi->ifi_index);
+	} else if (strncmp(t->link[slot].name, RTA_DATA(tb[IFLA_IFNAME]), IFNAMSIZ)) {
+		/* renamed, the name moves */
+		ll_name_remove(t, slot);
+		t->link[slot].name[0] = '\0';
+		if ((t->nused + 1) * 2 > t->size) {
+			if (ll_table_rebuild(tp) < 0)
+				return 0;
+			t = *tp;
+			slot = ll_find_index(t, ifi->ifi_index);
+		}
 	}
 
+	im = &t->link[slot];
 	im->type = ifi->ifi_type;
 	im->flags = ifi->ifi_flags;
 	if (tb[IFLA_ADDRESS]) {
@@ -81,89 +323,186 @@ int ll_remember_index(struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
 		im->alen = 0;
 		memset(im->addr, 0, sizeof(im->addr));
 	}
-	strcpy(im->name, RTA_DATA(tb[IFLA_IFNAME]));
+	if (im->name[0] == '\0') {
+		snprintf(im->name, sizeof(im->name), "%s", (char *)RTA_DATA(tb[IFLA_IFNAME]));
+		ll_name_insert(t, slot);
+	}
 	return 0;
 }
 
+/* Netlink handler, |arg| is the table to fill */
+int ll_remember_index(struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
+{
+	struct ll_table **tp = arg;
+	int err;
+
+	if (*tp == NULL && (*tp = ll_table_new(LL_TABLE_MIN)) == NULL)
+		return 0;
+
+	if (tp != &ll_tab)
+		return ll_apply(tp, n);
+
+	ll_write_begin();
+	err = ll_apply(tp, n);
+	ll_write_end();
+	ll_reclaim();
+	return err;
+}
+
+/* Copy out the link of an index, returns 0 if there is none */
+static int ll_get_index(int idx, struct ll_link *out)
+{
+	unsigned seq;
+	int slot;
+
+	do {
+		struct ll_table *t;
+
+		seq = ll_read_begin();
+		t = ll_reader_enter();
+		slot = t ? ll_find_index(t, idx) : -1;
+		if (slot >= 0)
+			memcpy(out, &t->link[slot], sizeof(*out));
+		ll_reader_leave();
+	} while (ll_read_retry(seq));
+
+	return slot >= 0;
+}
+
+/* Copy out the link of a name, returns 0 if there is none */
+static int ll_get_name(const char *name, struct ll_link *out)
+{
+	unsigned seq;
+	int i;
+
+	do {
+		struct ll_table *t;
+
+		seq = ll_read_begin();
+		t = ll_reader_enter();
+		i = t ? ll_find_name(t, name) : -1;
+		if (i >= 0)
+			memcpy(out, &t->link[t->name[i]], sizeof(*out));
+		ll_reader_leave();
+	} while (ll_read_retry(seq));
+
+	return i >= 0;
+}
+
+/* Name of a link into |buf|, IFNAMSIZ bytes; safe from any thread */
 const char *ll_idx_n2a(int idx, char *buf)
 {
-	struct idxmap *im;
+	struct ll_link im;
 
 	if (idx == 0)
 		return "*";
-	for (im = idxmap[idx&0xF]; im; im = im->next)
-		if (im->index == idx)
-			return im->name;
-	snprintf(buf, 16, "if%d", idx);
+	if (ll_get_index(idx, &im)) {
+		memcpy(buf, im.name, IFNAMSIZ);
+		return buf;
+	}
+	snprintf(buf, IFNAMSIZ, "if%d", idx);
 	return buf;
 }
 
 
 const char *ll_index_to_name(int idx)
 {
-	static char nbuf[16];
+	static char nbuf[IFNAMSIZ];
 
 	return ll_idx_n2a(idx, nbuf);
 }
 
 int ll_index_to_type(int idx)
 {
-	struct idxmap *im;
+	struct ll_link im;
 
-	if (idx == 0)
+	if (idx == 0 || !ll_get_index(idx, &im))
 		return -1;
-	for (im = idxmap[idx&0xF]; im; im = im->next)
-		if (im->index == idx)
-			return im->type;
-	return -1;
+	return im.type;
 }
 
 unsigned ll_index_to_flags(int idx)
 {
-	struct idxmap *im;
+	struct ll_link im;
 
-	if (idx == 0)
+	if (idx == 0 || !ll_get_index(idx, &im))
 		return 0;
-
-	for (im = idxmap[idx&0xF]; im; im = im->next)
-		if (im->index == idx)
-			return im->flags;
-	return 0;
+	return im.flags;
 }
 
 int ll_name_to_index(const char *name)
 {
-	static char ncache[16];
-	static int icache;
-	struct idxmap *im;
-	int i;
+	struct ll_link im;
 
-	if (name == NULL)
+	if (name == NULL || !ll_get_name(name, &im))
 		return 0;
-	if (icache && strcmp(name, ncache) == 0)
-		return icache;
-	for (i=0; i<16; i++) {
-		for (im = idxmap[i]; im; im = im->next) {
-			if (strcmp(im->name, name) == 0) {
-				icache = im->index;
-				strcpy(ncache, name);
-				return im->index;
-			}
-		}
-	}
-	return 0;
+	return im.index;
 }
 
+/* Fill the table from a link dump over the given handle */
 int ll_init_map(struct rtnl_handle *rth)
 {
+	struct ll_table *t = NULL;
+
 	if (rtnl_wilddump_request(rth, AF_UNSPEC, RTM_GETLINK) < 0) {
 		perror("Cannot send dump request");
-		exit(1);
+		return -1;
 	}
 
-	if (rtnl_dump_filter(rth, ll_remember_index, &idxmap, NULL, NULL) < 0) {
+	/* a private table, readers see it once it is complete */
+	if (rtnl_dump_filter(rth, ll_remember_index, &t, ll_remember_index, &t) < 0) {
 		fprintf(stderr, "Dump terminated\n");
-		exit(1);
+		ll_table_free(t);
+		return -1;
 	}
+	if (t == NULL)
+		return 0;
+
+	/* no reader saw the tables the dump outgrew, the old ones go along
+	 * until no reader is left in them */
+	ll_table_free(t->retired);
+	t->retired = ll_tab;
+	__atomic_store_n(&ll_tab, t, __ATOMIC_SEQ_CST);
+	ll_reclaim();
 	return 0;
 }
+
+/*
+ * Subscribe to link changes and fill the table, returns the descriptor
+ * to call ll_update() on when it is readable, -1 on failure.
+ */
+int ll_open(void)
+{
+	if (rtnl_open(&ll_rth, RTMGRP_LINK) < 0) {
+		ll_close();
+		return -1;
+	}
+	rtnl_monitor_rcvbuf(&ll_rth, RTNL_MONITOR_RCVBUF);
+	if (ll_init_map(&ll_rth) < 0) {
+		ll_close();
+		return -1;
+	}
+	return ll_rth.fd;
+}
+
+/* Apply pending link changes, a lost change costs a dump */
+int ll_update(void)
+{
+	if (ll_rth.fd < 0)
+		return -1;
+	if (rtnl_drain(&ll_rth, ll_remember_index, &ll_tab) == 0)
+		return 0;
+	if (errno == ENOBUFS)
+		return ll_init_map(&ll_rth);
+	perror("Cannot read link changes");
+	return -1;
+}
+
+/* Drop the table, no reader may be left */
+void ll_close(void)
+{
+	if (ll_rth.fd >= 0)
+		rtnl_close(&ll_rth);
+	ll_table_free(ll_tab);
+	ll_tab = NULL;
+}
@@ -8,5 +8,8 @@ extern const char *ll_index_to_name(int idx);
 extern const char *ll_idx_n2a(int idx, char *buf);
 extern int ll_index_to_type(int idx);
 extern unsigned ll_index_to_flags(int idx);
+extern int ll_open(void);
+extern int ll_update(void);
+extern void ll_close(void);
 
 #endif /* __LL_MAP_H__ */
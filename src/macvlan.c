@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <net/if.h>
+#include "vrrp_common.h"
+#include "libnetlink.h"
+#include "ll_map.h"
+#include "macvlan.h"
+
+#define MACVLAN_REQ_LEN		512
+
+//! @brief A link request and room for its attributes
+struct link_req {
+	struct nlmsghdr 	n;
+	struct ifinfomsg 	ifi;
+	char 			buf[MACVLAN_REQ_LEN];
+};
+
+//! @brief Open a nested attribute, close it with nest_end()
+static struct rtattr *nest_start(struct nlmsghdr *n, int maxlen, int type)
+{
+	struct rtattr *nest = (struct rtattr *)
+		((char *)n + NLMSG_ALIGN(n->nlmsg_len));
+	if (addattr_l(n, maxlen, type, NULL, 0) < 0) return NULL;
+	return nest;
+}
+
+//! @brief Make a nested attribute cover what was added since nest_start()
+static void nest_end(struct nlmsghdr *n, struct rtattr *nest)
+{
+	nest->rta_len = (char *)n + NLMSG_ALIGN(n->nlmsg_len) - (char *)nest;
+}
+
+// Link requests go through one handle, opened on first use
+static struct rtnl_handle link_rth = { .fd = -1 };
+static struct rtnl_batch link_batch;
+
+//! @brief Get the handle link requests go through
+static struct rtnl_handle *link_handle(void)
+{
+	if (link_rth.fd < 0 && rtnl_open(&link_rth, 0) < 0) {
+		if (link_rth.fd >= 0) rtnl_close(&link_rth);
+		return NULL;
+	}
+	return &link_rth;
+}
+
+//! @brief Send a link request and wait for the kernel to ack it
+static int link_talk(struct link_req *req)
+{
+	struct rtnl_handle *rth = link_handle();
+	if (!rth) return -1;
+	return rtnl_talk(rth, &req->n, 0, 0, NULL, NULL, NULL);
+}
+
+//! @brief Report a queued link request the kernel refused, and flag it to
+//!	whoever queued it
+static int link_error(struct nlmsghdr *req, void *cookie, int err,
+	const char *msg, void *arg)
+{
+	if (cookie) *(int *)cookie = 1;
+	struct ifinfomsg *ifi = req ? NLMSG_DATA(req) : NULL;
+	VRRPLOG("set link %d %s:%s%s%s\n", ifi ? ifi->ifi_index : 0,
+		ifi && (ifi->ifi_flags & IFF_UP) ? "up" : "down",
+		strerror(err), msg ? ": " : "", msg ? msg : "");
+	return 1;
+}
+
+//! @brief Find a link by name in the link table, brought up to date first
+static int link_index(const char *name)
+{
+	ll_update();
+	return ll_name_to_index(name);
+}
+
+//! @brief Start a link request
+static void link_req_init(struct link_req *req, int type, int flags)
+{
+	memset(req, 0, sizeof(*req));
+	req->n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+	req->n.nlmsg_flags = NLM_F_REQUEST | flags;
+	req->n.nlmsg_type = type;
+	req->ifi.ifi_family = AF_UNSPEC;
+}
+
+//! @brief Create a macvlan carrying the given MAC, it is left down
+//! @param[in] name The name of the new link, a stale one is replaced
+//! @param[in] parent_idx The link it sits on
+//! @param[in] mac The MAC of the new link
+//! @param[in] mode MACVLAN_MODE_PRIVATE, MACVLAN_MODE_BRIDGE, ...
+//! @return The index of the new link, -1 on failure
+int macvlan_create(const char *name, int parent_idx, const char *mac,
+	enum macvlan_mode mode)
+{
+	struct link_req req;
+	int stale = link_index(name);
+	if (stale) macvlan_delete(stale);
+
+	link_req_init(&req, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL);
+	addattr_l(&req.n, sizeof(req), IFLA_IFNAME, (void *)name,
+		strlen(name) + 1);
+	addattr32(&req.n, sizeof(req), IFLA_LINK, parent_idx);
+	addattr_l(&req.n, sizeof(req), IFLA_ADDRESS, (void *)mac, MACSIZ);
+	struct rtattr *info = nest_start(&req.n, sizeof(req), IFLA_LINKINFO);
+	addattr_l(&req.n, sizeof(req), IFLA_INFO_KIND, "macvlan",
+		strlen("macvlan"));
+	struct rtattr *data = nest_start(&req.n, sizeof(req), IFLA_INFO_DATA);
+	addattr32(&req.n, sizeof(req), IFLA_MACVLAN_MODE, mode);
+	nest_end(&req.n, data);
+	nest_end(&req.n, info);
+
+	if (link_talk(&req) < 0) {
+		VRRPLOG("create macvlan %s:%s\n", name, strerror(errno));
+		return -1;
+	}
+	int idx = link_index(name);
+	if (!idx) VRRPLOG("find macvlan %s\n", name);
+	return idx ? idx : -1;
+}
+
+//! @brief Queue bringing a link up or down, nothing else about it changes
+//! @param[in] ifidx The link
+//! @param[in] up Non-zero to bring it up
+//! @param[out] failed Set to 1 if the kernel refuses it, may be NULL
+//! @note Queued changes are sent together by macvlan_commit().
+//! @retval 0 Success
+//! @retval -1 Failure
+int macvlan_set_up(int ifidx, int up, int *failed)
+{
+	struct rtnl_handle *rth = link_handle();
+	if (!rth) return -1;
+	if (link_batch.rth != rth) {
+		rtnl_batch_init(&link_batch, rth, link_error, NULL);
+	}
+
+	struct link_req req;
+	link_req_init(&req, RTM_NEWLINK, 0);
+	req.ifi.ifi_index = ifidx;
+	req.ifi.ifi_change = IFF_UP;
+	req.ifi.ifi_flags = up ? IFF_UP : 0;
+	return rtnl_batch_add(&link_batch, &req.n, failed);
+}
+
+//! @brief Send the queued link changes in one go
+//! @return How many of them failed
+int macvlan_commit(void)
+{
+	if (!link_batch.rth) return 0;
+	return rtnl_batch_commit(&link_batch);
+}
+
+//! @brief Close the handle link requests go through
+void macvlan_close(void)
+{
+	if (link_rth.fd >= 0) rtnl_close(&link_rth);
+	link_rth.fd = -1;
+	link_batch.rth = NULL;
+}
+
+//! @brief Remove a link
+//! @param[in] ifidx The link
+//! @retval 0 Success
+//! @retval -1 Failure
+int macvlan_delete(int ifidx)
+{
+	struct link_req req;
+	link_req_init(&req, RTM_DELLINK, 0);
+	req.ifi.ifi_index = ifidx;
+	if (link_talk(&req) < 0) {
+		VRRPLOG("delete link %d:%s\n", ifidx, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
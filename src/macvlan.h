@@ -0,0 +1,12 @@
+#ifndef XTVRRPD_MACVLAN_H
+#define XTVRRPD_MACVLAN_H
+#include <linux/if_link.h>
+
+int macvlan_create(const char *name, int parent_idx, const char *mac,
+	enum macvlan_mode mode);
+int macvlan_set_up(int ifidx, int up, int *failed);
+int macvlan_commit(void);
+int macvlan_delete(int ifidx);
+void macvlan_close(void);
+
+#endif //XTVRRPD_MACVLAN_H
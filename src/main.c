@@ -6,13 +6,17 @@
 #include "daemon.h"
 
 extern struct vrrp_app app;
-extern volatile int evt_shutdown;
 
-//! @brief The signal handler of SIGINT and SIGTERM
+//! @brief The signal handler of SIGINT, SIGTERM and SIGUSR1
 //! @brief signo The signal number
-static void handling_shutdown(int signo)
+static void handling_signal(int signo)
 {
-	evt_shutdown = 1;
+	// Log the recent failovers, phase by phase
+	if (SIGUSR1 == signo) {
+		trace_dump(&app);
+		return;
+	}
+	reactor_stop(&app.loop);
 }
 
 int main(int argc, char **argv)
@@ -32,17 +36,24 @@ int main(int argc, char **argv)
 		}
 	}
 
-	// Set signal handler
-	struct sigaction shutdown_act;
-	shutdown_act.sa_handler = handling_shutdown;
-	sigemptyset(&shutdown_act.sa_mask);
-	shutdown_act.sa_flags=0; 
-	sigaction(SIGINT, &shutdown_act, NULL);
-	sigaction(SIGKILL, &shutdown_act, NULL);
-	sigaction(SIGTERM, &shutdown_act, NULL);
+	// Signals are delivered through the event loop, so block them
+	// before any thread is created
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
 
 	//
-	vrrp_initialize(&app);
+	if (vrrp_initialize(&app) < 0) {
+		VRRPLOG("Cannot initialize\n");
+		exit(EXIT_FAILURE);
+	}
+	if (reactor_add_signals(&app.loop, &mask, handling_signal) < 0) 
+	{
+		exit(EXIT_FAILURE);
+	}
 
 	// Run it
 	if (app.state_machine() < 0) { 
@@ -0,0 +1,96 @@
+#ifndef XTVRRPD_PROBES_H
+#define XTVRRPD_PROBES_H
+
+/**
+ * USDT probes of the "bxvrrpd" provider, for bpftrace, perf and SystemTap.
+ * A probe is one nop until a tracer attaches, its arguments are left where
+ * they already are and described in the .note.stapsdt section. Build with
+ * -DNO_PROBES to leave them out entirely.
+ *
+ *	bpftrace -e 'usdt:./bxvrrpd3:bxvrrpd:transition {
+ *		printf("%s/%d %d -> %d\n", str(arg0), arg1, arg2, arg3); }'
+ *
+ * <sys/sdt.h> is used when it is installed, otherwise the same notes are
+ * emitted here. Arguments are integers or pointers, at most four.
+ */
+
+#if defined(NO_PROBES)
+
+#define PROBE0(name)			do {} while (0)
+#define PROBE1(name, a)			do {} while (0)
+#define PROBE2(name, a, b)		do {} while (0)
+#define PROBE3(name, a, b, c)		do {} while (0)
+#define PROBE4(name, a, b, c, d)	do {} while (0)
+
+#elif defined(__has_include) && __has_include(<sys/sdt.h>)
+
+#include <sys/sdt.h>
+#define PROBE0(name)			STAP_PROBE(bxvrrpd, name)
+#define PROBE1(name, a)			STAP_PROBE1(bxvrrpd, name, a)
+#define PROBE2(name, a, b)		STAP_PROBE2(bxvrrpd, name, a, b)
+#define PROBE3(name, a, b, c)		STAP_PROBE3(bxvrrpd, name, a, b, c)
+#define PROBE4(name, a, b, c, d)	STAP_PROBE4(bxvrrpd, name, a, b, c, d)
+
+#else
+
+#ifdef __LP64__
+#define _PROBE_ADDR	".8byte"
+#else
+#define _PROBE_ADDR	".4byte"
+#endif
+
+// The note of a probe, version 3 of the SystemTap SDT format. The base
+// symbol lets tools find how far the binary was relocated.
+#define _PROBE_ASM(name, args) \
+	"990:	nop\n" \
+	"	.pushsection .note.stapsdt,\"?\",\"note\"\n" \
+	"	.balign 4\n" \
+	"	.4byte 992f-991f, 994f-993f, 3\n" \
+	"991:	.asciz \"stapsdt\"\n" \
+	"992:	.balign 4\n" \
+	"993:	" _PROBE_ADDR " 990b\n" \
+	"	" _PROBE_ADDR " _.stapsdt.base\n" \
+	"	" _PROBE_ADDR " 0\n" \
+	"	.asciz \"bxvrrpd\"\n" \
+	"	.asciz \"" #name "\"\n" \
+	"	.asciz \"" args "\"\n" \
+	"994:	.balign 4\n" \
+	"	.popsection\n" \
+	"	.ifndef _.stapsdt.base\n" \
+	"	.pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+	"	.weak _.stapsdt.base\n" \
+	"	.hidden _.stapsdt.base\n" \
+	"_.stapsdt.base: .space 1\n" \
+	"	.size _.stapsdt.base, 1\n" \
+	"	.popsection\n" \
+	"	.endif\n"
+
+// "SIZE@OPERAND", a negative SIZE is signed. %n prints the constant
+// negated, so signed types give a positive one.
+#define _PROBE_SIZE(x) _Generic((x) + 0, \
+	int: 4, long: (int)sizeof(long), long long: 8, \
+	default: -(int)sizeof((x) + 0))
+#define _PROBE_ARG(n, x) [_s##n] "n" (_PROBE_SIZE(x)), [_a##n] "nor" ((x) + 0)
+#define _PROBE_FMT(n) "%n[_s" #n "]@%[_a" #n "]"
+
+#define PROBE0(name) \
+	__asm__ __volatile__ (_PROBE_ASM(name, ""))
+#define PROBE1(name, a) \
+	__asm__ __volatile__ (_PROBE_ASM(name, _PROBE_FMT(1)) \
+		:: _PROBE_ARG(1, a))
+#define PROBE2(name, a, b) \
+	__asm__ __volatile__ (_PROBE_ASM(name, _PROBE_FMT(1) " " \
+		_PROBE_FMT(2)) :: _PROBE_ARG(1, a), _PROBE_ARG(2, b))
+#define PROBE3(name, a, b, c) \
+	__asm__ __volatile__ (_PROBE_ASM(name, _PROBE_FMT(1) " " \
+		_PROBE_FMT(2) " " _PROBE_FMT(3)) \
+		:: _PROBE_ARG(1, a), _PROBE_ARG(2, b), _PROBE_ARG(3, c))
+#define PROBE4(name, a, b, c, d) \
+	__asm__ __volatile__ (_PROBE_ASM(name, _PROBE_FMT(1) " " \
+		_PROBE_FMT(2) " " _PROBE_FMT(3) " " _PROBE_FMT(4)) \
+		:: _PROBE_ARG(1, a), _PROBE_ARG(2, b), _PROBE_ARG(3, c), \
+		_PROBE_ARG(4, d))
+
+#endif
+
+#endif //XTVRRPD_PROBES_H
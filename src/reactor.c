@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include "vrrp_common.h"
+#include "reactor.h"
+
+//! @brief The wheel's timerfd is readable
+static void reactor_tick(struct reactor_io *io, uint32_t events)
+{
+	struct reactor *r = io->arg;
+	uint64_t ticks;
+
+	// Expired timers already ran before dispatching, just drain it
+	if (read(io->fd, &ticks, sizeof(ticks)) == sizeof(ticks)) {
+		r->tick_at = TW_NEVER;
+	}
+}
+
+//! @brief Open the event loop
+//! @retval 0 Success
+//! @retval -1 Failure
+int reactor_open(struct reactor *r)
+{
+	memset(r, 0, sizeof(*r));
+	r->sig.fd = -1;
+	r->tick.fd = -1;
+	r->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (r->epfd < 0) {
+		VRRPLOG("open epoll:%s\n", strerror(errno));
+		return -1;
+	}
+
+	tw_init(&r->wheel, now_nsec());
+	r->tick_at = TW_NEVER;
+	r->tick.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (r->tick.fd < 0) {
+		VRRPLOG("open timerfd:%s\n", strerror(errno));
+		return -1;
+	}
+	r->tick.cb = reactor_tick;
+	r->tick.arg = r;
+	return reactor_add_io(r, &r->tick, EPOLLIN);
+}
+
+//! @brief Close the event loop and the descriptors it owns
+void reactor_close(struct reactor *r)
+{
+	if (r->sig.fd >= 0) close(r->sig.fd);
+	if (r->tick.fd >= 0) close(r->tick.fd);
+	close(r->epfd);
+}
+
+//! @brief Watch a file descriptor, its callback runs when it is ready
+//! @param[in] r The event loop
+//! @param[in] io The file descriptor and its callback
+//! @param[in] events The epoll events to wait for
+//! @retval 0 Success
+//! @retval -1 Failure
+int reactor_add_io(struct reactor *r, struct reactor_io *io, uint32_t events)
+{
+	struct epoll_event ev = {
+		.events = events,
+		.data.ptr = io,
+	};
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, io->fd, &ev) < 0) {
+		VRRPLOG("epoll add fd %d:%s\n", io->fd, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+//! @brief Stop watching a file descriptor
+int reactor_del_io(struct reactor *r, struct reactor_io *io)
+{
+	return epoll_ctl(r->epfd, EPOLL_CTL_DEL, io->fd, NULL);
+}
+
+//! @brief Read the pending signals and hand them over
+static void reactor_signal(struct reactor_io *io, uint32_t events)
+{
+	struct reactor *r = io->arg;
+	struct signalfd_siginfo si;
+
+	while (read(io->fd, &si, sizeof(si)) == sizeof(si)) {
+		r->on_signal(si.ssi_signo);
+	}
+}
+
+//! @brief Deliver the given signals through the event loop
+//! @param[in] r The event loop
+//! @param[in] mask The signals, they are blocked for the whole process
+//! @param[in] on_signal Called with each received signal number
+//! @note Block the signals before any thread is created, so no thread
+//!	takes them the old way.
+//! @retval 0 Success
+//! @retval -1 Failure
+int reactor_add_signals(struct reactor *r, const sigset_t *mask,
+	void (*on_signal)(int signo))
+{
+	if (sigprocmask(SIG_BLOCK, mask, NULL) < 0) {
+		VRRPLOG("block signals:%s\n", strerror(errno));
+		return -1;
+	}
+	r->sig.fd = signalfd(-1, mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (r->sig.fd < 0) {
+		VRRPLOG("open signalfd:%s\n", strerror(errno));
+		return -1;
+	}
+	r->sig.cb = reactor_signal;
+	r->sig.arg = r;
+	r->on_signal = on_signal;
+	return reactor_add_io(r, &r->sig, EPOLLIN);
+}
+
+//! @brief Point the timerfd at the next step of the wheel
+//! @note Most arms move a timer behind the earliest one, so the timerfd
+//!	is only touched when the next step changed. A step that only
+//!	cascades wakes the loop early, it finds nothing to run.
+static int reactor_sync_tick(struct reactor *r)
+{
+	uint64_t next = tw_next(&r->wheel);
+	struct itimerspec its;
+
+	if (next == r->tick_at) return 0;
+	memset(&its, 0, sizeof(its));
+	if (TW_NEVER != next) {
+		its.it_value.tv_sec = next / NSEC_FROM_SEC(1);
+		its.it_value.tv_nsec = next % NSEC_FROM_SEC(1);
+		if (!next) its.it_value.tv_nsec = 1; // zero would disarm it
+	}
+	if (timerfd_settime(r->tick.fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		VRRPLOG("arm timer:%s\n", strerror(errno));
+		return -1;
+	}
+	r->tick_at = next;
+	return 0;
+}
+
+//! @brief A timer of the wheel expired
+static void reactor_timer_expired(struct tw_timer *tw)
+{
+	struct reactor_timer *t = (struct reactor_timer *)tw;
+	PROBE2(timer_expire, t, t->cb);
+	t->cb(t);
+}
+
+//! @brief Set up a timer, it is not armed yet
+//! @param[in] r The event loop
+//! @param[out] t The timer
+//! @param[in] cb Called when the timer fires
+//! @param[in] arg Anything the callback needs, as |t->arg|
+//! @retval 0 Success
+//! @retval -1 Failure
+int reactor_timer_init(struct reactor *r, struct reactor_timer *t,
+	void (*cb)(struct reactor_timer *t), void *arg)
+{
+	memset(&t->tw, 0, sizeof(t->tw));
+	t->tw.cb = reactor_timer_expired;
+	t->r = r;
+	t->cb = cb;
+	t->arg = arg;
+	return 0;
+}
+
+//! @brief (Re)arm a timer
+//! @param[in] t The timer
+//! @param[in] usec Fire after this many usecs
+int reactor_timer_arm(struct reactor_timer *t, uint32_t usec)
+{
+	tw_add(&t->r->wheel, &t->tw, now_nsec() + NSEC_FROM_USEC(usec));
+	return 0;
+}
+
+//! @brief (Re)arm a timer at an absolute time
+//! @param[in] t The timer
+//! @param[in] nsec When to fire, on the now_nsec() clock
+int reactor_timer_arm_at(struct reactor_timer *t, uint64_t nsec)
+{
+	tw_add(&t->r->wheel, &t->tw, nsec);
+	return 0;
+}
+
+//! @brief Disarm a timer
+//! @note The timerfd is left alone, an early wakeup finds nothing to run.
+int reactor_timer_cancel(struct reactor_timer *t)
+{
+	tw_del(&t->r->wheel, &t->tw);
+	return 0;
+}
+
+//! @brief Dispatch events until reactor_stop() is called
+//! @retval 0 Stopped
+//! @retval -1 Failure
+int reactor_run(struct reactor *r)
+{
+	struct epoll_event evs[REACTOR_EVENTS_MAX];
+
+	while (!r->stop) {
+		if (reactor_sync_tick(r) < 0) return -1;
+		int n = epoll_wait(r->epfd, evs, REACTOR_EVENTS_MAX, -1);
+		if (n < 0) {
+			if (EINTR == errno) continue;
+			VRRPLOG("epoll wait:%s\n", strerror(errno));
+			return -1;
+		}
+		tw_advance(&r->wheel, now_nsec());
+		for (int i = 0; i < n && !r->stop; ++i) {
+			struct reactor_io *io = evs[i].data.ptr;
+			io->cb(io, evs[i].events);
+		}
+	}
+	return 0;
+}
+
+//! @brief Make reactor_run() return after the current callback
+void reactor_stop(struct reactor *r)
+{
+	r->stop = 1;
+}
@@ -0,0 +1,51 @@
+#ifndef XTVRRPD_REACTOR_H
+#define XTVRRPD_REACTOR_H
+#include <stdint.h>
+#include <signal.h>
+#include "timer_wheel.h"
+
+#define REACTOR_EVENTS_MAX	64
+
+//! @brief A file descriptor watched by the reactor
+struct reactor_io {
+	int 		fd;
+	void 		(*cb)(struct reactor_io *io, uint32_t events);
+	void 		*arg;
+};
+
+struct reactor;
+
+//! @brief A one-shot timer
+struct reactor_timer {
+	struct tw_timer tw;		// linked into the reactor's wheel
+	struct reactor 	*r;
+	void 		(*cb)(struct reactor_timer *t);
+	void 		*arg;
+};
+
+//! @brief The event loop
+struct reactor {
+	int 		epfd;
+	volatile int 	stop;
+	struct reactor_io sig;		// the signalfd
+	void 		(*on_signal)(int signo);
+	struct reactor_io tick;		// one timerfd for the whole wheel
+	uint64_t 	tick_at;	// nsec it is armed for, TW_NEVER if not
+	struct timer_wheel wheel;
+};
+
+int reactor_open(struct reactor *r);
+void reactor_close(struct reactor *r);
+int reactor_add_io(struct reactor *r, struct reactor_io *io, uint32_t events);
+int reactor_del_io(struct reactor *r, struct reactor_io *io);
+int reactor_add_signals(struct reactor *r, const sigset_t *mask,
+	void (*on_signal)(int signo));
+int reactor_timer_init(struct reactor *r, struct reactor_timer *t,
+	void (*cb)(struct reactor_timer *t), void *arg);
+int reactor_timer_arm(struct reactor_timer *t, uint32_t usec);
+int reactor_timer_arm_at(struct reactor_timer *t, uint64_t nsec);
+int reactor_timer_cancel(struct reactor_timer *t);
+int reactor_run(struct reactor *r);
+void reactor_stop(struct reactor *r);
+
+#endif //XTVRRPD_REACTOR_H
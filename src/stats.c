@@ -0,0 +1,512 @@
+#define _GNU_SOURCE	// accept4(), open_memstream()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "vrrp_common.h"
+#include "stats.h"
+
+#define LABEL_VALUE_LEN		(2 * IFNAMSIZ)	// an escaped interface name
+
+static const char *state_names[STATS_STATES] = { "init", "master", "backup" };
+
+//! @brief A drop counter every interface has
+struct iface_counter {
+	const char 	*reason;
+	size_t 		off;		// in struct iface_stats
+};
+
+static const struct iface_counter iface_counters[] = {
+	{ "length", 	offsetof(struct iface_stats, rx_bad_len) },
+	{ "ttl", 	offsetof(struct iface_stats, rx_bad_ttl) },
+	{ "version", 	offsetof(struct iface_stats, rx_bad_version) },
+	{ "checksum", 	offsetof(struct iface_stats, rx_bad_cksum) },
+};
+
+static const char *phase_names[PHASE_MAX] = {
+	"wait", "rt_fetch", "hwaddr", "own_mac", "rt_restore", "macvlan",
+	"vip", "announce"
+};
+
+//! @brief Escape a label value, the exposition format takes \\, \" and \n
+//!	in its quotes
+//! @param[in] in The value
+//! @param[out] out Where to, cut short if it has no room
+//! @param[in] size The size of |out|
+//! @return |out|
+static const char *label_escape(const char *in, char *out, size_t size)
+{
+	size_t n = 0;
+
+	for (; *in && n + 1 < size; ++in) {
+		char c = *in;
+		if ('\\' == c || '"' == c || '\n' == c) {
+			if (n + 2 >= size) break;
+			out[n++] = '\\';
+			if ('\n' == c) c = 'n';
+		}
+		out[n++] = c;
+	}
+	out[n] = 0;
+	return out;
+}
+
+//! @brief Write one histogram, in seconds
+//! @param[in] fp Where to
+//! @param[in] name The metric name
+//! @param[in] labels The labels telling it from others of |name|
+//! @param[in] h The histogram
+static void render_hist(FILE *fp, const char *name, const char *labels,
+	const struct hist *h)
+{
+	uint64_t cum = 0;
+
+	// Empty buckets add nothing to the cumulative counts, leave them out
+	for (int i = 0; i < HIST_BUCKETS - 1; ++i) {
+		if (!h->buckets[i]) continue;
+		cum += h->buckets[i];
+		fprintf(fp, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels,
+			hist_bucket_max(i) / 1e6, (unsigned long long)cum);
+	}
+	fprintf(fp, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels,
+		(unsigned long long)h->count);
+	fprintf(fp, "%s_sum{%s} %g\n", name, labels, h->sum / 1e6);
+	fprintf(fp, "%s_count{%s} %llu\n", name, labels,
+		(unsigned long long)h->count);
+}
+
+//! @brief A metric, rendered a virtual router or an interface at a time
+struct stats_section {
+	const char 	*name;
+	const char 	*help;
+	const char 	*type;
+	int 		per_iface;	// else per virtual router
+	//! @brief Write the series of one router or interface
+	//! @param[in] item The router or interface
+	//! @param[in] iface The escaped name of its interface
+	void 		(*render)(FILE *fp, const struct stats_section *sec,
+				const void *item, const char *iface);
+	size_t 		off;		// of the value it renders, if any
+};
+
+static void render_state(FILE *fp, const struct stats_section *sec,
+	const void *item, const char *iface)
+{
+	const struct vrrp_inst *inst = item;
+
+	fprintf(fp, "%s{iface=\"%s\",vrid=\"%d\"} %d\n", sec->name, iface,
+		inst->vrid, inst->state);
+}
+
+//! @brief A counter in struct inst_stats
+static void render_inst_counter(FILE *fp, const struct stats_section *sec,
+	const void *item, const char *iface)
+{
+	const struct vrrp_inst *inst = item;
+	const uint64_t *v = (const uint64_t *)
+		((const char *)&inst->stats + sec->off);
+
+	fprintf(fp, "%s{iface=\"%s\",vrid=\"%d\"} %llu\n", sec->name, iface,
+		inst->vrid, (unsigned long long)*v);
+}
+
+static void render_transitions(FILE *fp, const struct stats_section *sec,
+	const void *item, const char *iface)
+{
+	const struct vrrp_inst *inst = item;
+
+	for (int from = 0; from < STATS_STATES; ++from) {
+		for (int to = 0; to < STATS_STATES; ++to) {
+			uint64_t n = inst->stats.transitions[from][to];
+			if (!n) continue;
+			fprintf(fp, "%s{iface=\"%s\",vrid=\"%d\",from=\"%s\","
+				"to=\"%s\"} %llu\n", sec->name, iface,
+				inst->vrid, state_names[from], state_names[to],
+				(unsigned long long)n);
+		}
+	}
+}
+
+//! @brief A histogram in struct inst_stats
+static void render_inst_hist(FILE *fp, const struct stats_section *sec,
+	const void *item, const char *iface)
+{
+	const struct vrrp_inst *inst = item;
+	char labels[LABEL_VALUE_LEN + 32];
+
+	snprintf(labels, sizeof(labels), "iface=\"%s\",vrid=\"%d\"", iface,
+		inst->vrid);
+	render_hist(fp, sec->name, labels, (const struct hist *)
+		((const char *)&inst->stats + sec->off));
+}
+
+//! @brief A histogram in struct vrrp_iface
+static void render_iface_hist(FILE *fp, const struct stats_section *sec,
+	const void *item, const char *iface)
+{
+	char labels[LABEL_VALUE_LEN + 32];
+
+	snprintf(labels, sizeof(labels), "iface=\"%s\"", iface);
+	render_hist(fp, sec->name, labels, (const struct hist *)
+		((const char *)item + sec->off));
+}
+
+static void render_phases(FILE *fp, const struct stats_section *sec,
+	const void *item, const char *iface)
+{
+	const struct vrrp_iface *ifp = item;
+	char labels[LABEL_VALUE_LEN + 32];
+
+	for (int p = 0; p < PHASE_MAX; ++p) {
+		if (!ifp->failover.phases[p].count) continue;
+		snprintf(labels, sizeof(labels), "iface=\"%s\",phase=\"%s\"",
+			iface, phase_names[p]);
+		render_hist(fp, sec->name, labels, &ifp->failover.phases[p]);
+	}
+}
+
+static void render_drops(FILE *fp, const struct stats_section *sec,
+	const void *item, const char *iface)
+{
+	const struct vrrp_iface *ifp = item;
+
+	for (size_t c = 0;
+		c < sizeof(iface_counters) / sizeof(iface_counters[0]); ++c)
+	{
+		const uint64_t *v = (const uint64_t *)
+			((const char *)&ifp->stats + iface_counters[c].off);
+		fprintf(fp, "%s{iface=\"%s\",reason=\"%s\"} %llu\n", sec->name,
+			iface, iface_counters[c].reason,
+			(unsigned long long)*v);
+	}
+}
+
+//! @brief A counter in struct vrrp_iface
+static void render_iface_counter(FILE *fp, const struct stats_section *sec,
+	const void *item, const char *iface)
+{
+	const uint64_t *v = (const uint64_t *)((const char *)item + sec->off);
+
+	fprintf(fp, "%s{iface=\"%s\"} %llu\n", sec->name, iface,
+		(unsigned long long)*v);
+}
+
+static const struct stats_section sections[] = {
+	{ "vrrp_state", "State of a virtual router, 0 init, 1 master, 2 backup",
+		"gauge", 0, render_state, 0 },
+	{ "vrrp_adverts_sent_total", "Advertisements queued to be sent",
+		"counter", 0, render_inst_counter,
+		offsetof(struct inst_stats, tx_adverts) },
+	{ "vrrp_adverts_received_total", "Advertisements taken",
+		"counter", 0, render_inst_counter,
+		offsetof(struct inst_stats, rx_adverts) },
+	{ "vrrp_adverts_mismatched_total",
+		"Advertisements dropped for other VIPs, interval or "
+		"authentication", "counter", 0, render_inst_counter,
+		offsetof(struct inst_stats, rx_mismatch) },
+	{ "vrrp_adverts_priority_zero_total",
+		"Advertisements of a master shutting down",
+		"counter", 0, render_inst_counter,
+		offsetof(struct inst_stats, rx_prio0) },
+	{ "vrrp_transitions_total", "State changes of a virtual router",
+		"counter", 0, render_transitions, 0 },
+	{ "vrrp_advert_interval_seconds",
+		"Time between advertisements taken",
+		"histogram", 0, render_inst_hist,
+		offsetof(struct inst_stats, adver_gap) },
+	{ "vrrp_takeover_seconds", "Time from the last advertisement of the "
+		"master to taking over", "histogram", 0, render_inst_hist,
+		offsetof(struct inst_stats, takeover) },
+	{ "vrrp_failover_seconds", "Time from a state change to having "
+		"applied it on the interface", "histogram", 1,
+		render_iface_hist,
+		offsetof(struct vrrp_iface, failover.total) },
+	{ "vrrp_failover_phase_seconds",
+		"Time a step of applying state changes took",
+		"histogram", 1, render_phases, 0 },
+	{ "vrrp_adverts_dropped_total", "Advertisements dropped before "
+		"reaching a virtual router, those for other VRIDs are dropped "
+		"by the kernel uncounted", "counter", 1, render_drops, 0 },
+	{ "vrrp_tx_packets_total", "Advertisements sent",
+		"counter", 1, render_iface_counter,
+		offsetof(struct vrrp_iface, tx_pkts) },
+	{ "vrrp_tx_syscalls_total", "Syscalls advertisements took to send",
+		"counter", 1, render_iface_counter,
+		offsetof(struct vrrp_iface, tx_calls) },
+	{ "vrrp_garp_packets_total",
+		"Gratuitous ARPs and unsolicited NAs sent",
+		"counter", 1, render_iface_counter,
+		offsetof(struct vrrp_iface, garp.tx_pkts) },
+};
+
+#define NUM_OF_SECTIONS		(sizeof(sections) / sizeof(sections[0]))
+
+//! @brief Render the next chunk of a scrape in Prometheus text format
+//! @param[in] app The daemon-wide setting
+//! @param[in,out] c The scrape, its written chunk is replaced
+//! @retval 0 Success, |c->len| is 0 once every metric is out
+//! @retval -1 Failure
+static int client_render(const struct vrrp_app *app, struct stats_client *c)
+{
+	char iface[LABEL_VALUE_LEN];
+	FILE *fp;
+
+	free(c->buf);
+	c->buf = NULL;
+	c->off = 0;
+	fp = open_memstream(&c->buf, &c->len);
+	if (!fp) return -1;
+
+	while (c->sec < (int)NUM_OF_SECTIONS && ftell(fp) < STATS_CHUNK_LEN) {
+		const struct stats_section *sec = &sections[c->sec];
+		int n = sec->per_iface ? app->num_of_iface : app->num_of_inst;
+
+		if (!c->item) {
+			fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", sec->name,
+				sec->help, sec->name, sec->type);
+		} else if (sec->per_iface) {
+			const struct vrrp_iface *ifp = app->ifaces[c->item - 1];
+			sec->render(fp, sec, ifp, label_escape(ifp->name,
+				iface, sizeof(iface)));
+		} else {
+			const struct vrrp_inst *inst = app->insts[c->item - 1];
+			sec->render(fp, sec, inst, label_escape(
+				inst->iface->name, iface, sizeof(iface)));
+		}
+		if (++c->item > n) {
+			++c->sec;
+			c->item = 0;
+		}
+	}
+
+	if (fclose(fp)) {
+		free(c->buf);
+		c->buf = NULL;
+		c->len = 0;
+		return -1;
+	}
+	return 0;
+}
+
+//! @brief Hang up on a scrape
+static void client_close(struct stats_server *s, struct stats_client *c)
+{
+	// Not registered if adding it failed
+	reactor_del_io(s->r, &c->io);
+	close(c->io.fd);
+	c->io.fd = -1;
+	free(c->buf);
+	c->buf = NULL;
+}
+
+//! @brief Write out as much of a chunk as the socket takes
+//! @retval 0 Written, or the socket is full
+//! @retval -1 The reader went away
+static int client_write(struct stats_client *c)
+{
+	while (c->off < c->len) {
+		ssize_t n = send(c->io.fd, c->buf + c->off, c->len - c->off,
+			MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0) {
+			if (EINTR == errno) continue;
+			return (EAGAIN == errno) ? 0 : -1;
+		}
+		c->off += n;
+	}
+	return 0;
+}
+
+//! @brief A scrape can take more
+//! @note One chunk is rendered per wakeup, the routers get the loop in
+//!	between however many there are to scrape.
+static void on_client(struct reactor_io *io, uint32_t events)
+{
+	struct stats_server *s = io->arg;
+	struct stats_client *c = (struct stats_client *)io;
+
+	if (events & (EPOLLERR | EPOLLHUP)) goto done;
+	if (c->off == c->len &&
+		(client_render(s->app, c) < 0 || !c->len))
+	{
+		goto done;
+	}
+	if (client_write(c) < 0) goto done;
+	return;
+done:
+	client_close(s, c);
+}
+
+//! @brief Scrapes are waiting to be accepted
+//! @note Nothing is rendered here, on_client() does it a chunk at a time as
+//!	the socket drains. Counters may move between chunks, each series is
+//!	still read in one go.
+static void on_accept(struct reactor_io *io, uint32_t events)
+{
+	struct stats_server *s = io->arg;
+	int fd;
+
+	while ((fd = accept4(io->fd, NULL, NULL,
+		SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+	{
+		struct stats_client *c = NULL;
+		for (int i = 0; i < STATS_CLIENT_MAX; ++i) {
+			if (s->clients[i].io.fd < 0) {
+				c = &s->clients[i];
+				break;
+			}
+		}
+		if (!c) {
+			// Too many at once, it can try again
+			close(fd);
+			continue;
+		}
+
+		c->io.fd = fd;
+		c->buf = NULL;
+		c->len = c->off = 0;
+		c->sec = c->item = 0;
+		if (reactor_add_io(s->r, &c->io, EPOLLOUT) < 0) {
+			client_close(s, c);
+		}
+	}
+}
+
+//! @brief Serve the counters on a Unix socket
+//! @param[out] s The server
+//! @param[in] r The event loop it runs in
+//! @param[in] app The daemon-wide setting, whose counters are served
+//! @param[in] path Where the socket is, a stale one there is replaced
+//! @retval 0 Success
+//! @retval -1 Failure
+int stats_open(struct stats_server *s, struct reactor *r,
+	struct vrrp_app *app, const char *path)
+{
+	struct stat st;
+
+	memset(s, 0, sizeof(*s));
+	s->r = r;
+	s->app = app;
+	s->io.fd = -1;
+	for (int i = 0; i < STATS_CLIENT_MAX; ++i) {
+		s->clients[i].io.fd = -1;
+		s->clients[i].io.cb = on_client;
+		s->clients[i].io.arg = s;
+	}
+
+	s->addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(s->addr.sun_path)) {
+		VRRPLOG("stats socket path %s is too long\n", path);
+		goto err;
+	}
+	strcpy(s->addr.sun_path, path);
+	if (!stat(path, &st) && S_ISSOCK(st.st_mode)) unlink(path);
+
+	s->io.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		0);
+	if (s->io.fd < 0) {
+		VRRPLOG("open stats socket:%s\n", strerror(errno));
+		goto err;
+	}
+	if (bind(s->io.fd, (struct sockaddr *)&s->addr, sizeof(s->addr)) < 0 ||
+		listen(s->io.fd, STATS_CLIENT_MAX) < 0)
+	{
+		VRRPLOG("bind stats socket %s:%s\n", path, strerror(errno));
+		goto err;
+	}
+	s->io.cb = on_accept;
+	s->io.arg = s;
+	return reactor_add_io(r, &s->io, EPOLLIN);
+err:
+	if (s->io.fd >= 0) close(s->io.fd);
+	s->r = NULL;
+	return -1;
+}
+
+//! @brief Stop serving the counters and remove the socket
+void stats_close(struct stats_server *s)
+{
+	if (!s->r) return;
+	for (int i = 0; i < STATS_CLIENT_MAX; ++i) {
+		if (s->clients[i].io.fd >= 0) client_close(s, &s->clients[i]);
+	}
+	close(s->io.fd);
+	unlink(s->addr.sun_path);
+	s->r = NULL;
+}
+
+//! @brief Start timing the state changes an interface is about to apply
+//! @param[in,out] fs The failovers of the interface
+//! @note The wait phase runs from the first change noted on it.
+void trace_begin(struct failover_stats *fs)
+{
+	uint64_t now = now_nsec();
+
+	memset(&fs->cur, 0, sizeof(fs->cur));
+	fs->cur.start_nsec = fs->pending_nsec ? fs->pending_nsec : now;
+	if (fs->pending_nsec) {
+		fs->cur.phase_usec[PHASE_WAIT] = (now - fs->pending_nsec) / 1000;
+		fs->cur.ran |= 1 << PHASE_WAIT;
+	}
+	fs->pending_nsec = 0;
+	fs->mark_nsec = now;
+}
+
+//! @brief A phase just ended, it ran since the previous one
+void trace_mark(struct failover_stats *fs, enum failover_phase phase)
+{
+	uint64_t now = now_nsec();
+
+	fs->cur.phase_usec[phase] += (now - fs->mark_nsec) / 1000;
+	fs->cur.ran |= 1 << phase;
+	fs->mark_nsec = now;
+}
+
+//! @brief The state changes are applied, record how long it took
+//! @param[in,out] fs The failovers of the interface
+//! @param[in] num_of_master Masters on the interface now
+void trace_end(struct failover_stats *fs, int num_of_master)
+{
+	struct failover_trace *t = &fs->cur;
+
+	t->end_nsec = fs->mark_nsec;
+	t->num_of_master = num_of_master;
+	for (int p = 0; p < PHASE_MAX; ++p) {
+		if (t->ran & (1 << p)) hist_add(&fs->phases[p], t->phase_usec[p]);
+	}
+	hist_add(&fs->total, (t->end_nsec - t->start_nsec) / 1000);
+	fs->ring[fs->seq++ % TRACE_RING_LEN] = *t;
+}
+
+//! @brief Log the recent failovers of every interface, newest first
+void trace_dump(const struct vrrp_app *app)
+{
+	for (int i = 0; i < app->num_of_iface; ++i) {
+		const struct vrrp_iface *ifp = app->ifaces[i];
+		const struct failover_stats *fs = &ifp->failover;
+		uint64_t n = fs->seq < TRACE_RING_LEN ? fs->seq : TRACE_RING_LEN;
+
+		for (uint64_t k = 1; k <= n; ++k) {
+			const struct failover_trace *t =
+				&fs->ring[(fs->seq - k) % TRACE_RING_LEN];
+			char buf[PHASE_MAX * 24] = "";
+			int len = 0;
+			for (int p = 0; p < PHASE_MAX; ++p) {
+				if (!(t->ran & (1 << p))) continue;
+				len += snprintf(buf + len, sizeof(buf) - len,
+					" %s %u", phase_names[p],
+					t->phase_usec[p]);
+			}
+			VRRPLOG("%s failover #%llu, %d masters:%s, total %llu "
+				"usec\n", ifp->name,
+				(unsigned long long)(fs->seq - k),
+				t->num_of_master, buf,
+				(unsigned long long)
+				((t->end_nsec - t->start_nsec) / 1000));
+		}
+	}
+}
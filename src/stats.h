@@ -0,0 +1,159 @@
+#ifndef XTVRRPD_STATS_H
+#define XTVRRPD_STATS_H
+#include <stdint.h>
+#include <sys/un.h>
+#include "reactor.h"
+
+struct vrrp_app;
+
+#define HIST_SUB_BITS		2	// 4 buckets per power of two, 25% wide
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS		(HIST_SUB * 36)	// up to 2^36 usec, ~19 hours
+#define STATS_STATES		3	// INIT, MASTER and BACKUP
+#define STATS_CLIENT_MAX	4	// scrapes served at once
+#define STATS_CHUNK_LEN		16384	// rendered per write a scrape takes
+#define TRACE_RING_LEN		32	// failovers kept per interface
+
+//! @brief The steps of applying state changes on an interface, in order
+enum failover_phase {
+	PHASE_WAIT = 0,		// the reconcile window
+	PHASE_RT_FETCH,		// rt_cache_update(), the route dump
+	PHASE_HWADDR,		// set_hwaddr(), the link bounce
+	PHASE_OWN_MAC,		// iface_accept_own_mac()
+	PHASE_RT_RESTORE,	// rt_cache_restore(), the route replay
+	PHASE_MACVLAN,		// macvlans up or down
+	PHASE_VIP,		// accept mode addresses
+	PHASE_ANNOUNCE,		// ARP responder and GARP engine update
+	PHASE_MAX
+};
+
+/**
+ * Every counter is only touched by the thread running the event loop, which
+ * also serves the scrapes, so neither side takes a lock or makes a syscall
+ * to update or read them.
+ */
+
+//! @brief A log-linear histogram of usec values, in the manner of HDR
+//!	histograms: exact below 2 * HIST_SUB, then HIST_SUB buckets for
+//!	each power of two.
+struct hist {
+	uint64_t 	count;
+	uint64_t 	sum;
+	uint64_t 	buckets[HIST_BUCKETS];
+};
+
+//! @brief Advertisements an interface dropped before a router took them
+//! @note Adverts for no router of ours are dropped by the socket filter,
+//!	uncounted, see vrrp_adver_filter().
+struct iface_stats {
+	uint64_t 	rx_bad_len;
+	uint64_t 	rx_bad_ttl;	// or hop limit
+	uint64_t 	rx_bad_version;
+	uint64_t 	rx_bad_cksum;	// IPv4 only, the kernel checks IPv6
+};
+
+//! @brief What a virtual router sent, took and went through
+struct inst_stats {
+	uint64_t 	tx_adverts;	// queued to be sent
+	uint64_t 	rx_adverts;	// taken by the state machine
+	uint64_t 	rx_mismatch;	// other VIPs, interval or authentication
+	uint64_t 	rx_prio0;	// the master is shutting down
+	uint64_t 	transitions[STATS_STATES][STATS_STATES]; // [from][to]
+	uint64_t 	last_rx_nsec;	// when |rx_adverts| last grew
+	struct hist 	adver_gap;	// usecs between the adverts taken
+	struct hist 	takeover;	// usecs from the last advert to master
+};
+
+//! @brief How long applying the state changes on an interface took
+struct failover_trace {
+	uint64_t 	start_nsec;	// the first change it applies
+	uint64_t 	end_nsec;
+	uint32_t 	phase_usec[PHASE_MAX];
+	uint32_t 	ran;		// bit per phase that ran
+	int 		num_of_master;	// masters on it once applied
+};
+
+//! @brief The failovers of an interface, phase by phase
+struct failover_stats {
+	uint64_t 	pending_nsec;	// first change not applied, 0 if none
+	uint64_t 	mark_nsec;	// when the running phase began
+	struct failover_trace cur;
+	uint64_t 	seq;		// traces recorded, the newest is at
+					// |ring[(seq - 1) % TRACE_RING_LEN]|
+	struct failover_trace ring[TRACE_RING_LEN];
+	struct hist 	phases[PHASE_MAX];
+	struct hist 	total;
+};
+
+//! @brief A scrape being written out
+struct stats_client {
+	struct reactor_io io;		// -1 if the slot is free
+	char 		*buf;
+	size_t 		len;
+	size_t 		off;		// written so far
+	int 		sec;		// the metric rendered next
+	int 		item;		// in |sec|, 0 is its HELP and TYPE,
+					// then a router or interface each
+};
+
+//! @brief Serves the counters in Prometheus text format on a Unix socket,
+//!	one scrape per connection
+struct stats_server {
+	struct reactor 	*r;
+	struct reactor_io io;		// listening, -1 if not serving
+	struct sockaddr_un addr;
+	struct vrrp_app *app;
+	struct stats_client clients[STATS_CLIENT_MAX];
+};
+
+//! @brief The bucket a value goes in
+static inline int hist_bucket(uint64_t v)
+{
+	if (v < 2 * HIST_SUB) return v;
+	int e = 63 - __builtin_clzll(v);
+	int idx = HIST_SUB * (e - HIST_SUB_BITS + 1) +
+		((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+	return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+//! @brief The largest value a bucket takes
+static inline uint64_t hist_bucket_max(int idx)
+{
+	if (idx < 2 * HIST_SUB) return idx;
+	int e = idx / HIST_SUB + HIST_SUB_BITS - 1;
+	uint64_t m = HIST_SUB + idx % HIST_SUB;
+	return ((m + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+//! @brief Record a value in a histogram
+static inline void hist_add(struct hist *h, uint64_t v)
+{
+	++h->buckets[hist_bucket(v)];
+	++h->count;
+	h->sum += v;
+}
+
+//! @brief Count an advertisement a virtual router took
+//! @param[in,out] st The counters of the virtual router
+//! @param[in] rx_nsec When it arrived, on the now_nsec() clock
+//! @param[in] priority The priority it carries
+static inline void stats_rx(struct inst_stats *st, uint64_t rx_nsec,
+	int priority)
+{
+	if (st->last_rx_nsec && rx_nsec > st->last_rx_nsec) {
+		hist_add(&st->adver_gap, (rx_nsec - st->last_rx_nsec) / 1000);
+	}
+	st->last_rx_nsec = rx_nsec;
+	++st->rx_adverts;
+	if (!priority) ++st->rx_prio0;
+}
+
+int stats_open(struct stats_server *s, struct reactor *r,
+	struct vrrp_app *app, const char *path);
+void stats_close(struct stats_server *s);
+void trace_begin(struct failover_stats *fs);
+void trace_mark(struct failover_stats *fs, enum failover_phase phase);
+void trace_end(struct failover_stats *fs, int num_of_master);
+void trace_dump(const struct vrrp_app *app);
+
+#endif //XTVRRPD_STATS_H
@@ -0,0 +1,171 @@
+#include <string.h>
+#include "timer_wheel.h"
+
+#define TW_WORDS	(TW_SLOTS / 64)
+#define TW_SHIFT(l)	((l) * TW_BITS)
+#define TW_SPAN(l)	((uint64_t)1 << TW_SHIFT((l) + 1))
+#define TW_DIGIT(t, l)	((int)(((t) >> TW_SHIFT(l)) & TW_MASK))
+
+//! @brief Find the first occupied slot at or after |start|
+//! @return The slot index, -1 if there is none
+static int tw_find(const uint64_t *bitmap, int start)
+{
+	for (int w = start >> 6; w < TW_WORDS; ++w) {
+		uint64_t bits = bitmap[w];
+		if (w == (start >> 6)) bits &= ~0ULL << (start & 63);
+		if (bits) return (w << 6) + __builtin_ctzll(bits);
+	}
+	return -1;
+}
+
+//! @brief Link a timer into the slot its deadline belongs to
+//! @note The level is picked by the distance from now, so a slot index
+//!	below the current digit of that level belongs to the next round.
+static void tw_link(struct timer_wheel *tw, struct tw_timer *t)
+{
+	uint64_t now = tw->now;
+	uint64_t e = (t->expires < now) ? now : t->expires;
+	if (e - now >= TW_SPAN(TW_LEVELS - 1)) {
+		// Park it in the last slot, it is placed again from there
+		e = now + TW_SPAN(TW_LEVELS - 1) - 1;
+	}
+
+	int level = 0;
+	while (level < TW_LEVELS - 1 && e - now >= TW_SPAN(level)) ++level;
+	int idx = TW_DIGIT(e, level);
+
+	struct tw_timer **head = &tw->slots[level][idx];
+	t->next = *head;
+	if (t->next) t->next->pprev = &t->next;
+	t->pprev = head;
+	t->slot = level * TW_SLOTS + idx;
+	*head = t;
+	tw->bitmap[level][idx >> 6] |= 1ULL << (idx & 63);
+}
+
+//! @brief Unlink a timer from the slot it sits in
+static void tw_unlink(struct timer_wheel *tw, struct tw_timer *t)
+{
+	*t->pprev = t->next;
+	if (t->next) t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+//! @brief Clear the bit of a slot if it became empty
+static inline void tw_sync_bit(struct timer_wheel *tw, int level, int idx)
+{
+	if (!tw->slots[level][idx]) {
+		tw->bitmap[level][idx >> 6] &= ~(1ULL << (idx & 63));
+	}
+}
+
+//! @brief Initialize an empty wheel
+//! @param[out] tw The wheel
+//! @param[in] now The current time in nsec
+void tw_init(struct timer_wheel *tw, uint64_t now)
+{
+	memset(tw, 0, sizeof(*tw));
+	tw->now = now;
+}
+
+//! @brief Add a timer, or move it if it is already pending
+//! @param[in] tw The wheel
+//! @param[in] t The timer, |t->cb| must be set
+//! @param[in] expires The deadline in nsec
+void tw_add(struct timer_wheel *tw, struct tw_timer *t, uint64_t expires)
+{
+	tw_del(tw, t);
+	t->expires = expires;
+	tw_link(tw, t);
+	++tw->count;
+}
+
+//! @brief Cancel a timer, it is fine if it is not pending
+void tw_del(struct timer_wheel *tw, struct tw_timer *t)
+{
+	if (!tw_pending(t)) return;
+	tw_unlink(tw, t);
+	tw_sync_bit(tw, t->slot / TW_SLOTS, t->slot % TW_SLOTS);
+	--tw->count;
+}
+
+//! @brief Find the first slot of a level that is due, in wheel order
+//! @return The slot index, -1 if the level is empty
+static int tw_first(const struct timer_wheel *tw, int level)
+{
+	// A slot equal to the current digit of an upper level was already
+	// cascaded, so it belongs to the next round
+	int start = TW_DIGIT(tw->now, level) + (level ? 1 : 0);
+	int idx = (start < TW_SLOTS) ? tw_find(tw->bitmap[level], start) : -1;
+	if (idx < 0) idx = tw_find(tw->bitmap[level], 0);
+	return idx;
+}
+
+//! @brief Get the next time a slot has to be expired or cascaded
+//! @return The time in nsec, TW_NEVER if there is no timer
+//! @note It is never after the earliest deadline, but may be before it
+//!	when an upper slot only cascades then. Only the first slot of each
+//!	level is looked at, however many timers share it.
+uint64_t tw_next(const struct timer_wheel *tw)
+{
+	uint64_t next = TW_NEVER;
+	uint64_t now = tw->now;
+
+	for (int level = 0; level < TW_LEVELS; ++level) {
+		int idx = tw_first(tw, level);
+		if (idx < 0) continue;
+
+		uint64_t span = TW_SPAN(level);
+		uint64_t at = (now & ~(span - 1)) |
+			((uint64_t)idx << TW_SHIFT(level));
+		if (at < now || (level && at == now)) at += span;
+		if (at < next) next = at;
+	}
+	return next;
+}
+
+//! @brief Move timers of an upper slot down to where they belong now
+static void tw_cascade(struct timer_wheel *tw, int level, int idx)
+{
+	struct tw_timer *t;
+	while ((t = tw->slots[level][idx])) {
+		tw_unlink(tw, t);
+		tw_link(tw, t);
+	}
+	tw_sync_bit(tw, level, idx);
+}
+
+//! @brief Run the wheel up to the given time, firing expired timers
+//! @param[in] tw The wheel
+//! @param[in] now The current time in nsec
+//! @note Callbacks may add or cancel any timer, including their own.
+void tw_advance(struct timer_wheel *tw, uint64_t now)
+{
+	while (tw->count) {
+		uint64_t at = tw_next(tw);
+		if (at > now) break;
+		tw->now = at;
+
+		for (int level = TW_LEVELS - 1; level > 0; --level) {
+			if (at & ((1ULL << TW_SHIFT(level)) - 1)) continue;
+			int idx = TW_DIGIT(at, level);
+			if (tw->slots[level][idx]) tw_cascade(tw, level, idx);
+		}
+
+		int idx = TW_DIGIT(at, 0);
+		struct tw_timer *t;
+		while ((t = tw->slots[0][idx])) {
+			tw_unlink(tw, t);
+			if (t->expires > at) {
+				tw_link(tw, t);
+				continue;
+			}
+			--tw->count;
+			tw_sync_bit(tw, 0, idx);
+			t->cb(t);
+		}
+		tw_sync_bit(tw, 0, idx);
+	}
+	if (now > tw->now) tw->now = now;
+}
@@ -0,0 +1,42 @@
+#ifndef XTVRRPD_TIMER_WHEEL_H
+#define XTVRRPD_TIMER_WHEEL_H
+#include <stdint.h>
+
+// 6 levels of 256 slots at 1 nsec resolution cover 2^48 nsec (~78 hours),
+// later deadlines park in the last slot and cascade again.
+#define TW_BITS		8
+#define TW_SLOTS	(1 << TW_BITS)
+#define TW_MASK		(TW_SLOTS - 1)
+#define TW_LEVELS	6
+#define TW_NEVER	UINT64_MAX
+
+//! @brief A timer linked into the wheel
+struct tw_timer {
+	struct tw_timer *next;
+	struct tw_timer **pprev;	// NULL when not pending
+	uint64_t 	expires;	// nsec
+	int 		slot;		// level * TW_SLOTS + index
+	void 		(*cb)(struct tw_timer *t);
+};
+
+//! @brief A hierarchical timing wheel
+struct timer_wheel {
+	uint64_t 	now;		// nsec the wheel has run up to
+	uint64_t 	bitmap[TW_LEVELS][TW_SLOTS / 64];
+	struct tw_timer *slots[TW_LEVELS][TW_SLOTS];
+	int 		count;
+};
+
+void tw_init(struct timer_wheel *tw, uint64_t now);
+void tw_add(struct timer_wheel *tw, struct tw_timer *t, uint64_t expires);
+void tw_del(struct timer_wheel *tw, struct tw_timer *t);
+uint64_t tw_next(const struct timer_wheel *tw);
+void tw_advance(struct timer_wheel *tw, uint64_t now);
+
+//! @brief See if a timer is linked into a wheel
+static inline int tw_pending(const struct tw_timer *t)
+{
+	return t->pprev != NULL;
+}
+
+#endif //XTVRRPD_TIMER_WHEEL_H
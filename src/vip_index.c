@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "vip_index.h"
+
+#define VIP_INDEX_MIN	16	// slots
+
+//! @brief Hash a key, every byte of it counts
+static inline uint32_t vip_hash(const struct vip_key *key)
+{
+	uint64_t w[3];
+	memcpy(w, key, sizeof(w));
+	uint64_t h = w[0] * 0x9E3779B97F4A7C15ULL;
+	h ^= w[1] * 0xC2B2AE3D27D4EB4FULL;
+	h ^= w[2] * 0x165667B19E3779F9ULL;
+	// Finalizer of MurmurHash3, spreads the high bits down
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	return (uint32_t)h;
+}
+
+//! @brief Set up an empty index
+//! @param[out] idx The index
+//! @param[in] capacity How many keys will go in, at most
+//! @note It is kept at most half full, so a lookup takes one or two
+//!	probes whatever the number of VIPs.
+//! @retval 0 Success
+//! @retval -1 Failure
+int vip_index_init(struct vip_index *idx, int capacity)
+{
+	uint32_t n = VIP_INDEX_MIN;
+	while (n < 2 * (uint32_t)capacity) n <<= 1;
+
+	idx->slots = calloc(n, sizeof(*idx->slots));
+	if (!idx->slots) return -1;
+	idx->mask = n - 1;
+	idx->count = 0;
+	return 0;
+}
+
+//! @brief Find the slot of a key, or the free one it would go in
+static struct vip_slot* vip_probe(const struct vip_index *idx,
+	const struct vip_key *key)
+{
+	for (uint32_t i = vip_hash(key); ; ++i) {
+		struct vip_slot *s = &idx->slots[i & idx->mask];
+		if (!s->key.family || !memcmp(&s->key, key, sizeof(*key))) {
+			return s;
+		}
+	}
+}
+
+//! @brief Add a key
+//! @param[in] idx The index
+//! @param[in] key The key, |family| must be set
+//! @param[in] val What it maps to, not negative
+//! @retval 0 Success
+//! @retval 1 The key is already there, it is left alone
+//! @retval -1 The index is full
+int vip_index_add(struct vip_index *idx, const struct vip_key *key, int val)
+{
+	if (2 * (uint32_t)(idx->count + 1) > idx->mask + 1) return -1;
+
+	struct vip_slot *s = vip_probe(idx, key);
+	if (s->key.family) return 1;
+	s->key = *key;
+	s->val = val;
+	++idx->count;
+	return 0;
+}
+
+//! @brief Look a key up
+//! @return What it maps to, -1 if it is not there
+int vip_index_find(const struct vip_index *idx, const struct vip_key *key)
+{
+	if (!idx->slots) return -1;
+	const struct vip_slot *s = vip_probe(idx, key);
+	return s->key.family ? s->val : -1;
+}
+
+//! @brief Release an index
+void vip_index_free(struct vip_index *idx)
+{
+	free(idx->slots);
+	idx->slots = NULL;
+	idx->mask = 0;
+	idx->count = 0;
+}
@@ -0,0 +1,50 @@
+#ifndef XTVRRPD_VIP_INDEX_H
+#define XTVRRPD_VIP_INDEX_H
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+
+//! @brief What a VIP is looked up by
+struct vip_key {
+	uint8_t 	addr[16];	// network byteorder, IPv4 uses 4
+	uint8_t 	family;		// AF_INET or AF_INET6, 0 marks free
+	uint8_t 	vrid;		// 0 if it does not matter
+	uint16_t 	pad;
+	int32_t 	ifidx;		// 0 if it does not matter
+};
+
+//! @brief A slot of the index
+struct vip_slot {
+	struct vip_key 	key;
+	int 		val;
+};
+
+//! @brief An open-addressed hash of VIPs, sized once for what goes in
+struct vip_index {
+	struct vip_slot *slots;
+	uint32_t 	mask;		// number of slots - 1, a power of 2
+	int 		count;
+};
+
+int vip_index_init(struct vip_index *idx, int capacity);
+int vip_index_add(struct vip_index *idx, const struct vip_key *key, int val);
+int vip_index_find(const struct vip_index *idx, const struct vip_key *key);
+void vip_index_free(struct vip_index *idx);
+
+//! @brief Fill a lookup key
+//! @param[out] key The key
+//! @param[in] family AF_INET or AF_INET6
+//! @param[in] addr The VIP (in network byteorder)
+//! @param[in] ifidx The interface, 0 if it does not matter
+//! @param[in] vrid The virtual router, 0 if it does not matter
+static inline void vip_key_set(struct vip_key *key, int family,
+	const void *addr, int ifidx, int vrid)
+{
+	memset(key, 0, sizeof(*key));
+	memcpy(key->addr, addr, (AF_INET6 == family) ? 16 : 4);
+	key->family = family;
+	key->vrid = vrid;
+	key->ifidx = ifidx;
+}
+
+#endif //XTVRRPD_VIP_INDEX_H
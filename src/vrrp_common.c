@@ -1,22 +1,30 @@
+#define _GNU_SOURCE	// recvmmsg(), sendmmsg()
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <assert.h>
 #include <errno.h>
-#include <pthread.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <linux/ip.h>
-#include <netpacket/packet.h>
-#include <sys/time.h>
+#include <linux/filter.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include "vrrp_common.h"
 #include "arp.h"
+#include "arp_responder.h"
 #include "ifconfig.h"
 #include "iproute.h"
+#include "macvlan.h"
+#include "ipaddr.h"
+
+#ifndef IPV6_FREEBIND
+#define IPV6_FREEBIND	78
+#endif
 
-//extern struct vrrp_app app;
 #define IPADDR_STR_LEN 16 // 255.255.255.255'\0'
 #define HWADDR_STR_LEN 18 // 00-00-00-00-00-00'\0'
 
@@ -45,13 +53,29 @@ static inline char* hwaddr_to_str(const unsigned char *hwaddr)
 }
 
 
-//! @brief Get current time in usecs
-//! @return The current usec time
-uint32_t now_usec(void)
+//! @brief Read CLOCK_MONOTONIC, glibc serves it from the vDSO
+//! @return The monotonic nsec time
+static uint64_t monotonic_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return NSEC_FROM_SEC((uint64_t)ts.tv_sec) + ts.tv_nsec;
+}
+
+static uint64_t (*clock_source)(void) = monotonic_nsec;
+
+//! @brief Get current time in nsecs
+//! @return The current nsec time, it never goes back nor wraps
+uint64_t now_nsec(void)
+{
+	return clock_source();
+}
+
+//! @brief Replace the clock all timers run on, e.g. by a fake one in tests
+//! @param[in] src The new clock, NULL to go back to CLOCK_MONOTONIC
+void set_clock_source(uint64_t (*src)(void))
 {
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	return USEC_FROM_SEC(tv.tv_sec) + tv.tv_usec;
+	clock_source = src ? src : monotonic_nsec;
 }
 
 //! @brief See if the given file already exists
@@ -97,16 +121,433 @@ int check_pidfile(char *buff, size_t buffsiz, const char *tag)
 	return 0;
 }
 
+#define ADVER_FILTER_MAX	(2 * (VRID_MAX + 1) + 16)
+
+//! @brief Generate the classic BPF program that only accepts
+//!	advertisements for the virtual routers running on the interface
+//! @note TTL and version are left to the receive path, which counts
+//!	what it drops for them, adverts for other VRIDs are the bulk and
+//!	never leave the kernel.
+//! @param[out] prog Where to store the instructions
+//! @param[in] ifp The interface
+//! @param[in] family The address family of the socket
+//! @return The number of instructions
+static int adver_filter_build(struct sock_filter *prog,
+	const struct vrrp_iface *ifp, int family)
+{
+	int n = 0;
+	int ipv6 = (AF_INET6 == family);
+
+	if (!ifp->num_of_inst) {
+		prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+		return n;
+	}
+
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+		SKF_AD_OFF + SKF_AD_IFINDEX);
+	prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+		ifp->idx, 1, 0);
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+	// X = IP header length, the VRRP header follows, IPv6 raw sockets
+	// see no IP header
+	if (ipv6) {
+		prog[n++] = (struct sock_filter)BPF_STMT(
+			BPF_LDX | BPF_W | BPF_IMM, 0);
+	} else {
+		prog[n++] = (struct sock_filter)BPF_STMT(
+			BPF_LDX | BPF_B | BPF_MSH, 0);
+	}
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_IND, 1);
+	// One compare and one accept per VRID keeps every jump in range
+	for (int v = 1; v <= VRID_MAX; ++v) {
+		const struct vrrp_inst *inst = ifp->vrid_map[v];
+		if (!inst || inst->use_ipv4 == ipv6) continue;
+		prog[n++] = (struct sock_filter)BPF_JUMP(
+			BPF_JMP | BPF_JEQ | BPF_K, v, 0, 1);
+		prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+			0xFFFF);
+	}
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+	return n;
+}
+
+//! @brief Let the kernel drop advertisements no virtual router on the
+//!	interface cares about, call it whenever its VRID set changes
+//! @param[in] ifp The interface, its open sockets get a filter each
+//! @retval 0 Success
+//! @retval -1 Failure
+int vrrp_adver_filter(struct vrrp_iface *ifp)
+{
+	static struct sock_filter prog[ADVER_FILTER_MAX];
+	const int socks[] = { ifp->sock, ifp->sock6 };
+	const int families[] = { AF_INET, AF_INET6 };
+
+	for (int i = 0; i < 2; ++i) {
+		if (socks[i] < 0) continue;
+		struct sock_fprog fprog = {
+			.len = adver_filter_build(prog, ifp, families[i]),
+			.filter = prog,
+		};
+		if (setsockopt(socks[i], SOL_SOCKET, SO_ATTACH_FILTER,
+			&fprog, sizeof(fprog)) < 0)
+		{
+			VRRPLOG("attach adver filter:%s\n", strerror(errno));
+			return -1;
+		}
+
+		// Drop whatever got queued before the filter was in place
+		char buff[RECV_BUFSIZ];
+		while (recv(socks[i], buff, sizeof(buff), MSG_DONTWAIT) >= 0);
+	}
+	return 0;
+}
+
+//! @brief Preallocated buffers advertisements are received into
+struct vrrp_rxring {
+	struct mmsghdr 	msgs[RECV_BATCH];
+	struct iovec 	iovs[RECV_BATCH];
+	struct sockaddr_in6 names[RECV_BATCH];	// IPv6 senders
+	char 		bufs[RECV_BATCH][RECV_BUFSIZ];
+	char 		ctrl[RECV_BATCH][RECV_CTRL_LEN];
+};
+
+//! @brief Allocate the receive ring of an interface
+//! @retval 0 Success
+//! @retval -1 Failure
+static int rxring_open(struct vrrp_iface *ifp)
+{
+	struct vrrp_rxring *ring = calloc(1, sizeof(*ring));
+	if (!ring) {
+		VRRPLOG("alloc receive ring:%s\n", strerror(errno));
+		return -1;
+	}
+	for (int i = 0; i < RECV_BATCH; ++i) {
+		ring->iovs[i].iov_base = ring->bufs[i];
+		ring->iovs[i].iov_len = RECV_BUFSIZ;
+		ring->msgs[i].msg_hdr.msg_iov = &ring->iovs[i];
+		ring->msgs[i].msg_hdr.msg_iovlen = 1;
+		ring->msgs[i].msg_hdr.msg_control = ring->ctrl[i];
+		ring->msgs[i].msg_hdr.msg_name = &ring->names[i];
+		ifp->rx[i].buff = ring->bufs[i];
+	}
+	ifp->rxring = ring;
+	return 0;
+}
+
+//! @brief Receive the advertisements queued on an interface
+//! @param[in] ifp The interface, results are in |ifp->rx|
+//! @param[in] sock Its IPv4 or IPv6 advertisement socket
+//! @return The number of advertisements, RECV_BATCH means there may
+//!	be more, -1 on failure
+int vrrp_recv_batch(struct vrrp_iface *ifp, int sock)
+{
+	struct vrrp_rxring *ring = ifp->rxring;
+	for (int i = 0; i < RECV_BATCH; ++i) {
+		ring->msgs[i].msg_hdr.msg_controllen = RECV_CTRL_LEN;
+		ring->msgs[i].msg_hdr.msg_namelen = sizeof(ring->names[i]);
+	}
+
+	int n = recvmmsg(sock, ring->msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+	if (n < 0) {
+		if (EAGAIN == errno || EINTR == errno) return 0;
+		VRRPLOG("recv adver:%s\n", strerror(errno));
+		return -1;
+	}
+
+	// Kernel stamps are CLOCK_REALTIME, map them onto our clock
+	struct timespec real;
+	clock_gettime(CLOCK_REALTIME, &real);
+	uint64_t now = now_nsec();
+	uint64_t real_now = NSEC_FROM_SEC((uint64_t)real.tv_sec) + real.tv_nsec;
+
+	for (int i = 0; i < n; ++i) {
+		struct msghdr *msg = &ring->msgs[i].msg_hdr;
+		struct vrrp_rx *pkt = &ifp->rx[i];
+		pkt->len = ring->msgs[i].msg_len;
+		pkt->ifindex = ifp->idx;
+		pkt->hoplimit = -1;
+		pkt->src6 = ring->names[i].sin6_addr;
+		pkt->rx_nsec = now;
+
+		for (struct cmsghdr *c = CMSG_FIRSTHDR(msg); c;
+			c = CMSG_NXTHDR(msg, c))
+		{
+			if (IPPROTO_IP == c->cmsg_level &&
+				IP_PKTINFO == c->cmsg_type)
+			{
+				struct in_pktinfo info;
+				memcpy(&info, CMSG_DATA(c), sizeof(info));
+				pkt->ifindex = info.ipi_ifindex;
+			} else if (IPPROTO_IPV6 == c->cmsg_level &&
+				IPV6_PKTINFO == c->cmsg_type)
+			{
+				struct in6_pktinfo info;
+				memcpy(&info, CMSG_DATA(c), sizeof(info));
+				pkt->ifindex = info.ipi6_ifindex;
+			} else if (IPPROTO_IPV6 == c->cmsg_level &&
+				IPV6_HOPLIMIT == c->cmsg_type)
+			{
+				memcpy(&pkt->hoplimit, CMSG_DATA(c),
+					sizeof(pkt->hoplimit));
+			} else if (SOL_SOCKET == c->cmsg_level &&
+				SO_TIMESTAMPNS == c->cmsg_type)
+			{
+				struct timespec ts;
+				memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+				uint64_t stamp = NSEC_FROM_SEC((uint64_t)ts.tv_sec) +
+					ts.tv_nsec;
+				uint64_t age = real_now - stamp;
+				// A clock step may make it look from the future
+				if (stamp <= real_now && age < now) {
+					pkt->rx_nsec = now - age;
+				}
+			}
+		}
+	}
+	return n;
+}
+
+//! @brief Adverts of an interface waiting to go out in one sendmmsg()
+struct vrrp_txq {
+	int 		n;
+	int 		sock;
+	union {
+		struct sockaddr_in v4;
+		struct sockaddr_in6 v6;
+	} dsts[TX_BATCH];
+	union {
+		struct cmsghdr 	align;
+		char 		buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+	} ctrls[TX_BATCH];	// source and link of each advert
+	struct mmsghdr 	msgs[TX_BATCH];
+	struct iovec 	iovs[TX_BATCH];
+	const struct vrrp_inst *insts[TX_BATCH];	// who queued each
+	uint8_t 	bufs[TX_BATCH][ADVER_MAX_LEN];
+};
+
+//! @brief The coalescing window of an interface is over
+//! @note Adverts wait on while transitions on the interface do, the
+//!	reconcile sends them once the VMACs are in place.
+static void on_tx_timer(struct reactor_timer *t)
+{
+	struct vrrp_iface *ifp = t->arg;
+
+	if (ifp->failover.pending_nsec) return;
+	vrrp_tx_flush(ifp);
+}
+
+//! @brief The transitions of an interface waited long enough
+static void on_reconcile_timer(struct reactor_timer *t)
+{
+	vrrp_iface_reconcile(t->arg);
+}
+
+//! @brief Allocate a transmit queue of an interface
+//! @param[in] ifp The interface
+//! @param[in] sock The advertisement socket it sends on
+//! @param[in] family The address family of |sock|
+//! @return The queue, NULL for failure
+static struct vrrp_txq* txq_open(const struct vrrp_iface *ifp, int sock,
+	int family)
+{
+	struct vrrp_txq *txq = calloc(1, sizeof(*txq));
+	if (!txq) {
+		VRRPLOG("alloc transmit queue:%s\n", strerror(errno));
+		return NULL;
+	}
+	txq->sock = sock;
+	for (int i = 0; i < TX_BATCH; ++i) {
+		struct msghdr *hdr = &txq->msgs[i].msg_hdr;
+		struct cmsghdr *c = &txq->ctrls[i].align;
+		txq->iovs[i].iov_base = txq->bufs[i];
+		hdr->msg_iov = &txq->iovs[i];
+		hdr->msg_iovlen = 1;
+		hdr->msg_name = &txq->dsts[i];
+		hdr->msg_control = txq->ctrls[i].buf;
+		if (AF_INET6 == family) {
+			struct sockaddr_in6 *dst = &txq->dsts[i].v6;
+			dst->sin6_family = AF_INET6;
+			inet_pton(AF_INET6, VRRP_MCAST6_ADDR_STR,
+				&dst->sin6_addr);
+			dst->sin6_scope_id = ifp->idx;
+			hdr->msg_namelen = sizeof(*dst);
+
+			struct in6_pktinfo info = {
+				.ipi6_addr = ifp->ipv6,
+				.ipi6_ifindex = ifp->idx,
+			};
+			c->cmsg_level = IPPROTO_IPV6;
+			c->cmsg_type = IPV6_PKTINFO;
+			c->cmsg_len = CMSG_LEN(sizeof(info));
+			memcpy(CMSG_DATA(c), &info, sizeof(info));
+			hdr->msg_controllen = CMSG_SPACE(sizeof(info));
+		} else {
+			struct sockaddr_in *dst = &txq->dsts[i].v4;
+			dst->sin_family = AF_INET;
+			dst->sin_addr.s_addr = VRRP_MCAST_ADDR_NW;
+			hdr->msg_namelen = sizeof(*dst);
+
+			struct in_pktinfo info = {
+				.ipi_ifindex = ifp->idx,
+				.ipi_spec_dst.s_addr = htonl(ifp->ipv4),
+			};
+			c->cmsg_level = IPPROTO_IP;
+			c->cmsg_type = IP_PKTINFO;
+			c->cmsg_len = CMSG_LEN(sizeof(info));
+			memcpy(CMSG_DATA(c), &info, sizeof(info));
+			hdr->msg_controllen = CMSG_SPACE(sizeof(info));
+		}
+	}
+	return txq;
+}
+
+//! @brief Set the link a queued advert leaves by
+//! @param[in,out] txq The transmit queue
+//! @param[in] i The advert
+//! @param[in] ifidx The link, the interface or a macvlan on it
+static void txq_set_link(struct vrrp_txq *txq, int i, int ifidx)
+{
+	struct cmsghdr *c = &txq->ctrls[i].align;
+	if (IPPROTO_IPV6 == c->cmsg_level) {
+		// The scope of the group has to be the link the PKTINFO names
+		txq->dsts[i].v6.sin6_scope_id = ifidx;
+		((struct in6_pktinfo *)CMSG_DATA(c))->ipi6_ifindex = ifidx;
+	} else {
+		((struct in_pktinfo *)CMSG_DATA(c))->ipi_ifindex = ifidx;
+	}
+}
+
+//! @brief Queue the advertisement image of a virtual router
+//! @param[in] inst The virtual router, its image is copied as it is now
+//! @note Adverts queued within the coalescing window of the first one
+//!	leave together, a full queue leaves at once.
+//! @note In macvlan mode an advert leaves by the macvlan of its router,
+//!	so it carries the VMAC as its source MAC (RFC 5798 7.3). The link
+//!	is picked when the queue is sent, after the reconcile of a
+//!	takeover brought the macvlan up, see on_tx_timer().
+//! @retval 0 Success
+//! @retval -1 Failure
+int vrrp_send_adver(struct vrrp_inst *inst)
+{
+	struct vrrp_iface *ifp = inst->iface;
+	struct vrrp_txq *txq = inst->use_ipv4 ? ifp->txq : ifp->txq6;
+
+	++inst->stats.tx_adverts;
+	PROBE3(adver_tx, ifp->name, inst->vrid, inst->adver_prio);
+	memcpy(txq->bufs[txq->n], inst->adver, inst->adver_len);
+	txq->iovs[txq->n].iov_len = inst->adver_len;
+	txq->insts[txq->n++] = inst;
+	if (!tw_pending(&ifp->tx_timer.tw)) {
+		reactor_timer_arm(&ifp->tx_timer, ifp->tx_window_usec);
+	}
+	if (TX_BATCH != txq->n) return 0;
+	// Full, the transitions it waits for cannot wait either
+	if (ifp->failover.pending_nsec) {
+		vrrp_iface_reconcile(ifp);
+		return 0;
+	}
+	return vrrp_tx_flush(ifp);
+}
+
+//! @brief Fit the TX window of an interface to the routers on it
+//! @param[in,out] ifp The interface
+//! @param[in] max_usec The window asked for
+//! @note An advert waits up to the window, which must stay well inside
+//!	the skew that tells backups apart, or it decides who takes over.
+//!	Called again whenever a skew on the interface changes.
+void vrrp_iface_tx_window(struct vrrp_iface *ifp, uint32_t max_usec)
+{
+	uint32_t usec = max_usec;
+
+	for (int v = 1; v <= VRID_MAX; ++v) {
+		const struct vrrp_inst *inst = ifp->vrid_map[v];
+		if (inst && inst->skew_usec / TX_WINDOW_SKEW_DIV < usec) {
+			usec = inst->skew_usec / TX_WINDOW_SKEW_DIV;
+		}
+	}
+	ifp->tx_window_usec = usec;
+}
+
+//! @brief When the next advertisement of a master is due
+//! @param[in] inst The virtual router
+//! @return The time on the now_nsec() clock
+//! @note Masters with the same interval fall due on one grid, so their
+//!	adverts leave in one batch. Joining the grid stretches or shrinks
+//!	one interval by at most half.
+uint64_t vrrp_adver_due(const struct vrrp_inst *inst)
+{
+	uint64_t period = NSEC_FROM_USEC(inst->adver_usec);
+	uint64_t now = now_nsec();
+	if (!period) return now;
+
+	uint64_t due = now + period;
+	due -= due % period;
+	if (due - now < period / 2) due += period;
+	return due;
+}
+
+//! @brief Send every advertisement in a transmit queue
+//! @retval 0 Success
+//! @retval -1 Failure, the queue is dropped
+static int txq_flush(struct vrrp_iface *ifp, struct vrrp_txq *txq)
+{
+	int sent = 0;
+
+	for (int i = 0; i < txq->n; ++i) {
+		const struct vrrp_inst *inst = txq->insts[i];
+		txq_set_link(txq, i,
+			inst->mvl_up > 0 ? inst->mvl_idx : ifp->idx);
+	}
+	while (sent < txq->n) {
+		int n = sendmmsg(txq->sock, txq->msgs + sent, txq->n - sent, 0);
+		++ifp->tx_calls;
+		if (n < 0) {
+			if (EINTR == errno) continue;
+			VRRPLOG("%s send adver:%s\n", ifp->name, strerror(errno));
+			break;
+		}
+		sent += n;
+	}
+	ifp->tx_pkts += sent;
+	int ret = (sent == txq->n) ? 0 : -1;
+	txq->n = 0;
+	return ret;
+}
+
+//! @brief Send every queued advertisement of an interface
+//! @param[in] ifp The interface
+//! @retval 0 Success
+//! @retval -1 Failure, the queue is dropped
+int vrrp_tx_flush(struct vrrp_iface *ifp)
+{
+	int ret = 0;
+
+	reactor_timer_cancel(&ifp->tx_timer);
+	if (ifp->txq && txq_flush(ifp, ifp->txq) < 0) ret = -1;
+	if (ifp->txq6 && txq_flush(ifp, ifp->txq6) < 0) ret = -1;
+	return ret;
+}
+
 //! @brief Open socket and join the multicast group 224.0.0.18
+//! @param[in] ifp The interface the socket is shared on
 //! @return socket fd for success or -1 for failure
-static int open_adver_socket(uint32_t if_ipv4)
+static int open_adver_socket(const struct vrrp_iface *ifp)
 {
+	uint32_t if_ipv4 = ifp->ipv4;
 	int sock = socket(PF_INET, SOCK_RAW, IPPROTO_VRRP);
 	if (sock < 0) {
 		VRRPLOG("open adver socket:%s\n", strerror(errno));
 		return -1;
 	}
 
+	// Only see advertisements arriving on this interface
+	if (setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, ifp->name,
+		strlen(ifp->name) + 1) < 0)
+	{
+		VRRPLOG("set option SO_BINDTODEVICE:%s\n", strerror(errno));
+		goto err;
+	}
+
 	struct ip_mreq req;
 	memset(&req, 0, sizeof(req));
 	req.imr_multiaddr.s_addr = VRRP_MCAST_ADDR_NW;
@@ -143,33 +584,155 @@ static int open_adver_socket(uint32_t if_ipv4)
 		goto err;
 	} 
 
+	// Tell where and when each advertisement arrived
+	int on = 1;
+	if (setsockopt(sock, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on)) < 0) {
+		VRRPLOG("set option IP_PKTINFO:%s\n", strerror(errno));
+		goto err;
+	}
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+		VRRPLOG("set option SO_TIMESTAMPNS:%s\n", strerror(errno));
+		goto err;
+	}
+
 	return sock;
 err:
 	close(sock);
 	return -1;
 }
 
-//! @brief Get the usec delta to see if the timer is expired
-//! @param[in] value Given timer value
-//! @param[in] upbound The upbound of delta
-//! @note If delta is greater than |upbound|, it means someone had put system 
-//!	clock back.
-//! @retval 0 No
-//! @retval 1 Yes
-int vrrp_timer_fires(uint32_t value, uint32_t upbound)
+//! @brief Open socket and join the multicast group ff02::12
+//! @param[in] ifp The interface the socket is shared on
+//! @note The kernel fills in and checks the VRRP checksum, which covers
+//!	the IPv6 pseudo header. Adverts leave from the link-local address
+//!	the interface had at startup, even while a MAC change keeps it
+//!	tentative or has replaced it.
+//! @return socket fd for success or -1 for failure
+static int open_adver_socket6(const struct vrrp_iface *ifp)
 {
-	int delta = value - now_usec();
-	if (0 > delta || delta > upbound) return 1;
-	return 0;
+	int sock = socket(PF_INET6, SOCK_RAW, IPPROTO_VRRP);
+	if (sock < 0) {
+		VRRPLOG("open adver6 socket:%s\n", strerror(errno));
+		return -1;
+	}
+
+	// Only see advertisements arriving on this interface
+	if (setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, ifp->name,
+		strlen(ifp->name) + 1) < 0)
+	{
+		VRRPLOG("set option SO_BINDTODEVICE:%s\n", strerror(errno));
+		goto err;
+	}
+
+	int on = 1;
+	if (setsockopt(sock, IPPROTO_IPV6, IPV6_FREEBIND, &on, sizeof(on)) < 0) {
+		VRRPLOG("set option IPV6_FREEBIND:%s\n", strerror(errno));
+		goto err;
+	}
+
+	int offset = 6;	// of the checksum in the VRRP header
+	if (setsockopt(sock, IPPROTO_IPV6, IPV6_CHECKSUM,
+		&offset, sizeof(offset)) < 0)
+	{
+		VRRPLOG("set option IPV6_CHECKSUM:%s\n", strerror(errno));
+		goto err;
+	}
+
+	struct ipv6_mreq req;
+	memset(&req, 0, sizeof(req));
+	inet_pton(AF_INET6, VRRP_MCAST6_ADDR_STR, &req.ipv6mr_multiaddr);
+	req.ipv6mr_interface = ifp->idx;
+	if (setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP,
+		&req, sizeof(req)) < 0)
+	{
+		VRRPLOG("set option IPV6_JOIN_GROUP:%s\n", strerror(errno));
+		goto err;
+	}
+	int loop = 0;
+	if (setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP,
+		&loop, sizeof(loop)) < 0)
+	{
+		VRRPLOG("set option IPV6_MULTICAST_LOOP:%s\n", strerror(errno));
+		goto err;
+	}
+	int ifidx = ifp->idx;
+	if (setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_IF,
+		&ifidx, sizeof(ifidx)) < 0)
+	{
+		VRRPLOG("set option IPV6_MULTICAST_IF:%s\n", strerror(errno));
+		goto err;
+	}
+	int hops = VRRP_IP_TTL;
+	if (setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
+		&hops, sizeof(hops)) < 0)
+	{
+		VRRPLOG("set option IPV6_MULTICAST_HOPS:%s\n", strerror(errno));
+		goto err;
+	}
+
+	// Tell where and when each advertisement arrived, and its hop limit
+	if (setsockopt(sock, IPPROTO_IPV6, IPV6_RECVPKTINFO,
+		&on, sizeof(on)) < 0)
+	{
+		VRRPLOG("set option IPV6_RECVPKTINFO:%s\n", strerror(errno));
+		goto err;
+	}
+	if (setsockopt(sock, IPPROTO_IPV6, IPV6_RECVHOPLIMIT,
+		&on, sizeof(on)) < 0)
+	{
+		VRRPLOG("set option IPV6_RECVHOPLIMIT:%s\n", strerror(errno));
+		goto err;
+	}
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+		VRRPLOG("set option SO_TIMESTAMPNS:%s\n", strerror(errno));
+		goto err;
+	}
+
+	return sock;
+err:
+	close(sock);
+	return -1;
 }
 
 //! @brief Free resources when shutdown
-//! @param[in] sock The socket number
-//! @param[in] pidfile PID file name
-int vrrp_shutdown(int sock, const char *pidfile)
+//! @param[in] app The daemon-wide setting
+int vrrp_shutdown(struct vrrp_app *app)
 {
-	close(sock);
-	unlink(pidfile);
+	for (int i = 0; i < app->num_of_inst; ++i) {
+		struct vrrp_inst *inst = app->insts[i];
+		if (inst->mvl_idx > 0) macvlan_delete(inst->mvl_idx);
+	}
+	macvlan_close();
+	ipaddr_close();
+	ll_close();
+	for (int i = 0; i < app->num_of_iface; ++i) {
+		struct vrrp_iface *ifp = app->ifaces[i];
+		VRRPLOG("%s sent %llu adverts in %llu syscalls\n", ifp->name,
+			(unsigned long long)ifp->tx_pkts,
+			(unsigned long long)ifp->tx_calls);
+		arp_responder_close(&ifp->arp_resp);
+		VRRPLOG("%s sent %llu garps in %llu syscalls\n", ifp->name,
+			(unsigned long long)ifp->garp.tx_pkts,
+			(unsigned long long)ifp->garp.tx_calls);
+		garp_close(&ifp->garp);
+		if (ifp->arp_ignore >= 0) {
+			set_arp_ignore(ifp->name, ifp->arp_ignore);
+		}
+		if (ifp->sock >= 0) close(ifp->sock);
+		if (ifp->sock6 >= 0) close(ifp->sock6);
+		if (ifp->uc_fd >= 0) close(ifp->uc_fd);
+		free(ifp->rxring);
+		free(ifp->txq);
+		free(ifp->txq6);
+	}
+	if (app->routes) {
+		rt_cache_close(app->routes);
+		free(app->routes);
+	}
+	vip_index_free(&app->vip_index);
+	stats_close(&app->stats);
+	reactor_close(&app->loop);
+	unlink(app->pidfile);
 	VRRPLOG("Shutdown now\n");
 	return 0;
 }
@@ -178,176 +741,838 @@ int vrrp_shutdown(int sock, const char *pidfile)
 //! param[in] app The given vrrp_app structure
 int vrrp_dump(struct vrrp_app *app)
 {
-	// Check options
-	printf("> Interface      : %s (idx%d, %s, %s)\n"
-		"> VRID           : %d\n"
-		"> priority       : %d\n"
-		"> preempt_mode   : %d\n"
-		"> accept_mode    : %d (v3 only)\n"
-		"> adver usec     : %u\n"
-		"> mstr adver usec: %u (v3 only)\n"
-		"> skew usec      : %u\n"
-		"> mstr down usec : %u\n", 
-		app->if_name, 
-		app->if_idx, 
-		ipaddr_to_str(app->if_ipv4), 
-		hwaddr_to_str((unsigned char *)app->if_mac),
-		app->vrid, 
-		app->priority, 
-		app->preempt_mode, 
-		app->accept_mode, 
-		app->adver_usec, 
-		app->mstr_adver_usec, 
-		app->skew_usec, 
-		app->mstr_down_usec); 
-	for (int i = 0; i < app->num_of_vaddr; i++) {
-		printf("%02d) %s\n",  i + 1, ipaddr_to_str(app->vaddrs[i]));
-	}
-	printf("***\n");
+	for (int n = 0; n < app->num_of_inst; ++n) {
+		struct vrrp_inst *inst = app->insts[n];
+		struct vrrp_iface *ifp = inst->iface;
+		char ip6_buf[INET6_ADDRSTRLEN];
+		// Check options
+		printf("> Interface      : %s (idx%d, %s, %s)\n"
+			"> VRID           : %d\n"
+			"> priority       : %d\n"
+			"> preempt_mode   : %d\n"
+			"> accept_mode    : %d (v3 only)\n"
+			"> adver usec     : %u\n"
+			"> mstr adver usec: %u (v3 only)\n"
+			"> skew usec      : %u\n"
+			"> mstr down usec : %u\n", 
+			ifp->name, 
+			ifp->idx, 
+			inst->use_ipv4 ? ipaddr_to_str(ifp->ipv4) :
+			inet_ntop(AF_INET6, &ifp->ipv6, ip6_buf,
+				sizeof(ip6_buf)),
+			hwaddr_to_str((unsigned char *)ifp->mac),
+			inst->vrid, 
+			inst->priority, 
+			inst->preempt_mode, 
+			inst->accept_mode, 
+			inst->adver_usec, 
+			inst->mstr_adver_usec, 
+			inst->skew_usec, 
+			inst->mstr_down_usec); 
+		for (int i = 0; i < inst->num_of_vaddr; i++) {
+			printf("%02d) %s\n",  i + 1, inst->use_ipv4 ?
+				ipaddr_to_str(inst->vaddrs[i]) :
+				inet_ntop(AF_INET6, &inst->vaddrs6[i], ip6_buf,
+					sizeof(ip6_buf)));
+		}
+		printf("***\n");
+	}
+	return 0;
+}
+
+//! @brief Find the interface by name, or set up a new one
+//! @param[in] app The daemon-wide setting
+//! @param[in] ifname The interface name
+//! @return The interface, NULL for failure
+struct vrrp_iface* vrrp_iface_get(struct vrrp_app *app, const char *ifname)
+{
+	for (int i = 0; i < app->num_of_iface; ++i) {
+		if (!strcmp(app->ifaces[i]->name, ifname)) {
+			return app->ifaces[i];
+		}
+	}
+	if (app->num_of_iface == IFACE_MAX_NUM) {
+		VRRPLOG("Too many interfaces\n");
+		return NULL;
+	}
+
+	struct vrrp_iface *ifp = calloc(1, sizeof(*ifp));
+	if (!ifp) return NULL;
+	snprintf(ifp->name, IFNAMSIZ, "%s", ifname);
+	ifp->sock = -1;
+	ifp->sock6 = -1;
+	ifp->uc_fd = -1;
+	ifp->garp.fd = -1;
+	ifp->arp_ignore = -1;
+	// Routers of the family it lacks are turned down when parsed
+	int has_ipv4 = (get_ipaddr(ifp->name, &ifp->ipv4) == 0);
+	int has_ipv6 = (get_ipv6_linklocal(ifp->name, &ifp->ipv6) == 0);
+	if ((get_hwaddr(ifp->name, ifp->mac) < 0) || (!has_ipv4 && !has_ipv6)) {
+		VRRPLOG("Get interface address failed\n");
+		goto err;
+	}
+	if (!has_ipv4) ifp->ipv4 = 0;
+	memcpy(ifp->cur_mac, ifp->mac, MACSIZ);
+	ifp->idx = if_nametoindex(ifp->name);
+	if (ifp->idx == 0) {
+		VRRPLOG("Get interface index failed\n");
+		goto err;
+	}
+	app->ifaces[app->num_of_iface++] = ifp;
+	return ifp;
+err:
+	free(ifp);
+	return NULL;
+}
+
+//! @brief Add a virtual router to the instance table
+//! @param[in] app The daemon-wide setting
+//! @param[in] dft The setting to start from (copied)
+//! @return The new instance, NULL for failure
+struct vrrp_inst* vrrp_inst_new(struct vrrp_app *app,
+	const struct vrrp_inst *dft)
+{
+	struct vrrp_inst **insts = realloc(app->insts, 
+		(app->num_of_inst + 1) * sizeof(*insts));
+	if (!insts) return NULL;
+	app->insts = insts;
+
+	// The advertisement image inside is cacheline aligned
+	struct vrrp_inst *inst = NULL;
+	if (posix_memalign((void **)&inst, CACHELINE_SIZE, sizeof(*inst))) {
+		return NULL;
+	}
+	memcpy(inst, dft, sizeof(*inst));
+	app->insts[app->num_of_inst++] = inst;
+	return inst;
+}
+
+//! @brief Run a virtual router on an interface
+//! @param[in] inst The virtual router
+//! @param[in] ifp The interface
+//! @retval 0 Success
+//! @retval -1 The VRID is already used on |ifp|
+int vrrp_inst_attach(struct vrrp_inst *inst, struct vrrp_iface *ifp)
+{
+	if (ifp->vrid_map[inst->vrid]) {
+		VRRPLOG("VRID %d is duplicated on %s\n", inst->vrid, ifp->name);
+		return -1;
+	}
+	inst->iface = ifp;
+	ifp->vrid_map[inst->vrid] = inst;
+	++ifp->num_of_inst;
+	if (!inst->use_ipv4) ++ifp->num_of_inst6;
+	return 0;
+}
+
+//! @brief Move a virtual router to another state, and count it
+//! @param[in] inst The virtual router
+//! @param[in] state The state it goes to
+//! @note A backup taking over is timed from the last advertisement it
+//!	took, which is how long the virtual router went without a master.
+void vrrp_inst_transit(struct vrrp_inst *inst, enum vrrp_state state)
+{
+	struct inst_stats *st = &inst->stats;
+
+	if (VRRP_MASTER == state && VRRP_BACKUP == inst->state &&
+		st->last_rx_nsec)
+	{
+		hist_add(&st->takeover, (now_nsec() - st->last_rx_nsec) / 1000);
+	}
+	++st->transitions[inst->state][state];
+	PROBE4(transition, inst->iface->name, inst->vrid, inst->state, state);
+	inst->state = state;
+}
+
+//! @brief Parse a gratuitous ARP schedule, REPEAT[:MSEC[:REFRESH_SEC]]
+//! @param[in] arg The option argument
+//! @param[in,out] sched Where to store the fields given
+//! @retval 0 Success
+//! @retval -1 Invalid schedule
+int vrrp_parse_garp(const char *arg, struct garp_sched *sched)
+{
+	int repeat;
+	int msec = sched->interval_usec / 1000;
+	int refresh = SEC_FROM_USEC(sched->refresh_usec);
+	char tail;
+
+	int n = sscanf(arg, "%d:%d:%d%c", &repeat, &msec, &refresh, &tail);
+	if (n < 1 || n > 3) return -1;
+	if (repeat < 0 || msec < 0 || refresh < 0) return -1;
+	if (msec > 4000000 || refresh > 4000) return -1;
+	sched->repeat = repeat;
+	sched->interval_usec = msec * 1000;
+	sched->refresh_usec = USEC_FROM_SEC(refresh);
+	return 0;
+}
+
+//! @brief Parse a window in usec, as -W and -T take
+//! @param[in] arg The option argument
+//! @param[out] usec Where to store it
+//! @retval 0 Success
+//! @retval -1 Not a number from 0 to WINDOW_USEC_MAX
+int vrrp_parse_window(const char *arg, uint32_t *usec)
+{
+	int n;
+	char tail;
+
+	if (sscanf(arg, "%d%c", &n, &tail) != 1) return -1;
+	if (n < 0 || n > WINDOW_USEC_MAX) return -1;
+	*usec = n;
 	return 0;
 }
 
-//! @brief Initialize VRRP PID file and socket
+//! @brief Parse the VIPs of a virtual router
+//! @param[in,out] inst The virtual router, its VIP array is allocated
+//! @param[in] ifp The interface it runs on
+//! @param[in] argv The addresses, NULL terminated
+//! @param[in] allow_ipv6 Non-zero if the router may run over IPv6
+//! @note The first address tells if the router runs over IPv4 or IPv6,
+//!	and an address of the interface itself makes us the IP owner.
+//! @return The number of VIPs, -1 on failure
+int vrrp_parse_vaddrs(struct vrrp_inst *inst, struct vrrp_iface *ifp,
+	char **argv, int allow_ipv6)
+{
+	struct in_addr addr;
+	struct in6_addr addr6;
+	int n = 0;
+
+	while (argv[n]) ++n;
+	if (!n) return 0;
+	if (n > VADDR_MAX_NUM) {
+		VRRPLOG("Too many addresses %d, %d at most\n", n, VADDR_MAX_NUM);
+		return -1;
+	}
+
+	inst->use_ipv4 = !allow_ipv6 || inet_aton(argv[0], &addr);
+	if (inst->use_ipv4) {
+		inst->vaddrs = calloc(n, sizeof(*inst->vaddrs));
+	} else {
+		inst->vaddrs6 = calloc(n, sizeof(*inst->vaddrs6));
+	}
+	if (!inst->vaddrs && !inst->vaddrs6) {
+		VRRPLOG("alloc addresses:%s\n", strerror(errno));
+		return -1;
+	}
+
+	for (int i = 0; i < n; ++i) {
+		int use_ipv4 = 1;
+		if (!inet_aton(argv[i], &addr)) {
+			if (!allow_ipv6 ||
+				inet_pton(AF_INET6, argv[i], &addr6) != 1)
+			{
+				VRRPLOG("Invalid address:%s\n", argv[i]);
+				goto err;
+			}
+			use_ipv4 = 0;
+		}
+		if (inst->use_ipv4 != use_ipv4) {
+			VRRPLOG("Mixed IPv4 and IPv6 address:%s\n", argv[i]);
+			goto err;
+		}
+
+		if (use_ipv4) {
+			if (ifp->ipv4 == ntohl(addr.s_addr)) {
+				inst->priority = VRRP_PRIO_OWNER;
+			}
+			inst->vaddrs[i] = ntohl(addr.s_addr);
+		} else {
+			if (IN6_ARE_ADDR_EQUAL(&ifp->ipv6, &addr6)) {
+				inst->priority = VRRP_PRIO_OWNER;
+			}
+			inst->vaddrs6[i] = addr6;
+		}
+	}
+	inst->num_of_vaddr = n;
+
+	if (inst->use_ipv4 && !ifp->ipv4) {
+		VRRPLOG("%s has no IPv4 address\n", ifp->name);
+		goto err;
+	}
+	if (!inst->use_ipv4) {
+		if (IN6_IS_ADDR_UNSPECIFIED(&ifp->ipv6)) {
+			VRRPLOG("%s has no IPv6 link-local address\n",
+				ifp->name);
+			goto err;
+		}
+		inst->vmac[4] = 0x02;	// 00-00-5E-00-02-{VRID}
+	}
+	return n;
+err:
+	free(inst->vaddrs);
+	free(inst->vaddrs6);
+	inst->vaddrs = NULL;
+	inst->vaddrs6 = NULL;
+	inst->num_of_vaddr = 0;
+	return -1;
+}
+
+//! @brief Index the VIPs of every virtual router, for validating adverts
+//! @param[in] app The daemon-wide setting
+//! @retval 0 Success
+//! @retval -1 Failure, e.g. a router lists a VIP twice
+static int vip_index_open(struct vrrp_app *app)
+{
+	int total = 0;
+	for (int i = 0; i < app->num_of_inst; ++i) {
+		total += app->insts[i]->num_of_vaddr;
+	}
+	if (vip_index_init(&app->vip_index, total) < 0) {
+		VRRPLOG("alloc VIP index:%s\n", strerror(errno));
+		return -1;
+	}
+
+	for (int i = 0; i < app->num_of_inst; ++i) {
+		struct vrrp_inst *inst = app->insts[i];
+		for (int j = 0; j < inst->num_of_vaddr; ++j) {
+			struct vip_key key;
+			uint32_t nw_ipaddr = 0;
+			if (inst->use_ipv4) {
+				nw_ipaddr = htonl(inst->vaddrs[j]);
+				vip_key_set(&key, AF_INET, &nw_ipaddr,
+					inst->iface->idx, inst->vrid);
+			} else {
+				vip_key_set(&key, AF_INET6, &inst->vaddrs6[j],
+					inst->iface->idx, inst->vrid);
+			}
+			if (vip_index_add(&app->vip_index, &key, j)) {
+				INSTLOG(inst, "address %d is duplicated\n",
+					j + 1);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+//! @brief See if an advertisement carries the VIPs of a virtual router
+//! @param[in] app The daemon-wide setting
+//! @param[in] inst The virtual router
+//! @param[in] addrs The addresses in the advertisement, as many as
+//!	|inst| has (in network byteorder)
+//! @note The order does not matter, each VIP must be listed once.
+//! @return -1 if they match, else the position of the first address
+//!	that is not a VIP of |inst| or is listed again
+int vrrp_vaddrs_match(const struct vrrp_app *app,
+	const struct vrrp_inst *inst, const void *addrs)
+{
+	uint64_t seen[(VADDR_MAX_NUM + 64) / 64] = { 0 };
+	int family = inst->use_ipv4 ? AF_INET : AF_INET6;
+	int len = inst->use_ipv4 ? 4 : 16;
+
+	for (int i = 0; i < inst->num_of_vaddr; ++i) {
+		struct vip_key key;
+		vip_key_set(&key, family, (const uint8_t *)addrs + i * len,
+			inst->iface->idx, inst->vrid);
+		int pos = vip_index_find(&app->vip_index, &key);
+		if (pos < 0 || (seen[pos / 64] & (1ULL << (pos % 64)))) {
+			return i;
+		}
+		seen[pos / 64] |= 1ULL << (pos % 64);
+	}
+	return -1;
+}
+
+//! @brief Load virtual routers from a config file
+//! @param[in] path Full path to the config file
+//! @param[in] parse Called with the arguments of each line
+//! @note Each line holds the options of one virtual router, in the same
+//!	form as the command line. '#' starts a comment.
+//! @retval 0 Success
+//! @retval -1 Failure
+int vrrp_load_conf(const char *path, int (*parse)(int argc, char **argv))
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		VRRPLOG("open config %s:%s\n", path, strerror(errno));
+		return -1;
+	}
+
+	char line[CONF_LINE_LEN];
+	char *argv[CONF_ARGS_MAX + 1];
+	int lineno = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		++lineno;
+		if (!strchr(line, '\n') && !feof(fp)) {
+			VRRPLOG("%s:%d: line is too long\n", path, lineno);
+			goto err;
+		}
+		char *comment = strchr(line, '#');
+		if (comment) *comment = '\0';
+
+		int argc = 0;
+		argv[argc++] = "bxvrrpd";
+		for (char *tok = strtok(line, " \t\r\n"); tok; 
+			tok = strtok(NULL, " \t\r\n"))
+		{
+			if (argc == CONF_ARGS_MAX) {
+				VRRPLOG("%s:%d: too many arguments\n", path,
+					lineno);
+				goto err;
+			}
+			argv[argc++] = tok;
+		}
+		if (argc == 1) continue;
+		argv[argc] = NULL;
+
+		optind = 0;	// getopt starts over
+		if (parse(argc, argv) < 0) {
+			VRRPLOG("%s:%d: invalid virtual router\n", path, lineno);
+			goto err;
+		}
+	}
+	fclose(fp);
+	return 0;
+err:
+	fclose(fp);
+	return -1;
+}
+
+//! @brief Route changes are readable
+static void on_route_change(struct reactor_io *io, uint32_t events)
+{
+	struct rt_cache *routes = io->arg;
+	if (rt_cache_update(routes) < 0) {
+		VRRPLOG("Can't update routing table\n");
+	}
+}
+
+//! @brief Link changes are readable
+static void on_link_change(struct reactor_io *io, uint32_t events)
+{
+	if (ll_update() < 0) VRRPLOG("Can't update link table\n");
+}
+
+//! @brief Cache the routes of every interface carrying a VMAC itself,
+//!	they are put back after each MAC change
+static int routes_open(struct vrrp_app *app)
+{
+	app->routes = calloc(1, sizeof(*app->routes));
+	if (!app->routes) return -1;
+	for (int i = 0; i < app->num_of_iface; ++i) {
+		if (app->ifaces[i]->macvlan_mode) continue;
+		rt_cache_watch(app->routes, app->ifaces[i]->idx);
+	}
+	if (rt_cache_open(app->routes) < 0) {
+		VRRPLOG("Can't parse routing table\n");
+		return -1;
+	}
+
+	app->rt_io.fd = app->routes->rth.fd;
+	app->rt_io.cb = on_route_change;
+	app->rt_io.arg = app->routes;
+	return reactor_add_io(&app->loop, &app->rt_io, EPOLLIN);
+}
+
+//! @brief Initialize VRRP PID file, the event loop and the sockets of
+//!	every interface
 int vrrp_initialize(struct vrrp_app *app)
 {
 	// PID file
-	if (check_pidfile(app->pidfile, PIDFILE_LEN, app->if_name) < 0) {
+	const char *tag = app->pidtag;
+	if (1 == app->num_of_inst) tag = app->ifaces[0]->name;
+	if (check_pidfile(app->pidfile, PIDFILE_LEN, tag) < 0) {
 		return -1;
 	}
 
-	// Socket
-	if ((app->sock = open_adver_socket(app->if_ipv4)) < 0) return -1;
+	if (reactor_open(&app->loop) < 0) return -1;
+	if (vip_index_open(app) < 0) return -1;
+	if (app->stats_path &&
+		stats_open(&app->stats, &app->loop, app, app->stats_path) < 0)
+	{
+		return -1;
+	}
+
+	// Links are looked up in a table kept current by link changes
+	if ((app->ll_io.fd = ll_open()) < 0) {
+		VRRPLOG("Can't load link table\n");
+		return -1;
+	}
+	app->ll_io.cb = on_link_change;
+	if (reactor_add_io(&app->loop, &app->ll_io, EPOLLIN) < 0) return -1;
+
+	// An interface has one MAC, so one carrying more than one VRID puts
+	// each VMAC on a macvlan, and VRIDs never bounce each other's link
+	int iface_mode = 0;
+	for (int i = 0; i < app->num_of_iface; ++i) {
+		struct vrrp_iface *ifp = app->ifaces[i];
+		ifp->macvlan_mode = app->macvlan_mode;
+		if (!ifp->macvlan_mode && ifp->num_of_inst > 1) {
+			VRRPLOG("%s carries %d VRIDs, putting VMACs on macvlans\n",
+				ifp->name, ifp->num_of_inst);
+			ifp->macvlan_mode = MACVLAN_MODE_PRIVATE;
+		}
+		iface_mode |= !ifp->macvlan_mode;
+	}
+	if (iface_mode && routes_open(app) < 0) return -1;
+
+	for (int i = 0; i < app->num_of_iface; ++i) {
+		struct vrrp_iface *ifp = app->ifaces[i];
+
+		// Socket, one per address family the routers on it use
+		if (rxring_open(ifp) < 0) return -1;
+		if (ifp->num_of_inst > ifp->num_of_inst6) {
+			if ((ifp->sock = open_adver_socket(ifp)) < 0) return -1;
+			ifp->txq = txq_open(ifp, ifp->sock, AF_INET);
+			if (!ifp->txq) return -1;
+		}
+		if (ifp->num_of_inst6) {
+			if ((ifp->sock6 = open_adver_socket6(ifp)) < 0) return -1;
+			ifp->txq6 = txq_open(ifp, ifp->sock6, AF_INET6);
+			if (!ifp->txq6) return -1;
+		}
+		vrrp_iface_tx_window(ifp, app->tx_window_usec);
+		if (ifp->tx_window_usec < app->tx_window_usec) {
+			VRRPLOG("%s tx window cut to %u usec to fit the skews\n",
+				ifp->name, ifp->tx_window_usec);
+		}
+		reactor_timer_init(&app->loop, &ifp->tx_timer, on_tx_timer, ifp);
+		ifp->reconcile_window_usec = app->reconcile_window_usec;
+		reactor_timer_init(&app->loop, &ifp->reconcile_timer,
+			on_reconcile_timer, ifp);
+		if (vrrp_adver_filter(ifp) < 0) return -1;
+
+		// One macvlan per VRID, so transitions leave the link alone
+		ifp->routes = app->routes;
+		for (int v = 1; ifp->macvlan_mode && v <= VRID_MAX; ++v) {
+			struct vrrp_inst *inst = ifp->vrid_map[v];
+			if (!inst) continue;
+			snprintf(inst->mvl_name, IFNAMSIZ, "vrrp%d.%d",
+				ifp->idx, v);
+			inst->mvl_idx = macvlan_create(inst->mvl_name, ifp->idx,
+				inst->vmac, ifp->macvlan_mode);
+			if (inst->mvl_idx < 0) return -1;
+
+			// Only the macvlan answers ARP for the VIPs on it
+			if (inst->accept_mode && ifp->arp_ignore < 0 &&
+				0 == get_arp_ignore(ifp->name) &&
+				set_arp_ignore(ifp->name, 1) == 0)
+			{
+				ifp->arp_ignore = 0;
+			}
+		}
+
+		// We need to handle ARP. *sigh*
+		if (garp_open(&ifp->garp, &app->loop, ifp->idx,
+			&app->garp) < 0)
+		{
+			return -1;
+		}
+		if (arp_responder_open(&ifp->arp_resp, ifp->idx,
+			app->arp_workers, ifp->num_of_inst6 > 0) < 0)
+		{
+			return -1;
+		}
+	}
 
 	return 0;
 }
 
-extern struct vrrp_app app;
-//! @brief Sniffing ARP on assgined interface
-void* vrrp_arp_sniffer(void *arg)
-{
-	VRRPLOG("start sniffing\n");
-
-	int fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ARP));
-	assert(fd > 0);
-
-	struct sockaddr_ll recv;
-	memset(&recv, 0, sizeof(recv));
-	recv.sll_hatype = ARPOP_REQUEST;
-	recv.sll_pkttype = PACKET_OTHERHOST;
-
-	struct sockaddr_ll send;
-	memset(&send, 0, sizeof(send));
-	send.sll_family = AF_PACKET;
-	send.sll_ifindex = app.if_idx;
-	send.sll_halen = 6;
-	memcpy(send.sll_addr, app.vmac, 6);
-
-	socklen_t recvlen;
-	struct arppkt buff;
-	struct arppkt reply = {
-		.ethh = {
-			.h_dest = {0},
-			.h_source = {0},
-			.h_proto = htons(ETH_P_ARP),
-			},
-		.arph = {
-			.ar_hrd = htons(ARPHRD_ETHER),
-			.ar_pro = htons(ETH_P_IP),
-			.ar_hln = 6,
-			.ar_pln = 4,
-			.ar_op = htons(ARPOP_REPLY),
-			},
-		.sha = {0},
-		.sip = {0},
-		.dha = {0},
-		.dip = {0},
-	};
-	while (1) {
-		if (VRRP_MASTER != app.state) continue;
-		memset(&buff, 0, sizeof(buff));
-		if (recvfrom(fd, &buff, sizeof(buff), 0, 
-			(struct sockaddr *)&recv, &recvlen) < 0) 
-		{
-			VRRPLOG("recv arp:%s", strerror(errno));
-			close(fd);
-			break;
+//! @brief See if a VIP of a virtual router is the interface's own address
+static inline int vip_is_owned(const struct vrrp_inst *inst, int i)
+{
+	if (inst->use_ipv4) return inst->vaddrs[i] == inst->iface->ipv4;
+	return IN6_ARE_ADDR_EQUAL(&inst->vaddrs6[i], &inst->iface->ipv6);
+}
+
+//! @brief Let the ARP responder answer for VIPs of every master on the
+//!	interface, or put it to sleep if there is none, and have the
+//!	GARP engine announce them
+//! @param[in] ifp The interface
+//! @note Every VIP is answered and announced with the VMAC of its own
+//!	router. In macvlan mode it is announced only once its macvlan is up.
+//!	IPv6 VIPs are announced by unsolicited NA and solicitations for
+//!	them are answered the same way.
+int vrrp_arp_answer(struct vrrp_iface *ifp)
+{
+	static struct arp_resp_vip *vips, *garps;
+	static int cap;
+	int n = 0, m = 0, total = 0;
+
+	for (int v = 1; v <= VRID_MAX; ++v) {
+		if (ifp->vrid_map[v]) total += ifp->vrid_map[v]->num_of_vaddr;
+	}
+	if (total > cap) {
+		struct arp_resp_vip *p = realloc(vips, total * sizeof(*vips));
+		if (p) vips = p;
+		struct arp_resp_vip *q = realloc(garps, total * sizeof(*garps));
+		if (q) garps = q;
+		if (!p || !q) {
+			VRRPLOG("alloc VIPs of %s:%s\n", ifp->name,
+				strerror(errno));
+			return -1;
 		}
+		cap = total;
+	}
 
-		// Inspect
-		if (htons(ARPOP_REQUEST) != buff.arph.ar_op) continue;
-		for (int i = 0; i < app.num_of_vaddr; ++i) {
-			//uint32_t dip = *(uint32_t *)(buff.dip);
-			uint32_t dip = *(buff.dip);
-			if (app.if_ipv4 == dip) {
-				// Kernel will handle it
-				continue;
+	for (int v = 1; v <= VRID_MAX; ++v) {
+		struct vrrp_inst *inst = ifp->vrid_map[v];
+		if (!inst || VRRP_MASTER != inst->state) continue;
+		int announce = !ifp->macvlan_mode || inst->mvl_up > 0;
+		for (int i = 0; i < inst->num_of_vaddr; ++i) {
+			struct arp_resp_vip vip;
+			memset(&vip, 0, sizeof(vip));
+			if (inst->use_ipv4) {
+				vip.family = AF_INET;
+				vip.nw_ipaddr = htonl(inst->vaddrs[i]);
+			} else {
+				vip.family = AF_INET6;
+				memcpy(vip.addr6, &inst->vaddrs6[i], 16);
 			}
+			memcpy(vip.vmac, inst->vmac, MACSIZ);
 
-			if (dip != htonl(app.vaddrs[i])) continue;
-
-			// Reply it
-			memcpy(reply.ethh.h_dest, buff.sha, 6);
-			memcpy(reply.ethh.h_source, app.vmac, 6);
-			memcpy(reply.sha, app.vmac, 6);
-			memcpy(reply.sip, buff.dip, 4);
-			memcpy(reply.dha, buff.sha, 6);
-			memcpy(reply.dip, buff.sip, 4);
-			if (sendto(fd, &reply, sizeof(reply), 0, 
-				(struct sockaddr *)&send, sizeof(send)) < 0) 
-			{
-				VRRPLOG("reply arp:%s\n", strerror(errno));
+			if (announce) garps[m++] = vip;
+			// Kernel will handle it
+			if (vip_is_owned(inst, i)) continue;
+			if (inst->vip_up > 0) continue;
+			vips[n++] = vip;
+		}
+	}
+	garp_update(&ifp->garp, garps, m);
+	return arp_responder_update(&ifp->arp_resp, vips, n);
+}
+
+//! @brief Apply the state changes of an interface again a bit later,
+//!	the kernel refused some of them
+//! @param[in] ifp The interface
+static void iface_retry(struct vrrp_iface *ifp)
+{
+	if (!tw_pending(&ifp->reconcile_timer.tw)) {
+		reactor_timer_arm(&ifp->reconcile_timer, RECONCILE_RETRY_USEC);
+	}
+}
+
+//! @brief Bring the VIP addresses of accept mode masters on an interface
+//!	in line with their state
+//! @param[in] ifp The interface
+//! @note The VIPs of a master are added to the link carrying its VMAC, so
+//!	the kernel takes traffic for them and answers ARP. Every change
+//!	goes in one request batch, a router whose changes all went through
+//!	flips its |vip_up|. The others may have some of their VIPs on the
+//!	link, their |vip_up| becomes -1 so iface_retry() redoes them all
+//!	whichever state they are in then.
+static void vip_reconcile(struct vrrp_iface *ifp)
+{
+	struct vrrp_inst *changed[VRID_MAX];
+	int failed[VRID_MAX];
+	int n = 0;
+	for (int v = 1; v <= VRID_MAX; ++v) {
+		struct vrrp_inst *inst = ifp->vrid_map[v];
+		if (!inst || !inst->accept_mode) continue;
+		int up = (VRRP_MASTER == inst->state) &&
+			(!ifp->macvlan_mode || inst->mvl_up > 0);
+		if (up == inst->vip_up) continue;
+		int link = ifp->macvlan_mode ? inst->mvl_idx : ifp->idx;
+		failed[n] = 0;
+		for (int i = 0; i < inst->num_of_vaddr; ++i) {
+			// The owner keeps its address
+			if (vip_is_owned(inst, i)) continue;
+			int ret;
+			if (inst->use_ipv4) {
+				uint32_t nw_ipaddr = htonl(inst->vaddrs[i]);
+				ret = ipaddr_set(link, AF_INET, &nw_ipaddr, up,
+					&failed[n]);
+			} else {
+				ret = ipaddr_set(link, AF_INET6,
+					&inst->vaddrs6[i], up, &failed[n]);
 			}
+			if (ret < 0) failed[n] = 1;
 		}
+		changed[n++] = inst;
+	}
+	if (!n) return;
+	ipaddr_commit();
+
+	int retry = 0;
+	for (int i = 0; i < n; ++i) {
+		struct vrrp_inst *inst = changed[i];
+		int up = (VRRP_MASTER == inst->state) &&
+			(!ifp->macvlan_mode || inst->mvl_up > 0);
+		inst->vip_up = failed[i] ? -1 : up;
+		retry |= failed[i];
 	}
-	pthread_exit(0);
+	if (retry) iface_retry(ifp);
 }
 
-//! @brief Set interface MAC and promiscuous
-//! @param[in] ifname Which interface to set
-//! @param[in] mac MAC to set
-//! @param[in] flag For VRRP_MASTER ot VRRP_BACKUP
-int set_iface_hw(const char *ifname, const char *mac, enum vrrp_state flag)
+//! @brief Bring the macvlans of an interface in line with the virtual
+//!	routers on it, the interface itself is never touched
+//! @param[in] ifp The interface
+//! @note A macvlan is up while its virtual router is master, and its
+//!	VIPs are announced with its VMAC once it is up.
+//! @retval 0 Nothing came up
+//! @retval 1 Some macvlan came up
+static int macvlan_reconcile(struct vrrp_iface *ifp)
 {
-	struct rt_entry rt_table;
-	memset(&rt_table, 0, sizeof(struct rt_entry));
-	if (!rt_fetch(&rt_table)) VRRPLOG("Can't parse routing table\n");
+	struct vrrp_inst *changed[VRID_MAX];
+	int failed[VRID_MAX];
+	int n = 0;
+	for (int v = 1; v <= VRID_MAX; ++v) {
+		struct vrrp_inst *inst = ifp->vrid_map[v];
+		if (!inst) continue;
+		int up = (VRRP_MASTER == inst->state);
+		if (up == inst->mvl_up) continue;
+		failed[n] = 0;
+		if (macvlan_set_up(inst->mvl_idx, up, &failed[n]) < 0) {
+			failed[n] = 1;
+		}
+		changed[n++] = inst;
+	}
 
-	if (VRRP_MASTER == flag) {
-		set_hwaddr(ifname, mac, 6);
-		set_promiscuous(ifname);
-	} else {
-		assert(VRRP_BACKUP == flag);
-		unset_promiscuous(ifname);
-		set_hwaddr(ifname, mac, 6);
+	// The links flip in one request batch, one the kernel refused is
+	// in neither state as far as we know, and is tried again
+	if (n) macvlan_commit();
+	trace_mark(&ifp->failover, PHASE_MACVLAN);
+
+	int announced = 0, retry = 0;
+	for (int i = 0; i < n; ++i) {
+		struct vrrp_inst *inst = changed[i];
+		inst->mvl_up = failed[i] ? -1 : (VRRP_MASTER == inst->state);
+		announced |= inst->mvl_up > 0;
+		retry |= failed[i];
 	}
+	if (retry) iface_retry(ifp);
+	// Adverts held for the takeover leave by their macvlans, ahead of
+	// the GARPs
+	vrrp_tx_flush(ifp);
+	vip_reconcile(ifp);
+	trace_mark(&ifp->failover, PHASE_VIP);
+	vrrp_arp_answer(ifp);
+	trace_mark(&ifp->failover, PHASE_ANNOUNCE);
+	return announced;
+}
 
-	rt_restore(rt_table.next, ifname);
-	return 0;
+//! @brief Note that a virtual router on an interface changed state
+//! @param[in] ifp The interface
+//! @note Transitions within the reconcile window of the first one are
+//!	applied together, so routers of a dead master taking over at
+//!	once cost one link batch, address batch and GARP update between
+//!	them.
+//! @note Adverts are held until then, a retry of refused changes pending
+//!	is brought forward to the window so it holds them no longer.
+void vrrp_iface_changed(struct vrrp_iface *ifp)
+{
+	int first = !ifp->failover.pending_nsec;
+
+	if (first) ifp->failover.pending_nsec = now_nsec();
+	if (!ifp->reconcile_window_usec) {
+		vrrp_iface_reconcile(ifp);
+	} else if (first) {
+		reactor_timer_arm(&ifp->reconcile_timer,
+			ifp->reconcile_window_usec);
+	}
 }
 
-//! @brief Handling checksum
-//! @param[in] addr The word to add to accumulator
-//! @param[in] len  Indicate the length of |addr|
-//! @param[in] csum The accumulator
-//! @return The checksum value
-unsigned short in_cksum(unsigned short *addr, int len, unsigned short csum)
+//! @brief Bring interface MAC in line with the virtual routers on it
+//! @param[in] ifp The interface
+//! @note An interface with one VRID carries its VMAC while it is master,
+//!	one with more has a macvlan per VRID and keeps its own MAC.
+//! @note Each step is timed, see struct failover_stats.
+//! @retval 0 MAC unchanged
+//! @retval 1 MAC changed to a VMAC
+int vrrp_iface_reconcile(struct vrrp_iface *ifp)
 {
-	register int nleft = len;
-	const unsigned short *w = addr;
-	register unsigned short answer;
-	register int sum = csum;
+	int ret = 0, masters = 0;
+
+	reactor_timer_cancel(&ifp->reconcile_timer);
+	trace_begin(&ifp->failover);
 
-	while (nleft > 1)  {
-		sum += *w++;
-		nleft -= 2;
+	const char *mac = ifp->mac;
+	for (int v = 1; v <= VRID_MAX; ++v) {
+		struct vrrp_inst *inst = ifp->vrid_map[v];
+		if (!inst || VRRP_MASTER != inst->state) continue;
+		if (!masters++) mac = inst->vmac;
 	}
 
-	// mop up an odd byte, if necessary
-	if (nleft == 1) sum += htons(*(unsigned char *)w << 8);
-	
-	sum = (sum >> 16) + (sum & 0xffff);	// add hi 16 to low 16
-	sum += (sum >> 16); 			// add carry
-	answer = ~sum;				// truncate to 16 bits
-	return (answer);
+	if (ifp->macvlan_mode) {
+		ret = macvlan_reconcile(ifp);
+	} else {
+		int changed = memcmp(mac, ifp->cur_mac, MACSIZ) != 0;
+		if (changed) {
+			set_iface_hw(ifp, mac, 
+				mac == ifp->mac ? VRRP_BACKUP : VRRP_MASTER);
+			memcpy(ifp->cur_mac, mac, MACSIZ);
+		}
+		// Adverts held for the takeover carry the VMAC now
+		vrrp_tx_flush(ifp);
+		vip_reconcile(ifp);
+		trace_mark(&ifp->failover, PHASE_VIP);
+		vrrp_arp_answer(ifp);
+		trace_mark(&ifp->failover, PHASE_ANNOUNCE);
+		ret = changed && mac != ifp->mac;
+	}
+
+	trace_end(&ifp->failover, masters);
+	return ret;
+}
+
+//! @brief Keep frames for the own MAC of an interface coming while it
+//!	carries a VMAC, or stop taking them
+//! @param[in] ifp The interface
+//! @param[in] on 1 to take them, 0 to stop
+//! @note The own MAC goes into the unicast filter of the NIC as a
+//!	secondary address. Drivers without a unicast filter are put in
+//!	promiscuous mode by the kernel itself, we only do it when the
+//!	kernel refuses the address.
+//! @note Only an interface with a single VRID carries a VMAC itself. The
+//!	VMACs of an interface with more are filtered in by their macvlans,
+//!	the kernel adds each to the unicast filter of the interface while
+//!	its macvlan is up, that is while its router is master. A secondary
+//!	address of the interface itself would pass the NIC filter but not
+//!	the IP stack, which drops frames for another MAC than the link's.
+static void iface_accept_own_mac(struct vrrp_iface *ifp, int on)
+{
+	if (on && IFACE_UC_NONE == ifp->uc_state) {
+		if (ifp->uc_fd < 0) ifp->uc_fd = open_unicast_filter();
+		if (ifp->uc_fd >= 0 &&
+			add_unicast(ifp->uc_fd, ifp->idx, ifp->mac) == 0)
+		{
+			ifp->uc_state = IFACE_UC_FILTER;
+			return;
+		}
+		VRRPLOG("%s unicast filter:%s, going promiscuous\n",
+			ifp->name, strerror(errno));
+		set_promiscuous(ifp->name);
+		ifp->uc_state = IFACE_UC_PROMISC;
+	} else if (!on && IFACE_UC_FILTER == ifp->uc_state) {
+		del_unicast(ifp->uc_fd, ifp->idx, ifp->mac);
+		ifp->uc_state = IFACE_UC_NONE;
+	} else if (!on && IFACE_UC_PROMISC == ifp->uc_state) {
+		unset_promiscuous(ifp->name);
+		ifp->uc_state = IFACE_UC_NONE;
+	}
 }
 
+//! @brief Set interface MAC, and keep its own MAC in the unicast filter
+//! @param[in] ifp Which interface to set
+//! @param[in] mac MAC to set
+//! @param[in] flag For VRRP_MASTER ot VRRP_BACKUP
+//! @note Taking the link down drops its routes, they are put back from
+//!	the route cache. Pending route changes are applied first, the
+//!	drop itself is applied after the routes are back.
+int set_iface_hw(struct vrrp_iface *ifp, const char *mac,
+	enum vrrp_state flag)
+{
+	struct failover_stats *fs = &ifp->failover;
+
+	if (rt_cache_update(ifp->routes) < 0) {
+		VRRPLOG("Can't update routing table\n");
+	}
+	trace_mark(fs, PHASE_RT_FETCH);
+
+	if (VRRP_MASTER == flag) {
+		set_hwaddr(ifp->name, mac, 6);
+		trace_mark(fs, PHASE_HWADDR);
+		iface_accept_own_mac(ifp, 1);
+		trace_mark(fs, PHASE_OWN_MAC);
+	} else {
+		assert(VRRP_BACKUP == flag);
+		iface_accept_own_mac(ifp, 0);
+		trace_mark(fs, PHASE_OWN_MAC);
+		set_hwaddr(ifp->name, mac, 6);
+		trace_mark(fs, PHASE_HWADDR);
+	}
+
+	rt_cache_restore(ifp->routes, ifp->idx);
+	trace_mark(fs, PHASE_RT_RESTORE);
+	return 0;
+}
@@ -4,6 +4,13 @@
 #include <stdint.h>
 #include <syslog.h>
 #include <net/if.h>
+#include <netinet/in.h>
+#include "arp.h"
+#include "arp_responder.h"
+#include "reactor.h"
+#include "vip_index.h"
+#include "stats.h"
+#include "probes.h"
 
 // Protocal-level constants
 enum vrrp_state {
@@ -20,48 +27,158 @@ enum vrrp_state {
 #define VRRP_IP_TTL 		255
 #define VRRP_MCAST_ADDR_STR	"224.0.0.18"
 #define VRRP_MCAST_ADDR_NW	0x120000E0
+#define VRRP_MCAST6_ADDR_STR	"ff02::12"
 #define VRRP_AUTHEN_NO		0
 #define VRRP_AUTHEN_PW		1
 #define VRRP_AUTHEN_AH		2
 #define VRRP_ADVER_USEC_DFT 	1000000	//usec
 
 // Implementation-level constants
-#define OWNER_MAX_NUM 		16
-#define RECV_BUFSIZ 		128
+#define VADDR_MAX_NUM 		255	// the count field is one byte
+#define ADVER_MAX_LEN		(8 + VADDR_MAX_NUM * 16) // v3 over IPv6 is longest
+#define CACHELINE_SIZE		64
+#define VRID_MAX		255
+#define IFACE_MAX_NUM		64
+#define CONF_LINE_LEN		(VADDR_MAX_NUM * 40 + 1024) // IPv6 VIPs
+#define CONF_ARGS_MAX		(VADDR_MAX_NUM + 32)
+#define RECV_BUFSIZ 		(60 + ADVER_MAX_LEN) // longest IP header
+#define RECV_BATCH		32	// adverts taken per recvmmsg()
+#define RECV_CTRL_LEN		128	// PKTINFO, HOPLIMIT and SO_TIMESTAMPNS
+#define TX_BATCH		64	// adverts sent per sendmmsg()
+#define TX_WINDOW_USEC_DFT	200	// usec adverts wait for company
+#define TX_WINDOW_SKEW_DIV	4	// the window is at most this part of
+					// the smallest skew on the interface
+#define WINDOW_USEC_MAX		1000000	// -W and -T take up to a second
+#define RECONCILE_WINDOW_USEC_DFT 1000	// usec transitions wait for company
+#define RECONCILE_RETRY_USEC	100000	// usec before retrying refused changes
 #define PIDFILE_LEN		(IFNAMSIZ + 32) // full path
 #define PIDFILE_DIR		"/var/run"
 
 #define	HAS_IFNAME	1
 #define	HAS_VRID 	2
 #define	HAS_IP		4
+#define	HAS_CONF	8
 
 #define MACSIZ 			6
 
+// How an interface carrying a VMAC still takes frames for its own MAC
+#define IFACE_UC_NONE		0
+#define IFACE_UC_FILTER		1	// secondary address in the NIC filter
+#define IFACE_UC_PROMISC	2	// the filter is full or unsupported
+
+struct vrrp_inst;
+
+//! @brief A received advertisement
+struct vrrp_rx {
+	char 		*buff;		// IPv4 starts at the IP header, IPv6
+					// at the VRRP header
+	int 		len;
+	int 		ifindex;	// where it arrived, from *_PKTINFO
+	int 		hoplimit;	// IPv6 only, the IPv4 TTL is in |buff|
+	struct in6_addr src6;		// IPv6 only, the sender
+	uint64_t 	rx_nsec;	// when it arrived, on the now_nsec() clock
+};
+
+struct vrrp_rxring;
+struct vrrp_txq;
+struct rt_cache;
+
+//! @brief An interface shared by every virtual router running on it
+struct vrrp_iface {
+	char 		name[IFNAMSIZ];
+	int 		idx;
+	uint32_t 	ipv4;		// 0 if it has none
+	struct in6_addr ipv6;		// link-local, :: if it has none
+	char 		mac[MACSIZ];
+	char 		cur_mac[MACSIZ];	// MAC currently set on it
+	int 		uc_fd;		// keeps |mac| in the unicast filter
+	int 		uc_state;	// IFACE_UC_*
+	int 		sock;		// IPv4 adverts, -1 if no router uses it
+	struct reactor_io io;		// readable advertisement socket
+	int 		sock6;		// IPv6 adverts, -1 if no router uses it
+	struct reactor_io io6;
+	struct vrrp_rxring *rxring;	// buffers of the adverts in |rx|
+	struct vrrp_rx 	rx[RECV_BATCH];
+	struct vrrp_txq *txq;		// adverts waiting to be sent together
+	struct vrrp_txq *txq6;
+	struct reactor_timer tx_timer;	// flushes |txq| and |txq6|
+	uint32_t 	tx_window_usec;	// -W, cut to fit the skews of its routers
+	uint64_t 	tx_pkts;	// adverts sent
+	uint64_t 	tx_calls;	// syscalls they took
+	struct reactor_timer reconcile_timer;	// applies transitions together
+	uint32_t 	reconcile_window_usec;
+	int 		macvlan_mode;	// VMACs live on macvlans, 0 if not
+	int 		arp_ignore;	// to put back on shutdown, -1 if kept
+	struct rt_cache *routes;	// put back after a MAC change
+	int 		num_of_inst;
+	int 		num_of_inst6;	// of them over IPv6
+	struct vrrp_inst *vrid_map[VRID_MAX + 1];	// demux by VRID
+	struct arp_responder arp_resp;
+	struct garp_engine garp;	// announces VIPs of the masters on it
+	struct iface_stats stats;
+	struct failover_stats failover;	// timing of reconciles
+};
+
 //! @brief The setting of a VRRP virtual router
-struct vrrp_app {
-	int 		daemonize;
-	char		pidfile[PIDFILE_LEN];
-	int 		use_ipv4;
-	//
-	int 		sock;
+struct vrrp_inst {
+	struct vrrp_iface *iface;
+	int 		use_ipv4;	// 0 for IPv6, v3 only
 	int 		vrid;
 	char 		vmac[MACSIZ];
-	volatile int 	state;	// shared between two threads
+	int 		state;
 	int 		preempt_mode;
 	int 		accept_mode;		// v3
+	int 		vip_up;		// VIPs are addresses of the link,
+					// -1 if only some may be
 	int 		priority;
 	uint32_t	adver_usec;
 	uint32_t	mstr_adver_usec;
 	uint32_t	skew_usec;
 	uint32_t	mstr_down_usec;
-	uint32_t 	adver_timer;
-	uint32_t 	mstr_down_timer;
+	struct reactor_timer adver_timer;
+	struct reactor_timer mstr_down_timer;
 	int 		num_of_vaddr;
-	uint32_t 	vaddrs[OWNER_MAX_NUM];
-	char 		if_name[IFNAMSIZ];
-	int 		if_idx;
-	uint32_t 	if_ipv4;
-	char 		if_mac[MACSIZ];
+	uint32_t 	*vaddrs;	// in the order configured
+	struct in6_addr *vaddrs6;	// instead, if not |use_ipv4|
+
+	// The advertisement as sent, built again only when the VIP set or
+	// the interval changes
+	int 		adver_len;
+	int 		adver_prio;	// the priority |adver| carries
+	uint8_t 	adver[ADVER_MAX_LEN]
+		__attribute__((aligned(CACHELINE_SIZE)));
+
+	// The macvlan carrying the VMAC, up only while we are master
+	char 		mvl_name[IFNAMSIZ];
+	int 		mvl_idx;
+	int 		mvl_up;		// -1 if a change of it was refused
+
+	struct inst_stats stats;
+};
+
+//! @brief The daemon-wide setting, a table of virtual routers
+struct vrrp_app {
+	int 		daemonize;
+	char		pidfile[PIDFILE_LEN];
+	const char	*pidtag;	// PID file tag for multi-instance
+	int 		version;	// VRRP version we speak
+	int 		arp_workers;
+	uint32_t 	tx_window_usec;	// how long adverts wait to be batched
+	uint32_t 	reconcile_window_usec;	// how long transitions wait
+	struct garp_sched garp;		// gratuitous ARP repeats and pacing
+	int 		macvlan_mode;	// 0 to set the VMAC of an interface's
+					// only VRID on the interface itself
+	struct reactor	loop;
+	struct rt_cache *routes;	// routes of every interface
+	struct reactor_io rt_io;	// readable route changes
+	struct reactor_io ll_io;	// readable link changes
+	int 		num_of_iface;
+	struct vrrp_iface *ifaces[IFACE_MAX_NUM];
+	int 		num_of_inst;
+	struct vrrp_inst **insts;
+	struct vip_index vip_index;	// VIP of a router to its position
+	const char 	*stats_path;	// Unix socket serving the counters
+	struct stats_server stats;
 
 	// Functions
 	int (*parse_args)(int argc, char **argv);
@@ -73,22 +190,56 @@ struct vrrp_app {
 #else
 #define VRRPLOG(f, s...) syslog(LOG_ERR, f, ## s)
 #endif
+#define INSTLOG(inst, f, s...) \
+	VRRPLOG("%s/%d " f, (inst)->iface->name, (inst)->vrid, ## s)
+
+// Count an advertisement an interface dropped, |why| names the counter
+#define IFACE_DROP(ifp, vrid, why) do { \
+	++(ifp)->stats.rx_bad_##why; \
+	PROBE3(adver_drop, (ifp)->name, (vrid), #why); \
+} while (0)
+// Count an advertisement a virtual router dropped
+#define INST_DROP(inst) do { \
+	++(inst)->stats.rx_mismatch; \
+	PROBE3(adver_drop, (inst)->iface->name, (inst)->vrid, "mismatch"); \
+} while (0)
 
-uint32_t now_usec(void);
+uint64_t now_nsec(void);
+void set_clock_source(uint64_t (*src)(void));
 int check_pidfile(char *buff, size_t buffsiz, const char *tag);
-unsigned short in_cksum(unsigned short *addr, int len, unsigned short csum);
 
-void* vrrp_arp_sniffer(void *arg);
+struct vrrp_iface* vrrp_iface_get(struct vrrp_app *app, const char *ifname);
+struct vrrp_inst* vrrp_inst_new(struct vrrp_app *app,
+	const struct vrrp_inst *dft);
+int vrrp_inst_attach(struct vrrp_inst *inst, struct vrrp_iface *ifp);
+void vrrp_inst_transit(struct vrrp_inst *inst, enum vrrp_state state);
+int vrrp_parse_garp(const char *arg, struct garp_sched *sched);
+int vrrp_parse_window(const char *arg, uint32_t *usec);
+int vrrp_parse_vaddrs(struct vrrp_inst *inst, struct vrrp_iface *ifp,
+	char **argv, int allow_ipv6);
+int vrrp_vaddrs_match(const struct vrrp_app *app,
+	const struct vrrp_inst *inst, const void *addrs);
+int vrrp_load_conf(const char *path, int (*parse)(int argc, char **argv));
+int vrrp_arp_answer(struct vrrp_iface *ifp);
+int vrrp_adver_filter(struct vrrp_iface *ifp);
+int vrrp_recv_batch(struct vrrp_iface *ifp, int sock);
+int vrrp_send_adver(struct vrrp_inst *inst);
+void vrrp_iface_tx_window(struct vrrp_iface *ifp, uint32_t max_usec);
+uint64_t vrrp_adver_due(const struct vrrp_inst *inst);
+int vrrp_tx_flush(struct vrrp_iface *ifp);
 int vrrp_dump(struct vrrp_app *app);
 int vrrp_initialize(struct vrrp_app *app);
-int vrrp_shutdown(int sock, const char *pidfile);
-int vrrp_timer_fires(uint32_t value, uint32_t upbound);
-int set_iface_hw(const char *ifname, const char *mac, enum vrrp_state flag);
+int vrrp_shutdown(struct vrrp_app *app);
+int vrrp_iface_reconcile(struct vrrp_iface *ifp);
+void vrrp_iface_changed(struct vrrp_iface *ifp);
+int set_iface_hw(struct vrrp_iface *ifp, const char *mac,
+	enum vrrp_state flag);
 
 #define USEC_FROM_SEC(s) ((s) * 1000000)
 #define SEC_FROM_USEC(u) ((u) / 1000000)
 #define USEC_FROM_CSEC(c) ((c) * 10000)
 #define CSEC_FROM_USEC(u) ((u) / 10000)
-#define SET_TIME(usec)	(now_usec() + (usec))
+#define NSEC_FROM_SEC(s) ((s) * 1000000000ULL)
+#define NSEC_FROM_USEC(u) ((u) * 1000ULL)
 
 #endif //VRRP_COMMON_H
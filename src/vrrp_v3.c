@@ -4,13 +4,15 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
-#include <pthread.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <linux/ip.h>
-#include "vrrp_v3.h"
+#include <sys/epoll.h>
 #include "arp.h"
+#include "vrrp_v3.h"
 #include "ifconfig.h"
+#include "cksum.h"
+#include "macvlan.h"
 
 extern char *optarg;
 extern int optind, opterr, optopt;
@@ -18,12 +20,10 @@ extern int optind, opterr, optopt;
 static int parse_args(int argc, char **argv);
 static int state_machine(void);
 
-struct vrrp_app app = {
-	.daemonize = 		0,
-	.pidfile =		{0},
+//! @brief The setting a new virtual router starts from
+static const struct vrrp_inst inst_dft = {
+	.iface = 		NULL,
 	.use_ipv4 = 		1,
-	//
-	.sock = 		-1,
 	.vrid = 		-1,
 	.vmac = 		"\x00\x00\x5E\x00\x01\x00",
 	.state = 		VRRP_INIT,
@@ -34,30 +34,45 @@ struct vrrp_app app = {
 	.mstr_adver_usec = 	VRRP_ADVER_USEC_DFT,
 	.skew_usec = 		0,
 	.mstr_down_usec = 	0,
-	.adver_timer = 		0,
-	.mstr_down_timer =	0,
 	.num_of_vaddr =		0,
-	.vaddrs = 		{0},
-	.if_name = 		{0},
-	.if_idx = 		0,
-	.if_ipv4 = 		0,
-	.if_mac = 		{0},
+	.vaddrs = 		NULL,
+	.vaddrs6 = 		NULL,
+};
+
+struct vrrp_app app = {
+	.daemonize = 		0,
+	.pidfile =		{0},
+	.pidtag =		"v3",
+	.version =		VRRP_VERSION,
+	.arp_workers =		ARP_RESP_WORKER_DFT,
+	.tx_window_usec =	TX_WINDOW_USEC_DFT,
+	.reconcile_window_usec = RECONCILE_WINDOW_USEC_DFT,
+	.garp = {
+		.repeat =	GARP_REPEAT_DFT,
+		.interval_usec = GARP_INTERVAL_USEC_DFT,
+		.refresh_usec =	GARP_REFRESH_USEC_DFT,
+		.rate =		GARP_RATE_DFT,
+	},
+	.num_of_iface =		0,
+	.ifaces =		{0},
+	.num_of_inst =		0,
+	.insts =		NULL,
 	//
 	.parse_args = parse_args,
 	.state_machine = state_machine,
 };
-volatile int evt_shutdown = 0;
-static pthread_t sniff;
 
 //! @brief Caculate the length of VRRP payload (including the variable parts)
 //! @param[in] num_of_ip How many IP are included in
+//! @param[in] use_ipv4 0 if they are IPv6 addresses
 //! @return The number of bytes of VRRP payload
-static inline unsigned long adver_len(int num_of_ip)
+static inline unsigned long adver_len(int num_of_ip, int use_ipv4)
 {
-	return sizeof(struct vrrphdr_v3) + (num_of_ip * sizeof(uint32_t));
+	return sizeof(struct vrrphdr_v3) + (num_of_ip *
+		(use_ipv4 ? sizeof(uint32_t) : sizeof(struct in6_addr)));
 }
 
-//! @brief Add a pseudo header to calculate checksum
+//! @brief Calculate checksum including the IPv4 pseudo header
 //! @param[in] data Data
 //! @param[in] datalen Length of |data|
 //! @param[in] n_saddr Source address in network byteorder
@@ -68,259 +83,366 @@ static unsigned short vrrp_cksum_ipv4(
 	uint32_t n_saddr, 
 	uint32_t n_daddr)
 {
-	int bufflen = sizeof(struct pseudohdr_ipv4) + datalen;
-	char *buff = malloc(bufflen);
-	assert(buff != NULL);
-	struct pseudohdr_ipv4 *ps = (struct pseudohdr_ipv4 *)buff;
-	ps->saddr = n_saddr;
-	ps->daddr = n_daddr;
-	ps->zero = 0;
-	ps->protocol = 112;
-	ps->upper_len = htons(datalen);
-
-	struct vrrphdr_v3 *vrrp = (struct vrrphdr_v3 *)(ps + 1);
-	memcpy(vrrp, data, datalen);
-	unsigned short ret = in_cksum((unsigned short *)buff, bufflen, 0);
-	free(buff);
-	return ret;
+	struct pseudohdr_ipv4 ps = {
+		.saddr = n_saddr,
+		.daddr = n_daddr,
+		.zero = 0,
+		.protocol = IPPROTO_VRRP,
+		.upper_len = htons(datalen),
+	};
+	struct cksum_vec vec[] = {
+		{ &ps, sizeof(ps) },
+		{ data, datalen },
+	};
+	return in_cksumv(vec, 2);
+}
+
+//! @brief Build the advertisement image of a virtual router
+//! @param[in] inst The virtual router
+//! @note Call it again whenever the VIP set, the interval or the source
+//!	address changes. The kernel checksums IPv6 adverts itself.
+static void build_adver(struct vrrp_inst *inst)
+{
+	struct vrrphdr_v3 *vrrp = (struct vrrphdr_v3 *)inst->adver;
+	uint32_t *vaddrs = (uint32_t *)(vrrp + 1);
+
+	inst->adver_len = adver_len(inst->num_of_vaddr, inst->use_ipv4);
+	inst->adver_prio = inst->priority;
+	vrrp->vers_type = (VRRP_VERSION << 4) | VRRP_PKT_ADVER;
+	vrrp->vrid = inst->vrid;
+	vrrp->priority = inst->priority;
+	vrrp->num_of_vaddr = inst->num_of_vaddr;
+	vrrp->max_adver_csec = htons(CSEC_FROM_USEC(inst->adver_usec));
+	vrrp->chksum = 0;
+	if (!inst->use_ipv4) {
+		memcpy(vaddrs, inst->vaddrs6,
+			inst->num_of_vaddr * sizeof(struct in6_addr));
+		return;
+	}
+	for (int i = 0; i < inst->num_of_vaddr; i++) {
+		vaddrs[i] = htonl(inst->vaddrs[i]);
+	}
+	vrrp->chksum = vrrp_cksum_ipv4((char *)vrrp, inst->adver_len,
+		htonl(inst->iface->ipv4), VRRP_MCAST_ADDR_NW);
 }
 
 //! @brief Send an advertisement packet
+//! @param[in] inst The virtual router
 //! @param[in] prio The priority od this advertisement
-static int send_adver(int prio)
+static int send_adver(struct vrrp_inst *inst, int prio)
 {
-	//FIXME IPv6 is not yet implemented
+	struct vrrphdr_v3 *vrrp = (struct vrrphdr_v3 *)inst->adver;
+
+	// Only the priority differs between adverts, patch it in place
+	if (prio != inst->adver_prio) {
+		uint16_t old_word, new_word;
+		memcpy(&old_word, &vrrp->priority, sizeof(old_word));
+		vrrp->priority = prio;
+		memcpy(&new_word, &vrrp->priority, sizeof(new_word));
+		if (inst->use_ipv4) {
+			vrrp->chksum = cksum_adjust(vrrp->chksum, old_word,
+				new_word);
+		}
+		inst->adver_prio = prio;
+	}
 
-	size_t bufflen = adver_len(app.num_of_vaddr);
-	char *buff = malloc(bufflen);
-	assert(buff != NULL);
+	// Goes out with whatever else the interface sends in the window
+	return vrrp_send_adver(inst);
+}
 
-	struct vrrphdr_v3 *vrrp = (struct vrrphdr_v3 *)buff;
-	uint32_t *vaddrs = (uint32_t *)(vrrp + 1);
-	
-	// Generate
-	vrrp->vers_type = (VRRP_VERSION << 4) | VRRP_PKT_ADVER;
-	vrrp->vrid = app.vrid;
-	vrrp->priority = prio;
-	vrrp->num_of_vaddr = app.num_of_vaddr;
-	vrrp->max_adver_csec = htons(CSEC_FROM_USEC(app.adver_usec));
-	for (int i = 0; i < app.num_of_vaddr; i++) {
-		vaddrs[i] = htonl(app.vaddrs[i]);
+//! @brief Find the virtual router an advertisement is for
+//! @param[in] ifp The interface it arrived on
+//! @param[in] vrrp The advertisement, its length is already checked
+//! @param[in] use_ipv4 0 if it arrived over IPv6
+//! @return The virtual router, NULL if it is not for one of ours
+static struct vrrp_inst* adver_inst(struct vrrp_iface *ifp,
+	const struct vrrphdr_v3 *vrrp, int use_ipv4)
+{
+	struct vrrp_inst *inst = ifp->vrid_map[vrrp->vrid];
+	if (!inst || inst->use_ipv4 != use_ipv4) {
+		// The socket filter drops these, uncounted
+		PROBE3(adver_drop, ifp->name, vrrp->vrid, "vrid");
+		VRRPLOG("invalid vrid %d\n", vrrp->vrid);
+		return NULL;
 	}
-	vrrp->chksum = 0;
-	vrrp->chksum = vrrp_cksum_ipv4(buff, bufflen, htonl(app.if_ipv4), 
-		VRRP_MCAST_ADDR_NW);
-
-	// Send
-	struct sockaddr_in dst;
-	memset(&dst, 0, sizeof(dst));
-	dst.sin_family = PF_INET;
-	dst.sin_addr.s_addr = VRRP_MCAST_ADDR_NW;
-	int ret = sendto(app.sock, buff, bufflen, 0,
-		(struct sockaddr *)&dst, sizeof(struct sockaddr));
-	if (ret < 0) {
-		VRRPLOG("send adver:%s\n", strerror(errno));
+
+	/* optional */
+	if (vrrp->num_of_vaddr != inst->num_of_vaddr) {
+		INST_DROP(inst);
+		INSTLOG(inst, "vaddr count missmatched %d\n",
+			vrrp->num_of_vaddr);
+		return NULL;
 	}
-	
-	free(buff);
-	return 0;
+	int i = vrrp_vaddrs_match(&app, inst, vrrp + 1);
+	if (i < 0) return inst;
+	INST_DROP(inst);
+	if (!use_ipv4) {
+		char buf[INET6_ADDRSTRLEN];
+		INSTLOG(inst, "vaddr missmatched %s\n", inet_ntop(AF_INET6,
+			(const struct in6_addr *)(vrrp + 1) + i, buf, sizeof(buf)));
+	} else {
+		INSTLOG(inst, "vaddr missmatched %#x\n",
+			ntohl(((const uint32_t *)(vrrp + 1))[i]));
+	}
+	return NULL;
 }
 
-//! @brief Receive and check the advertisement packet
-//! @param[out] buff Where to store received data
-//! @param[in]	bufsiz Size of |buff|
-static int recv_adver(char *buff, size_t bufsiz)
+//! @brief Receive and check an advertisement packet on an interface
+//! @param[in] ifp The interface which is readable
+//! @param[in] rx The received packet, from the IP header on
+//! @param[out] adver Where to store the VRRP header inside |rx|
+//! @return The virtual router it is for, NULL if it is invalid
+static struct vrrp_inst* recv_adver(struct vrrp_iface *ifp,
+	const struct vrrp_rx *rx, struct vrrphdr_v3 **adver)
 {
-	//FIXME IPv6 is not yet implemented
-
-	uint32_t next = 0xFFFFFFFF;
-	int32_t delta = -1;
-	if (app.adver_timer) {
-		delta = (int32_t)(app.adver_timer - now_usec());
-	} else {  // mstr_down_timer
-		assert(app.mstr_down_timer);
-		delta = (int32_t)(app.mstr_down_timer - now_usec());
+	char *buff = rx->buff;
+	int len = rx->len;
+	if (len < (int)sizeof(struct iphdr)) return NULL;
+	if (rx->ifindex != ifp->idx) return NULL;
+
+	struct iphdr *ip = (struct iphdr *)buff;
+	int iplen = ip->ihl << 2;
+	if (len < iplen + (int)sizeof(struct vrrphdr_v3)) {
+		IFACE_DROP(ifp, -1, len);
+		VRRPLOG("packet is too short\n");
+		return NULL;
 	}
-	if (delta < 0) delta = 0;
-	next = (next < delta) ? next : delta;
-	
-	fd_set readfds;
-	FD_ZERO(&readfds);
-	FD_SET(app.sock, &readfds);
-	struct timeval timeout = {
-		.tv_sec = next / 1000000,
-		.tv_usec = next % 1000000,
-	};
+	struct vrrphdr_v3 *vrrp = (struct vrrphdr_v3 *)(buff + iplen);
+	int vrrplen = adver_len(vrrp->num_of_vaddr, 1);
 
-	int vrrplen = adver_len(app.num_of_vaddr);
-	int len = select((app.sock) + 1, &readfds, NULL, NULL, &timeout);
-	if (len > 0) {
-		read(app.sock, buff, RECV_BUFSIZ);
-		struct iphdr *ip = (struct iphdr *)buff;
-		struct vrrphdr_v3 *vrrp = (struct vrrphdr_v3 *)(ip + 1);
-		
-		if (ip->ttl != VRRP_IP_TTL) {
-			VRRPLOG("wrong ttl %d\n", ip->ttl);
-			goto err;
-		}
-		if ((vrrp->vers_type >> 4) != VRRP_VERSION)  {
-			VRRPLOG("wrong version %d\n", vrrp->vers_type >> 4);
-			goto err;
-		}
-		if ((ntohs(ip->tot_len) - ip->ihl) < vrrplen) {
-			VRRPLOG("packet is too short\n");
-			goto err;
-		}
-		if (vrrp_cksum_ipv4((char *)vrrp, vrrplen, ip->saddr, 
-			ip->daddr)) 
-		{
-			VRRPLOG("invalid checksum\n");
-			goto err;
-		}
-		if (vrrp->vrid != app.vrid) {
-			VRRPLOG("invalid vrid %d\n", vrrp->vrid);
-			goto err;
-		}
+	if (ip->ttl != VRRP_IP_TTL) {
+		IFACE_DROP(ifp, vrrp->vrid, ttl);
+		VRRPLOG("wrong ttl %d\n", ip->ttl);
+		return NULL;
+	}
+	if ((vrrp->vers_type >> 4) != VRRP_VERSION)  {
+		IFACE_DROP(ifp, vrrp->vrid, version);
+		VRRPLOG("wrong version %d\n", vrrp->vers_type >> 4);
+		return NULL;
+	}
+	if (len - iplen < vrrplen) {
+		IFACE_DROP(ifp, vrrp->vrid, len);
+		VRRPLOG("packet is too short\n");
+		return NULL;
+	}
+	if (vrrp_cksum_ipv4((char *)vrrp, vrrplen, ip->saddr, ip->daddr)) {
+		IFACE_DROP(ifp, vrrp->vrid, cksum);
+		VRRPLOG("invalid checksum\n");
+		return NULL;
+	}
 
-		/* optional */
-		uint32_t *nw_vaddrs = (uint32_t *)(vrrp + 1);
-		for (int i = 0; i < vrrp->num_of_vaddr; ++i) {
-			if (ntohl(nw_vaddrs[i]) != app.vaddrs[i]) {
-				VRRPLOG("vaddr missmatched %#x\n", 
-					ntohl(nw_vaddrs[i]));
-				goto err;
-			}
-		}
-		return len;
+	struct vrrp_inst *inst = adver_inst(ifp, vrrp, 1);
+	if (inst) *adver = vrrp;
+	return inst;
+}
+
+//! @brief Receive and check an IPv6 advertisement packet on an interface
+//! @param[in] ifp The interface which is readable
+//! @param[in] rx The received packet, from the VRRP header on
+//! @param[out] adver Where to store the VRRP header inside |rx|
+//! @note The kernel already dropped it if the checksum was wrong.
+//! @return The virtual router it is for, NULL if it is invalid
+static struct vrrp_inst* recv_adver6(struct vrrp_iface *ifp,
+	const struct vrrp_rx *rx, struct vrrphdr_v3 **adver)
+{
+	int len = rx->len;
+	if (rx->ifindex != ifp->idx) return NULL;
+	if (len < (int)sizeof(struct vrrphdr_v3)) {
+		IFACE_DROP(ifp, -1, len);
+		VRRPLOG("packet is too short\n");
+		return NULL;
 	}
+	struct vrrphdr_v3 *vrrp = (struct vrrphdr_v3 *)rx->buff;
 
-err:
-	return -1;
+	if (rx->hoplimit != VRRP_IP_TTL) {
+		IFACE_DROP(ifp, vrrp->vrid, ttl);
+		VRRPLOG("wrong hop limit %d\n", rx->hoplimit);
+		return NULL;
+	}
+	if ((vrrp->vers_type >> 4) != VRRP_VERSION)  {
+		IFACE_DROP(ifp, vrrp->vrid, version);
+		VRRPLOG("wrong version %d\n", vrrp->vers_type >> 4);
+		return NULL;
+	}
+	if (len < (int)adver_len(vrrp->num_of_vaddr, 0)) {
+		IFACE_DROP(ifp, vrrp->vrid, len);
+		VRRPLOG("packet is too short\n");
+		return NULL;
+	}
+
+	struct vrrp_inst *inst = adver_inst(ifp, vrrp, 0);
+	if (inst) *adver = vrrp;
+	return inst;
 }
 
 //! @brief Transition to VRRP backup state
-static int become_backup(void)
+static int become_backup(struct vrrp_inst *inst)
 {
-	app.adver_timer = 0;
-	app.mstr_down_timer = SET_TIME(app.mstr_down_usec);
-	app.state = VRRP_BACKUP;
+	reactor_timer_cancel(&inst->adver_timer);
+	reactor_timer_arm(&inst->mstr_down_timer, inst->mstr_down_usec);
+	vrrp_inst_transit(inst, VRRP_BACKUP);
+	// Give up VMAC if nobody else on the interface needs it
+	vrrp_iface_changed(inst->iface);
 	return 0;
 }
 
 //! @brief Transition to VRRP master state
-static int become_master(void)
+static int become_master(struct vrrp_inst *inst)
 {
-	// Set VMAC
-	set_iface_hw(app.if_name, app.vmac, VRRP_MASTER);
-
-	if (app.use_ipv4) {
-		send_adver(app.priority);
-		for (int i = 0; i < app.num_of_vaddr; ++i) {
-			send_garp_request(app.if_idx, app.vmac, app.vaddrs[i]);
-		}	
-	} else { // IPv6
-		//FIXME Not yet implemented
-	}
-	app.adver_timer = SET_TIME(app.adver_usec);
-	app.mstr_down_timer = 0;
-	app.state = VRRP_MASTER;
+	struct vrrp_iface *ifp = inst->iface;
+
+	// Set VMAC, the VIPs are announced by the GARP engine
+	vrrp_inst_transit(inst, VRRP_MASTER);
+	vrrp_iface_changed(ifp);
+
+	send_adver(inst, inst->priority);
+	reactor_timer_arm_at(&inst->adver_timer, vrrp_adver_due(inst));
+	reactor_timer_cancel(&inst->mstr_down_timer);
 	return 0;
 }
 
-static inline uint32_t GEN_SKEW_USEC(void)
+static inline uint32_t GEN_SKEW_USEC(struct vrrp_inst *inst)
 {
-	return ((256 - app.priority) * app.mstr_adver_usec / 256);
+	return ((256 - inst->priority) * inst->mstr_adver_usec / 256);
 }
 
-static inline uint32_t GEN_MSTR_DOWN_USEC(void)
+static inline uint32_t GEN_MSTR_DOWN_USEC(struct vrrp_inst *inst)
 {
-	return (3 * app.mstr_adver_usec + app.skew_usec);
+	return (3 * inst->mstr_adver_usec + inst->skew_usec);
 }
 
-static inline int BACKUP_REGEN_INTERVALS(uint32_t new_adver_csec)
+static inline int BACKUP_REGEN_INTERVALS(struct vrrp_inst *inst,
+	uint32_t new_adver_csec)
 {		
-	app.mstr_adver_usec = USEC_FROM_CSEC(new_adver_csec);
-	app.skew_usec = GEN_SKEW_USEC();
-	app.mstr_down_usec = GEN_MSTR_DOWN_USEC();
+	uint32_t skew_usec = inst->skew_usec;
+
+	inst->mstr_adver_usec = USEC_FROM_CSEC(new_adver_csec);
+	inst->skew_usec = GEN_SKEW_USEC(inst);
+	inst->mstr_down_usec = GEN_MSTR_DOWN_USEC(inst);
+	// The master sets the interval, and with it our skew
+	if (skew_usec != inst->skew_usec) {
+		vrrp_iface_tx_window(inst->iface, app.tx_window_usec);
+	}
 	return 0;
 }
 
-//! @brief Implement the behavir of VRRP master state
-static int run_as_master(void)
+//! @brief See if the sender of an advertisement has a higher primary
+//!	address than ours, which wins a priority tie
+static int sender_is_higher(const struct vrrp_inst *inst,
+	const struct vrrp_rx *rx)
 {
-	//FIXME IPv4 and acceptio mode are not yet implemented
-	if (evt_shutdown) {
-		set_iface_hw(app.if_name, app.if_mac, VRRP_BACKUP);
-		//XXX: directly exit program is much simpler
-		send_adver(VRRP_PRIO_SHUTDOWN);
-		vrrp_shutdown(app.sock, app.pidfile);
-		exit(0);
-	}
-	
-	if (vrrp_timer_fires(app.adver_timer, app.adver_usec)) {
-		send_adver(app.priority);
-		app.adver_timer = SET_TIME(app.adver_usec);
-		return 0;
+	if (!inst->use_ipv4) {
+		return memcmp(&rx->src6, &inst->iface->ipv6,
+			sizeof(rx->src6)) > 0;
 	}
+	const struct iphdr *ip = (const struct iphdr *)rx->buff;
+	return ntohl(ip->saddr) > inst->iface->ipv4;
+}
 
-	char buff[RECV_BUFSIZ] = {0};
-	int ret = recv_adver(buff, RECV_BUFSIZ);
-	if (ret > 0) {
-		struct iphdr *ip = (struct iphdr *)buff;
-		struct vrrphdr_v3 *adver = (struct vrrphdr_v3 *)(ip + 1);
-		if (VRRP_PRIO_SHUTDOWN == adver->priority) {
-			VRRPLOG("MASTER shutdown\n");
-			send_adver(app.priority);
-			app.adver_timer = SET_TIME(app.adver_usec);
-		} else if (adver->priority > app.priority ||
-			(adver->priority == app.priority &&
-			ntohl(ip->saddr) > app.if_ipv4))
-		{
-			set_iface_hw(app.if_name, app.if_mac, VRRP_BACKUP);
-			BACKUP_REGEN_INTERVALS(ntohs(adver->max_adver_csec));	
-			become_backup();
-			VRRPLOG("MASTER to BACKUP\n");
-		} else {
-			//DISCARD
-		}
+//! @brief Implement the behavir of VRRP master state on an advertisement
+static int run_as_master(struct vrrp_inst *inst, const struct vrrp_rx *rx,
+	struct vrrphdr_v3 *adver)
+{
+	if (VRRP_PRIO_SHUTDOWN == adver->priority) {
+		INSTLOG(inst, "MASTER shutdown\n");
+		send_adver(inst, inst->priority);
+		reactor_timer_arm_at(&inst->adver_timer,
+			vrrp_adver_due(inst));
+	} else if (adver->priority > inst->priority ||
+		(adver->priority == inst->priority &&
+		sender_is_higher(inst, rx)))
+	{
+		BACKUP_REGEN_INTERVALS(inst, ntohs(adver->max_adver_csec));
+		become_backup(inst);
+		INSTLOG(inst, "MASTER to BACKUP\n");
+	} else {
+		//DISCARD
 	}
 	return 0;
 }
 
-//! @brief Implement the behavir of VRRP backup state
-static int run_as_backup(void)
+//! @brief Implement the behavir of VRRP backup state on an advertisement
+static int run_as_backup(struct vrrp_inst *inst, const struct vrrp_rx *rx,
+	struct vrrphdr_v3 *adver)
 {
-	if (evt_shutdown) {
-		// Directly shutdown 
-		vrrp_shutdown(app.sock, app.pidfile);
-		exit(0);
-	}
-	
-	if (vrrp_timer_fires(app.mstr_down_timer, app.mstr_down_usec)) {
-		become_master();
-		VRRPLOG("BACKUP to MASTER\n");
-		return 0;
+	uint64_t rx_nsec = rx->rx_nsec;
+
+	if (VRRP_PRIO_SHUTDOWN == adver->priority) {
+		INSTLOG(inst, "MASTER shutdown\n");
+		reactor_timer_arm_at(&inst->mstr_down_timer,
+			rx_nsec + NSEC_FROM_USEC(inst->skew_usec));
+	} else if (0 == inst->preempt_mode ||
+		adver->priority >= inst->priority)
+	{
+		BACKUP_REGEN_INTERVALS(inst, ntohs(adver->max_adver_csec));
+		// Count from the arrival, not from when we got to it
+		reactor_timer_arm_at(&inst->mstr_down_timer,
+			rx_nsec + NSEC_FROM_USEC(inst->mstr_down_usec));
+	} else {
+		// Discard it
 	}
+	return 0;
+}
 
-	char buff[RECV_BUFSIZ] = {0};
-	int ret = recv_adver(buff, RECV_BUFSIZ);
-	if (ret > 0) {
-		struct iphdr *ip = (struct iphdr *)buff;
-		struct vrrphdr_v3 *adver = (struct vrrphdr_v3 *)(ip + 1);
-		if (VRRP_PRIO_SHUTDOWN == adver->priority) {
-			VRRPLOG("MASTER shutdown\n");
-			app.mstr_down_timer = SET_TIME(app.skew_usec);
-		} else if (0 == app.preempt_mode || 
-			adver->priority >= app.priority)
-		{
-			BACKUP_REGEN_INTERVALS(ntohs(adver->max_adver_csec));	
-			app.mstr_down_timer = SET_TIME(app.mstr_down_usec);
-		} else {
-			// Discard it
+//! @brief Advertisement timer of a master fires
+static void on_adver_timer(struct reactor_timer *t)
+{
+	struct vrrp_inst *inst = t->arg;
+	send_adver(inst, inst->priority);
+	reactor_timer_arm_at(&inst->adver_timer, vrrp_adver_due(inst));
+}
+
+//! @brief Master down timer of a backup fires
+static void on_mstr_down_timer(struct reactor_timer *t)
+{
+	struct vrrp_inst *inst = t->arg;
+	become_master(inst);
+	INSTLOG(inst, "BACKUP to MASTER\n");
+}
+
+//! @brief An advertisement socket, IPv4 or IPv6, is readable
+static void on_adver(struct reactor_io *io, uint32_t events)
+{
+	struct vrrp_iface *ifp = io->arg;
+	int ipv6 = (io == &ifp->io6);
+	int n;
+
+	// Drain it in batches, a full batch means there may be more
+	do {
+		n = vrrp_recv_batch(ifp, io->fd);
+		for (int i = 0; i < n; ++i) {
+			struct vrrp_rx *rx = &ifp->rx[i];
+			struct vrrphdr_v3 *adver = NULL;
+			struct vrrp_inst *inst = ipv6 ?
+				recv_adver6(ifp, rx, &adver) :
+				recv_adver(ifp, rx, &adver);
+			if (!inst) continue;
+			stats_rx(&inst->stats, rx->rx_nsec, adver->priority);
+			PROBE4(adver_rx, ifp->name, inst->vrid,
+				adver->priority, inst->state);
+			if (VRRP_MASTER == inst->state) {
+				run_as_master(inst, rx, adver);
+			} else {
+				run_as_backup(inst, rx, adver);
+			}
 		}
-	}
+	} while (RECV_BATCH == n);
+}
 
-	return 0;
+//! @brief Give up every virtual router we are master of
+static void release_all(void)
+{
+	for (int i = 0; i < app.num_of_inst; ++i) {
+		struct vrrp_inst *inst = app.insts[i];
+		if (VRRP_MASTER != inst->state) continue;
+		// Directly shutdown
+		send_adver(inst, VRRP_PRIO_SHUTDOWN);
+		vrrp_inst_transit(inst, VRRP_BACKUP);
+	}
+	for (int i = 0; i < app.num_of_iface; ++i) {
+		vrrp_tx_flush(app.ifaces[i]);
+		vrrp_iface_reconcile(app.ifaces[i]);
+	}
 }
 
 //! @brief Print usage
@@ -329,32 +451,62 @@ static int usage(void)
 	printf(
 "bxvrrpd3 version 0.1 (implementation of RFC 5798)\n"
 "Usage: bxvrrpd3 -i ifname -v vrid [OPTIONS] ipaddr\n"
+"       bxvrrpd3 -f config [OPTIONS]\n"
 "	-d, --daemonize  : Run as daemon\n"
+"	-f, --config     : Load virtual routers from file, one per line\n"
 "	-i, --ifname     : the LAN interface name to run on\n"
 "	-v, --vrid       : the id of the virtual server [1-255]\n"
 "	-n, --no-preempt : Set non-preempt mode (dfl: preemptible)\n"
+"	-a, --accept     : Set accept mode, the VIPs are added to the link\n"
+"	                   while master (dfl: not accept)\n"
 "	-p, --prio       : Set local priority (dfl: 100)\n"
 "	-I, --interval   : Set advertisement interval (in csec) (dfl: 100)\n"
+"	-w, --arp-workers: Number of ARP responder threads (dfl: 1)\n"
+"	-W, --tx-window  : Usecs adverts wait to be sent together, at most a\n"
+"	                   quarter of the smallest skew (dfl: 200)\n"
+"	-T, --flip-window: Usecs state changes on an interface wait to be\n"
+"	                   applied together (dfl: 1000)\n"
+"	-m, --macvlan    : Put each VMAC on a macvlan (private|bridge) instead\n"
+"	                   of on the interface itself, an interface with more\n"
+"	                   than one VRID always does (dfl: private)\n"
+"	-g, --garp       : Gratuitous ARP schedule REPEAT[:MSEC[:REFRESH]],\n"
+"	                   REPEAT rounds MSEC apart for new VIPs, then every\n"
+"	                   REFRESH secs while master (dfl: 5:100:0, 0 never)\n"
+"	-G, --garp-rate  : Gratuitous ARPs sent per sec at most (dfl: 10000)\n"
+"	-s, --stats      : Serve counters in Prometheus text format on this\n"
+"	                   Unix socket, one scrape per connection\n"
 "	-h, --help       : help message\n"
 "	    --verbose    : (No implementation)\n"
-"	ipaddr   : the ip address(es) of the virtual server\n");
+"	ipaddr   : the ip address(es) of the virtual server, all IPv4\n"
+"	           or all IPv6\n");
 	return 0;
 }
 
-//! @brief Parse command-line options
+//! @brief Parse the options of a virtual router, or of the daemon
 //! @param[in] argc The argument count
 //! @param[in] argv The argument array
+//! @param[in] top Non-zero for the command line, which may also carry
+//!	daemon-wide options
 //! @retval 0 Success
 //! @retval -1 Invalid arguments
-static int parse_args(int argc, char **argv)
+static int parse_inst(int argc, char **argv, int top)
 {
 	struct option longopts[] = {
 		{"daemonize",	0, 0, 'd'},
+		{"config",	1, 0, 'f'},
 		{"ifname", 	1, 0, 'i'},
 		{"vrid", 	1, 0, 'v'},
 		{"no-preempt", 	0, 0, 'n'},
+		{"accept", 	0, 0, 'a'},
 		{"prioity", 	1, 0, 'p'},
 		{"interval", 	1, 0, 'I'},
+		{"arp-workers",	1, 0, 'w'},
+		{"tx-window",	1, 0, 'W'},
+		{"flip-window",	1, 0, 'T'},
+		{"macvlan",	1, 0, 'm'},
+		{"garp",	1, 0, 'g'},
+		{"garp-rate",	1, 0, 'G'},
+		{"stats",	1, 0, 's'},
 		{"help", 	0, 0, 'h'},
 		{"verbose", 	0, 0, 'h'},
 		{0,0,0,0}
@@ -362,42 +514,91 @@ static int parse_args(int argc, char **argv)
 	int opt_idx = 0;
 	int c = EOF;
 	int input_check = 0;
+	struct vrrp_inst inst = inst_dft;
+	char ifname[IFNAMSIZ] = {0};
+	char *conf = NULL;
 
 	while (1) {
-		c = getopt_long(argc, argv, "h?di:v:np:I:", longopts, &opt_idx);
+		c = getopt_long(argc, argv, "h?df:i:v:nap:I:w:W:T:m:g:G:s:", longopts,
+			&opt_idx);
 		if (EOF == c) break;
+		if (!top && strchr("dfwWTmgGs", c)) {
+			VRRPLOG("-%c is not allowed in config\n", c);
+			goto err;
+		}
 		switch (c) {
 		case 'd':
 			app.daemonize = 1;
 			break;
+		case 'f':
+			conf = optarg;
+			input_check |= HAS_CONF;
+			break;
 		case 'i':
-			snprintf(app.if_name, IFNAMSIZ, "%s", optarg);
+			snprintf(ifname, IFNAMSIZ, "%s", optarg);
 			input_check |= HAS_IFNAME;
-			if ((get_hwaddr(app.if_name, app.if_mac) < 0) ||
-			 (get_ipaddr(app.if_name, &app.if_ipv4) < 0))
-			{
-				VRRPLOG("Get interface address failed\n");
-				goto err;
-			}
-			app.if_idx = if_nametoindex(app.if_name);
-			if (app.if_idx == 0) {
-				VRRPLOG("Get interface index failed\n");
-				goto err;
-			}
 			break;
 		case 'v':
-			app.vrid = atoi(optarg);
-			app.vmac[5] = app.vrid;
+			inst.vrid = atoi(optarg);
+			if (inst.vrid < 1 || inst.vrid > VRID_MAX) {
+				VRRPLOG("Invalid VRID %s\n", optarg);
+				goto err;
+			}
+			inst.vmac[5] = inst.vrid;
 			input_check |= HAS_VRID;
 			break;
 		case 'n':
-			app.preempt_mode = 0;
+			inst.preempt_mode = 0;
+			break;
+		case 'a':
+			inst.accept_mode = 1;
 			break;
 		case 'p':
-			app.priority = atoi(optarg);
+			inst.priority = atoi(optarg);
 			break;
-		case 'I': 
-			app.adver_usec = USEC_FROM_CSEC(atoi(optarg));
+		case 'I':
+			inst.adver_usec = USEC_FROM_CSEC(atoi(optarg));
+			break;
+		case 'w':
+			app.arp_workers = atoi(optarg);
+			break;
+		case 'W':
+			if (vrrp_parse_window(optarg, &app.tx_window_usec) < 0) {
+				VRRPLOG("Invalid tx window %s\n", optarg);
+				goto err;
+			}
+			break;
+		case 'T':
+			if (vrrp_parse_window(optarg, &app.reconcile_window_usec) < 0) {
+				VRRPLOG("Invalid flip window %s\n", optarg);
+				goto err;
+			}
+			break;
+		case 'm':
+			if (!strcmp(optarg, "private")) {
+				app.macvlan_mode = MACVLAN_MODE_PRIVATE;
+			} else if (!strcmp(optarg, "bridge")) {
+				app.macvlan_mode = MACVLAN_MODE_BRIDGE;
+			} else {
+				VRRPLOG("Invalid macvlan mode %s\n", optarg);
+				goto err;
+			}
+			break;
+		case 'g':
+			if (vrrp_parse_garp(optarg, &app.garp) < 0) {
+				VRRPLOG("Invalid garp schedule %s\n", optarg);
+				goto err;
+			}
+			break;
+		case 'G':
+			app.garp.rate = atoi(optarg);
+			if ((int)app.garp.rate < 1) {
+				VRRPLOG("Invalid garp rate %s\n", optarg);
+				goto err;
+			}
+			break;
+		case 's':
+			app.stats_path = optarg;
 			break;
 		case ':':
 		case '?':
@@ -407,6 +608,13 @@ static int parse_args(int argc, char **argv)
 			goto err;
 		}
 	}
+
+	// A config file may carry every virtual router
+	if ((input_check & HAS_CONF) && !(input_check & HAS_IFNAME) &&
+		!(input_check & HAS_VRID) && !argv[optind])
+	{
+		goto conf;
+	}
 	if (!(input_check & HAS_IFNAME)) {
 		VRRPLOG("Missing interface name\n");
 		goto err;
@@ -415,70 +623,106 @@ static int parse_args(int argc, char **argv)
 		VRRPLOG("Missing VRID\n");
 		goto err;
 	}
-
-	// Add ip(s) associated to virtual router and
-	// 1. Check if it is the IP owner.
-	// 2. If it is IP owner, set the order.
-	for (int i = optind; argv[i]; i++) {
-		struct in_addr addr;
-		if (!inet_aton(argv[i], &addr)) {
-			VRRPLOG("Invalid address:%s\n", argv[i]);
-			goto err;
-		}
-
-		if (app.if_ipv4 == ntohl(addr.s_addr)) {
-			app.priority = VRRP_PRIO_OWNER;
-		}
-
-		app.vaddrs[app.num_of_vaddr] = ntohl(addr.s_addr);
-		++app.num_of_vaddr;
-		input_check |= HAS_IP;
-	}
-	if (!(input_check & HAS_IP)) {
+	struct vrrp_iface *ifp = vrrp_iface_get(&app, ifname);
+	if (!ifp) goto err;
+
+	// Add ip(s) associated to virtual router, an address of the
+	// interface makes it the IP owner. The first address tells if the
+	// router runs over IPv4 or IPv6.
+	int n = vrrp_parse_vaddrs(&inst, ifp, &argv[optind], 1);
+	if (n < 0) goto err;
+	if (!n) {
 		VRRPLOG("Missing ip of virtual router\n");
 		goto err;
 	}
-	app.mstr_adver_usec = app.adver_usec;
-	app.skew_usec = GEN_SKEW_USEC();
-	app.mstr_down_usec = GEN_MSTR_DOWN_USEC();
+	inst.mstr_adver_usec = inst.adver_usec;
+	inst.skew_usec = GEN_SKEW_USEC(&inst);
+	inst.mstr_down_usec = GEN_MSTR_DOWN_USEC(&inst);
+
+	struct vrrp_inst *p = vrrp_inst_new(&app, &inst);
+	if (!p) {
+		free(inst.vaddrs);
+		free(inst.vaddrs6);
+		goto err;
+	}
+	if (vrrp_inst_attach(p, ifp) < 0) goto err;
 
+conf:
+	if (conf && vrrp_load_conf(conf, app.parse_args) < 0) goto err;
 	return 0;
 err:
 	return -1;
 }
 
-int state_machine(void)
+//! @brief Parse command-line options, or one line of the config file
+//! @param[in] argc The argument count
+//! @param[in] argv The argument array
+//! @retval 0 Success
+//! @retval -1 Invalid arguments
+static int parse_args(int argc, char **argv)
 {
-	// We need to handle ARP. *sigh*
-	pthread_create(&sniff, NULL, vrrp_arp_sniffer, NULL);
-	pthread_detach(sniff);
+	static int parsed_top = 0;
+	int top = !parsed_top;
+	parsed_top = 1;
+
+	if (parse_inst(argc, argv, top) < 0) return -1;
+	if (top && !app.num_of_inst) {
+		VRRPLOG("Missing virtual router\n");
+		return -1;
+	}
+	return 0;
+}
 
-	// State machine
-	while (1) {
-		switch (app.state) {
-		case VRRP_INIT:
-			//run_as_init();
-			if (VRRP_PRIO_OWNER == app.priority) {
-				become_master();
-				VRRPLOG("INIT to MASTER\n");
-			} else {
-				become_backup();
-				VRRPLOG("INIT to BACKUP\n");
-			}
-			break;
-		case VRRP_MASTER:
-			run_as_master();
-			break;
-		case VRRP_BACKUP:
-			run_as_backup();
-			break;
-		default:
-			VRRPLOG("unknown VRRP state\n");
+static int state_machine(void)
+{
+	// Sockets and timers are registered once
+	for (int i = 0; i < app.num_of_iface; ++i) {
+		struct vrrp_iface *ifp = app.ifaces[i];
+		ifp->io.fd = ifp->sock;
+		ifp->io.cb = on_adver;
+		ifp->io.arg = ifp;
+		if (ifp->sock >= 0 &&
+			reactor_add_io(&app.loop, &ifp->io, EPOLLIN) < 0)
+		{
+			return -1;
+		}
+		ifp->io6.fd = ifp->sock6;
+		ifp->io6.cb = on_adver;
+		ifp->io6.arg = ifp;
+		if (ifp->sock6 >= 0 &&
+			reactor_add_io(&app.loop, &ifp->io6, EPOLLIN) < 0)
+		{
+			return -1;
+		}
+	}
+	for (int i = 0; i < app.num_of_inst; ++i) {
+		struct vrrp_inst *inst = app.insts[i];
+		build_adver(inst);
+		if (reactor_timer_init(&app.loop, &inst->adver_timer,
+			on_adver_timer, inst) < 0 ||
+			reactor_timer_init(&app.loop, &inst->mstr_down_timer,
+			on_mstr_down_timer, inst) < 0)
+		{
 			return -1;
 		}
 	}
 
-	return 0;
-}
+	for (int i = 0; i < app.num_of_inst; ++i) {
+		struct vrrp_inst *inst = app.insts[i];
+		//run_as_init();
+		if (VRRP_PRIO_OWNER == inst->priority) {
+			become_master(inst);
+			INSTLOG(inst, "INIT to MASTER\n");
+		} else {
+			become_backup(inst);
+			INSTLOG(inst, "INIT to BACKUP\n");
+		}
+	}
 
+	// One loop drives every virtual router
+	if (reactor_run(&app.loop) < 0) return -1;
 
+	release_all();
+	vrrp_shutdown(&app);
+	return 0;
+}
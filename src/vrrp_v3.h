@@ -13,7 +13,7 @@ struct vrrphdr_v3 {
 	uint8_t 	num_of_vaddr;
 	uint16_t 	max_adver_csec; // The first 4 bits are reserved
 	uint16_t 	chksum;
-	// Append ip addresses (4 bytes*n)
+	// Append ip addresses (4 bytes*n, or 16 bytes*n over IPv6)
 };
 
 /*struct pseudohdr_ipv4 {